@@ -0,0 +1,198 @@
+// Header-only reader for the CSR companion files written by
+// `update_hic_header export-csr`.
+//
+// A .csr file holds selected resolutions of a .hic as uncompressed CSR
+// matrices, one per chromosome pair and resolution, plus normalization
+// vectors. It is meant to be memory-mapped and scanned in place:
+//
+//   hic_csr::File f;
+//   if (!f.open("map.csr")) ...;
+//   const hic_csr::MatrixEntry* m = f.find(1, 1, 10000);
+//   const int64_t* rowPtr = f.rowPtr(*m);
+//   const int32_t* cols = f.colIdx(*m);
+//   const float* counts = f.counts(*m);
+//   for (int64_t r = 0; r < m->nRows; r++)
+//       for (int64_t k = rowPtr[r]; k < rowPtr[r + 1]; k++)
+//           use(r, cols[k], counts[k]);
+//
+// Rows are bins of chr1 and columns bins of chr2 (chr1 <= chr2). Intra-
+// chromosomal matrices keep the .hic convention of storing only the upper
+// triangle (row <= column).
+//
+// On-disk layout, little-endian, every section starting on a 64-byte
+// boundary:
+//   FileHeader
+//   Chromosome[nChromosomes], then the chromosome name bytes
+//   per matrix: int64 rowPtr[nRows + 1], int32 colIdx[nnz], float counts[nnz]
+//   per norm vector: double values[nValues]
+//   MatrixEntry[nMatrices] (sorted by chr1, chr2, unit, binSize)
+//   NormEntry[nNorms]
+
+#ifndef HIC_CSR_H
+#define HIC_CSR_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace hic_csr {
+
+static const char MAGIC[8] = {'H', 'I', 'C', 'C', 'S', 'R', '1', '\0'};
+static const uint32_t FORMAT_VERSION = 1;
+static const uint64_t ALIGN = 64;
+
+enum Unit : int32_t { BP = 0, FRAG = 1 };
+
+struct FileHeader {
+    char magic[8];
+    uint32_t formatVersion;
+    uint32_t hicVersion;                  // version of the source .hic
+    uint32_t nChromosomes;
+    uint32_t nMatrices;
+    uint32_t nNorms;
+    uint32_t reserved0;
+    uint64_t chromosomeOffset;
+    uint64_t matrixDirOffset;
+    uint64_t normDirOffset;
+    uint64_t reserved1;
+};
+
+struct Chromosome {
+    int64_t length;
+    uint64_t nameOffset;
+    uint32_t nameLength;
+    uint32_t reserved;
+};
+
+struct MatrixEntry {
+    int32_t chr1, chr2, binSize, unit;
+    int64_t nRows, nCols, nnz;
+    uint64_t rowPtrOffset, colIdxOffset, countsOffset;
+};
+
+struct NormEntry {
+    char type[32];                        // NUL-padded, e.g. "KR", "SCALE"
+    int32_t chrIdx, binSize, unit, reserved;
+    int64_t nValues;
+    uint64_t offset;
+};
+
+static_assert(sizeof(FileHeader) == 64, "FileHeader layout");
+static_assert(sizeof(MatrixEntry) == 64, "MatrixEntry layout");
+static_assert(sizeof(NormEntry) == 64, "NormEntry layout");
+
+inline uint64_t alignUp(uint64_t v) { return (v + ALIGN - 1) & ~(ALIGN - 1); }
+
+class File {
+public:
+    File() : base_(nullptr), size_(0), hdr_(nullptr) {}
+    ~File() { close(); }
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+
+    bool open(const std::string& path) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(FileHeader)) { ::close(fd); return false; }
+        void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        base_ = (const char*)p;
+        size_ = (size_t)st.st_size;
+        hdr_ = (const FileHeader*)base_;
+        if (std::memcmp(hdr_->magic, MAGIC, 8) != 0 || hdr_->formatVersion != FORMAT_VERSION ||
+            !inBounds(hdr_->chromosomeOffset, hdr_->nChromosomes * sizeof(Chromosome)) ||
+            !inBounds(hdr_->matrixDirOffset, hdr_->nMatrices * sizeof(MatrixEntry)) ||
+            !inBounds(hdr_->normDirOffset, hdr_->nNorms * sizeof(NormEntry))) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (base_) munmap((void*)base_, size_);
+        base_ = nullptr;
+        size_ = 0;
+        hdr_ = nullptr;
+    }
+
+    const FileHeader& header() const { return *hdr_; }
+
+    uint32_t chromosomeCount() const { return hdr_->nChromosomes; }
+    const Chromosome& chromosome(uint32_t i) const {
+        return ((const Chromosome*)(base_ + hdr_->chromosomeOffset))[i];
+    }
+    std::string chromosomeName(uint32_t i) const {
+        const Chromosome& c = chromosome(i);
+        return std::string(base_ + c.nameOffset, c.nameLength);
+    }
+
+    uint32_t matrixCount() const { return hdr_->nMatrices; }
+    const MatrixEntry& matrix(uint32_t i) const {
+        return ((const MatrixEntry*)(base_ + hdr_->matrixDirOffset))[i];
+    }
+
+    // Binary search of the sorted directory; nullptr if absent.
+    const MatrixEntry* find(int32_t chr1, int32_t chr2, int32_t binSize, int32_t unit = BP) const {
+        uint32_t lo = 0, hi = hdr_->nMatrices;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            const MatrixEntry& m = matrix(mid);
+            if (less(m, chr1, chr2, unit, binSize)) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == hdr_->nMatrices) return nullptr;
+        const MatrixEntry& m = matrix(lo);
+        if (m.chr1 != chr1 || m.chr2 != chr2 || m.unit != unit || m.binSize != binSize) return nullptr;
+        return &m;
+    }
+
+    const int64_t* rowPtr(const MatrixEntry& m) const { return (const int64_t*)(base_ + m.rowPtrOffset); }
+    const int32_t* colIdx(const MatrixEntry& m) const { return (const int32_t*)(base_ + m.colIdxOffset); }
+    const float* counts(const MatrixEntry& m) const { return (const float*)(base_ + m.countsOffset); }
+
+    uint32_t normCount() const { return hdr_->nNorms; }
+    const NormEntry& norm(uint32_t i) const {
+        return ((const NormEntry*)(base_ + hdr_->normDirOffset))[i];
+    }
+
+    // Normalization vector values, or nullptr if absent; NaN marks bins
+    // without a value, as in the source .hic.
+    const double* normValues(const std::string& type, int32_t chrIdx, int32_t binSize,
+                             int64_t* nValues = nullptr, int32_t unit = BP) const {
+        for (uint32_t i = 0; i < hdr_->nNorms; i++) {
+            const NormEntry& e = norm(i);
+            if (e.chrIdx == chrIdx && e.binSize == binSize && e.unit == unit &&
+                type == std::string(e.type, strnlen(e.type, sizeof(e.type)))) {
+                if (nValues) *nValues = e.nValues;
+                return (const double*)(base_ + e.offset);
+            }
+        }
+        return nullptr;
+    }
+
+private:
+    bool inBounds(uint64_t off, uint64_t len) const { return off <= size_ && len <= size_ - off; }
+
+    static bool less(const MatrixEntry& m, int32_t chr1, int32_t chr2, int32_t unit, int32_t binSize) {
+        if (m.chr1 != chr1) return m.chr1 < chr1;
+        if (m.chr2 != chr2) return m.chr2 < chr2;
+        if (m.unit != unit) return m.unit < unit;
+        return m.binSize < binSize;
+    }
+
+    const char* base_;
+    size_t size_;
+    const FileHeader* hdr_;
+};
+
+} // namespace hic_csr
+
+#endif // HIC_CSR_H
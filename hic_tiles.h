@@ -0,0 +1,240 @@
+// Header-only reader for the tile pyramids written by
+// `update_hic_header export-tiles`.
+//
+// A .tiles file holds selected bp resolutions of a .hic as dense, already
+// normalized square tiles, so a tile server answers each request with one
+// pread and no decoding:
+//
+//   hic_tiles::File f;
+//   if (!f.open("map.tiles")) ...;
+//   std::vector<float> cells(f.tileCells());
+//   if (f.readTile(1, 1, 10000, row, col, cells.data())) ...;
+//
+// Tile (row, col) of chromosome pair chr1 <= chr2 at a level covers bins
+// [row * tileSize, (row + 1) * tileSize) of chr1 and the same span of
+// columns of chr2, row-major. Intra-chromosomal pairs store only tiles with
+// row <= col (diagonal tiles are filled symmetrically); readTile transposes
+// for row > col. Tiles without contacts are not stored and read as zeros.
+// Contacts whose normalization is undefined (a zero or NaN factor) are
+// dropped, as query and straw drop them, so their cells read as zero.
+//
+// On-disk layout, little-endian, every section starting on a 64-byte
+// boundary:
+//   FileHeader
+//   Chromosome[nChromosomes], then the chromosome name bytes
+//   tile payloads: tileSize * tileSize cells of float16 or float32
+//   int32 levels[nLevels] (bin sizes, finest first)
+//   TileEntry[nTiles] (sorted by chr1, chr2, binSize, row, col)
+
+#ifndef HIC_TILES_H
+#define HIC_TILES_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace hic_tiles {
+
+static const char MAGIC[8] = {'H', 'I', 'C', 'T', 'I', 'L', 'E', '\0'};
+static const uint32_t FORMAT_VERSION = 1;
+static const uint64_t ALIGN = 64;
+
+enum CellType : uint32_t { FLOAT16 = 0, FLOAT32 = 1 };
+
+struct FileHeader {
+    char magic[8];
+    uint32_t formatVersion;
+    uint32_t hicVersion;                  // version of the source .hic
+    uint32_t nChromosomes;
+    uint32_t nLevels;
+    uint32_t tileSize;                    // cells per side
+    uint32_t cellType;                    // CellType
+    uint64_t nTiles;
+    uint64_t chromosomeOffset;
+    uint64_t levelOffset;
+    uint64_t tileDirOffset;
+    char norm[32];                        // NUL-padded, "NONE" for raw counts
+    uint64_t reserved[4];
+};
+
+struct Chromosome {
+    int64_t length;
+    uint64_t nameOffset;
+    uint32_t nameLength;
+    uint32_t reserved;
+};
+
+struct TileEntry {
+    int32_t chr1, chr2, binSize;
+    int32_t row, col;
+    uint32_t reserved;
+    uint64_t offset;
+};
+
+static_assert(sizeof(FileHeader) == 128, "FileHeader layout");
+static_assert(sizeof(TileEntry) == 32, "TileEntry layout");
+
+inline uint64_t alignUp(uint64_t v) { return (v + ALIGN - 1) & ~(ALIGN - 1); }
+
+// IEEE 754 binary16 to binary32.
+inline float halfToFloat(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    int32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    float f;
+    if (exp == 0) f = std::ldexp((float)mant, -24);
+    else if (exp == 31) f = mant ? NAN : INFINITY;
+    else f = std::ldexp((float)(mant | 0x400), exp - 25);
+    uint32_t bits;
+    std::memcpy(&bits, &f, 4);
+    bits |= sign;
+    std::memcpy(&f, &bits, 4);
+    return f;
+}
+
+class File {
+public:
+    File() : fd_(-1), size_(0) {}
+    ~File() { close(); }
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+
+    // Reads the header and directories; tiles are read on demand.
+    bool open(const std::string& path) {
+        close();
+        fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_ < 0) return false;
+        struct stat st;
+        if (fstat(fd_, &st) != 0 || !readAt(&hdr_, sizeof(hdr_), 0) ||
+            std::memcmp(hdr_.magic, MAGIC, 8) != 0 || hdr_.formatVersion != FORMAT_VERSION ||
+            hdr_.tileSize == 0 || hdr_.cellType > FLOAT32) {
+            close();
+            return false;
+        }
+        size_ = (uint64_t)st.st_size;
+        chroms_.resize(hdr_.nChromosomes);
+        levels_.resize(hdr_.nLevels);
+        tiles_.resize(hdr_.nTiles);
+        if (!inBounds(hdr_.chromosomeOffset, chroms_.size() * sizeof(Chromosome)) ||
+            !inBounds(hdr_.levelOffset, levels_.size() * sizeof(int32_t)) ||
+            !inBounds(hdr_.tileDirOffset, tiles_.size() * sizeof(TileEntry)) ||
+            !readAt(chroms_.data(), chroms_.size() * sizeof(Chromosome), hdr_.chromosomeOffset) ||
+            !readAt(levels_.data(), levels_.size() * sizeof(int32_t), hdr_.levelOffset) ||
+            !readAt(tiles_.data(), tiles_.size() * sizeof(TileEntry), hdr_.tileDirOffset)) {
+            close();
+            return false;
+        }
+        names_.resize(hdr_.nChromosomes);
+        for (uint32_t i = 0; i < hdr_.nChromosomes; i++) {
+            names_[i].resize(chroms_[i].nameLength);
+            if (!inBounds(chroms_[i].nameOffset, chroms_[i].nameLength) ||
+                !readAt(&names_[i][0], chroms_[i].nameLength, chroms_[i].nameOffset)) {
+                close();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void close() {
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+        chroms_.clear();
+        names_.clear();
+        levels_.clear();
+        tiles_.clear();
+    }
+
+    const FileHeader& header() const { return hdr_; }
+    uint32_t tileSize() const { return hdr_.tileSize; }
+    size_t tileCells() const { return (size_t)hdr_.tileSize * hdr_.tileSize; }
+    size_t tileBytes() const { return tileCells() * (hdr_.cellType == FLOAT16 ? 2 : 4); }
+
+    uint32_t chromosomeCount() const { return hdr_.nChromosomes; }
+    const Chromosome& chromosome(uint32_t i) const { return chroms_[i]; }
+    const std::string& chromosomeName(uint32_t i) const { return names_[i]; }
+    const std::vector<int32_t>& levels() const { return levels_; }
+
+    // Binary search of the sorted directory; nullptr for an empty tile.
+    const TileEntry* find(int32_t chr1, int32_t chr2, int32_t binSize, int32_t row, int32_t col) const {
+        TileEntry key = {chr1, chr2, binSize, row, col, 0, 0};
+        size_t lo = 0, hi = tiles_.size();
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (less(tiles_[mid], key)) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo == tiles_.size() || less(key, tiles_[lo])) return nullptr;
+        return &tiles_[lo];
+    }
+
+    // Fills tileCells() floats. Returns false only on I/O error.
+    bool readTile(int32_t chr1, int32_t chr2, int32_t binSize, int32_t row, int32_t col, float* out) const {
+        bool transpose = false;
+        if (chr1 > chr2 || (chr1 == chr2 && row > col)) {
+            std::swap(chr1, chr2);
+            std::swap(row, col);
+            transpose = true;
+        }
+        const TileEntry* e = find(chr1, chr2, binSize, row, col);
+        size_t n = tileCells(), t = hdr_.tileSize;
+        if (!e) {
+            std::fill(out, out + n, 0.0f);
+            return true;
+        }
+        std::vector<char> buf(tileBytes());
+        if (!readAt(buf.data(), buf.size(), e->offset)) return false;
+        for (size_t i = 0; i < n; i++) {
+            size_t at = transpose ? (i % t) * t + i / t : i;
+            if (hdr_.cellType == FLOAT16) {
+                uint16_t h;
+                std::memcpy(&h, buf.data() + 2 * i, 2);
+                out[at] = halfToFloat(h);
+            } else {
+                std::memcpy(&out[at], buf.data() + 4 * i, 4);
+            }
+        }
+        return true;
+    }
+
+private:
+    bool inBounds(uint64_t off, uint64_t len) const { return off <= size_ && len <= size_ - off; }
+
+    bool readAt(void* p, size_t n, uint64_t off) const {
+        char* c = (char*)p;
+        while (n > 0) {
+            ssize_t r = pread(fd_, c, n, (off_t)off);
+            if (r <= 0) return false;
+            c += r;
+            n -= (size_t)r;
+            off += (uint64_t)r;
+        }
+        return true;
+    }
+
+    static bool less(const TileEntry& a, const TileEntry& b) {
+        if (a.chr1 != b.chr1) return a.chr1 < b.chr1;
+        if (a.chr2 != b.chr2) return a.chr2 < b.chr2;
+        if (a.binSize != b.binSize) return a.binSize < b.binSize;
+        if (a.row != b.row) return a.row < b.row;
+        return a.col < b.col;
+    }
+
+    int fd_;
+    uint64_t size_;
+    FileHeader hdr_;
+    std::vector<Chromosome> chroms_;
+    std::vector<std::string> names_;
+    std::vector<int32_t> levels_;
+    std::vector<TileEntry> tiles_;
+};
+
+} // namespace hic_tiles
+
+#endif // HIC_TILES_H
@@ -0,0 +1,40 @@
+// Prints every cell of a .csr file written by export-csr, one
+// "chr1 chr2 binSize row col count" line each, or with --norms every
+// normalization value as "type chr binSize bin value", through hic_csr.h.
+// Built and run by tests/roundtrip.sh.
+
+#include "hic_csr.h"
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+int main(int argc, char** argv) {
+    bool norms = argc == 3 && std::strcmp(argv[1], "--norms") == 0;
+    hic_csr::File f;
+    if (argc != (norms ? 3 : 2) || !f.open(argv[argc - 1])) {
+        std::fprintf(stderr, "usage: csr_dump [--norms] file.csr\n");
+        return 1;
+    }
+    if (norms) {
+        for (uint32_t i = 0; i < f.normCount(); i++) {
+            const hic_csr::NormEntry& e = f.norm(i);
+            int64_t n;
+            const double* v = f.normValues(e.type, e.chrIdx, e.binSize, &n);
+            for (int64_t k = 0; k < n; k++) {
+                if (std::isnan(v[k])) std::printf("%s %d %d %lld nan\n", e.type, e.chrIdx, e.binSize, (long long)k);
+                else std::printf("%s %d %d %lld %.17g\n", e.type, e.chrIdx, e.binSize, (long long)k, v[k]);
+            }
+        }
+        return 0;
+    }
+    for (uint32_t i = 0; i < f.matrixCount(); i++) {
+        const hic_csr::MatrixEntry& m = f.matrix(i);
+        const int64_t* rowPtr = f.rowPtr(m);
+        const int32_t* colIdx = f.colIdx(m);
+        const float* counts = f.counts(m);
+        for (int64_t r = 0; r < m.nRows; r++)
+            for (int64_t k = rowPtr[r]; k < rowPtr[r + 1]; k++)
+                std::printf("%d %d %d %lld %d %g\n", m.chr1, m.chr2, m.binSize, (long long)r, colIdx[k], counts[k]);
+    }
+    return 0;
+}
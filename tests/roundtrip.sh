@@ -0,0 +1,160 @@
+#!/bin/sh
+# Round-trip regression test for the .hic writers. Builds the tool, bins
+# generated pairs files with pre (in memory, out of core under a small
+# --max-memory, and from short format), and checks every cell that query
+# and export-csr return against counts binned independently with awk.
+# append-contacts (copying and in place), retile and coarsen are checked the
+# same way, and rebuild-all against an All matrix kept up by append.
+# Normalized queries go through the vector kernels and are checked against
+# the raw counts over the coverage vectors export-csr writes out.
+#
+#   tests/roundtrip.sh [work-dir]     (needs g++, zlib and awk)
+
+set -eu
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=${1:-$(mktemp -d)}
+mkdir -p "$work"
+cd "$work"
+
+g++ -std=c++11 -O2 -pthread "$root/update_hic_header_stream.cpp" -o uhh -lz
+g++ -std=c++11 -O2 -I"$root" "$root/tests/csr_dump.cpp" -o csr_dump
+
+failures=0
+check() {   # name expected got
+    sort "$2" > expected.sorted
+    sort "$3" > got.sorted
+    if cmp -s expected.sorted got.sorted; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        diff expected.sorted got.sorted | head -5
+        failures=$((failures + 1))
+    fi
+}
+
+check_close() {   # name expected got: same cells, values within 1e-5 relative
+    if awk 'NR == FNR { want[$1 " " $2 " " $3 " " $4 " " $5] = $6; next }
+            {
+                k = $1 " " $2 " " $3 " " $4 " " $5
+                if (!(k in want)) { bad++; next }
+                d = $6 - want[k]; if (d < 0) d = -d
+                m = want[k] < 0 ? -want[k] : want[k]
+                if (d > 1e-5 * (m > 1 ? m : 1)) bad++
+                delete want[k]
+            }
+            END { for (k in want) bad++; exit bad > 0 }' "$2" "$3"; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        failures=$((failures + 1))
+    fi
+}
+
+printf 'c1\t3000000\nc2\t2000000\nc3\t1500000\n' > sizes.txt
+chroms="c1 c2 c3"
+res="1000000,100000,5000"
+
+# pairs seed count > file: 4DN pairs with a mix of intra and inter contacts.
+pairs() {
+    awk -v seed="$1" -v n="$2" 'BEGIN {
+        srand(seed); split("c1 c2 c3", c, " "); len["c1"] = 3000000; len["c2"] = 2000000; len["c3"] = 1500000
+        print "## pairs format v1.0"
+        for (i = 0; i < n; i++) {
+            a = c[int(rand() * 3) + 1]; b = rand() < 0.6 ? a : c[int(rand() * 3) + 1]
+            printf "r%d\t%s\t%d\t%s\t%d\t+\t-\n", i, a, int(rand() * len[a]), b, int(rand() * len[b])
+        }
+    }'
+}
+
+# expected res-list pairs-files... > file: "chr1 chr2 binSize x y count",
+# chromosomes by dictionary index with chr1 <= chr2 and x <= y on the diagonal.
+expected() {
+    list=$1; shift
+    awk -v list="$list" 'BEGIN { split("c1 c2 c3", c, " "); for (i in c) idx[c[i]] = i; n = split(list, r, ",") }
+        /^#/ { next }
+        {
+            i = idx[$2]; j = idx[$4]; p = $3; q = $5
+            if (i > j || (i == j && p > q)) { t = i; i = j; j = t; t = p; p = q; q = t }
+            for (k = 1; k <= n; k++) cells[i " " j " " r[k] " " int(p / r[k]) " " int(q / r[k])]++
+        }
+        END { for (k in cells) print k, cells[k] }' "$@"
+}
+
+# dump file.hic res-list [query options] > file: every cell query returns, in
+# expected()'s form. Run as `dump ... > got`, so a failing query stops the
+# test under set -e.
+dump() {
+    for r in $(echo "$2" | tr , ' '); do
+        i=0
+        for a in $chroms; do
+            i=$((i + 1)); j=0
+            for b in $chroms; do
+                j=$((j + 1))
+                [ $j -lt $i ] && continue
+                ./uhh query ${3:-} "$1" "$r" "$a" "$b" > query.out
+                awk -v i=$i -v j=$j -v r="$r" '{ print i, j, r, $1 / r, $2 / r, $3 }' query.out
+            done
+        done
+    done
+}
+
+pairs 1 20000 > a.pairs
+pairs 2 5000 > b.pairs
+awk '!/^#/ { print 0, $2, $3, 0, 16, $4, $5, 1 }' a.pairs > a.short
+expected "$res" a.pairs > a.expected
+expected "$res" a.pairs b.pairs > ab.expected
+
+./uhh pre -r "$res" a.pairs a.hic sizes.txt > /dev/null
+dump a.hic "$res" > got; check "pre" a.expected got
+# Small enough that the merge parks pending blocks on disk.
+./uhh pre -r "$res" --max-memory 256K a.pairs am.hic sizes.txt > /dev/null
+dump am.hic "$res" > got; check "pre --max-memory" a.expected got
+./uhh pre -r "$res" a.short as.hic sizes.txt > /dev/null
+dump as.hic "$res" > got; check "pre short format" a.expected got
+
+./uhh export-csr a.hic a.csr > /dev/null
+./csr_dump a.csr > got; check "export-csr" a.expected got
+
+./uhh append-contacts a.hic b.pairs ab.hic > /dev/null
+dump ab.hic "$res" > got; check "append-contacts" ab.expected got
+cp a.hic ip.hic
+./uhh append-contacts --in-place ip.hic b.pairs > /dev/null
+dump ip.hic "$res" > got; check "append-contacts --in-place" ab.expected got
+
+./uhh retile -b 7 ab.hic rt.hic > /dev/null
+dump rt.hic "$res" > got; check "retile" ab.expected got
+
+./uhh coarsen -r 500000 ab.hic co.hic > /dev/null
+expected 500000 a.pairs b.pairs > co.expected
+dump co.hic 500000 > got; check "coarsen" co.expected got
+
+./uhh coarsen -r 500000 --norm VC ab.hic con.hic > /dev/null
+./uhh export-csr -r 500000 --norm VC con.hic con.csr > /dev/null
+./csr_dump --norms con.csr > norms
+./csr_dump con.csr | awk 'NR == FNR { v[$2 " " $4] = $5; next }
+    {
+        a = v[$1 " " $4]; b = v[$2 " " $5]
+        if (a == "nan" || b == "nan" || a * b == 0) next
+        printf "%s %s %s %s %s %.17g\n", $1, $2, $3, $4, $5, $6 / (a * b)
+    }' norms - > vc.expected
+dump con.hic 500000 "--norm VC" > got; check_close "query --norm VC" vc.expected got
+if ./uhh bench norm --records 100000 --repeat 1 > bench.out; then
+    echo "ok   normalization kernels match scalar"
+else
+    echo "FAIL normalization kernels match scalar"; cat bench.out
+    failures=$((failures + 1))
+fi
+
+# The All matrix: append onto a file with one must match rebuilding it.
+./uhh rebuild-all a.hic all.hic > /dev/null
+./uhh append-contacts all.hic b.pairs all2.hic > /dev/null
+./uhh rebuild-all all2.hic all3.hic > /dev/null
+./uhh query all2.hic 13 All All > got
+./uhh query all3.hic 13 All All > all.expected
+check "append-contacts All matrix" all.expected got
+
+if [ $failures -ne 0 ]; then
+    echo "$failures check(s) failed (work files in $work)"
+    exit 1
+fi
+echo "All round-trip checks passed."
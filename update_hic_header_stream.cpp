@@ -1,5 +1,26 @@
-// g++ -std=c++11 update_hic_header.cpp -o update_hic_header
-// ./update_hic_header input.hic output.hic statistics statistics.txt graphs graphs.txt
+// g++ -std=c++11 -O2 -pthread update_hic_header_stream.cpp -o update_hic_header -lz
+// ./update_hic_header [--max-memory 64M] input.hic output.hic statistics statistics.txt graphs graphs.txt
+//   input may be .hic.gz/.hic.zst and output .gz/.zst: both are streamed, never staged
+//   (zstd: add -DHAVE_ZSTD ... -lzstd)
+// ./update_hic_header batch [--durable] [--group N] [-j N|auto] [--threads N] [--numa] [--max-memory SIZE] manifest.txt
+// ./update_hic_header watch [--debounce MS] dir...   (updates x.hic in place from x.statistics.txt + x.graphs.txt)
+// ./update_hic_header rename-chroms in.hic out.hic mapping.txt   (or --in-place file.hic mapping.txt)
+// ./update_hic_header export-csr [-r res,...] [--norm TYPE] in.hic out.csr   (read with hic_csr.h)
+// ./update_hic_header export-tiles [-r res,...] [--norm TYPE] [--float16] in.hic out.tiles   (read with hic_tiles.h)
+// ./update_hic_header pre [-r res,...] [-q mapq] [--max-memory 32G] in.pairs out.hic chrom.sizes
+// ./update_hic_header append-contacts [-q mapq] in.hic new.pairs out.hic   (or --in-place file.hic new.pairs)
+// ./update_hic_header rebuild-all in.hic out.hic   (or --in-place file.hic)
+// ./update_hic_header compact in.hic out.hic   (or --in-place / --dry-run file.hic)
+// ./update_hic_header retile -b N|binSize=N,... in.hic out.hic
+// ./update_hic_header coarsen -r res,... [--norm VC|VC_SQRT] in.hic out.hic
+// ./update_hic_header checksum file.hic [sidecar]   then   scrub [--rate MB/s] file.hic [sidecar]
+// ./update_hic_header inspect file.hic   (a .hic.zst written by this tool is read by seeking)
+// ./update_hic_header query [--norm TYPE] [--oe] file.hic binSize chr1[:s-e] chr2[:s-e]   (or file.hic - for stdin)
+//   HIC_METADATA_CACHE=dir: inspect, query and export-* reuse parsed headers and indices
+// ./update_hic_header bench copy|decode [--threads N] [--numa] [--repeat R] file
+// ./update_hic_header bench norm [--repeat R] [--records N]   (normalization kernels vs scalar)
+//   manifest: one "<in.hic> <out.hic> <statistics.txt> <graphs.txt>" per line
+// tests/roundtrip.sh: round-trip regression test of pre, append-contacts, retile, coarsen and export-csr
 
 #include <iostream>
 #include <fstream>
@@ -8,6 +29,47 @@
 #include <cstdint>
 #include <cstring>
 #include <map>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <algorithm>
+#include <set>
+#include <deque>
+#include <queue>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <cmath>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HIC_X86_KERNELS 1   // AVX2/AVX-512 normalization, chosen at run time
+#include <immintrin.h>
+#endif
+
+#include "hic_csr.h"
+#include "hic_tiles.h"
 
 static int32_t readInt32LE(const char* p) {
     int32_t v; std::memcpy(&v, p, 4); return v;
@@ -27,17 +89,18 @@ struct AttrKV {
 };
 
 // Helper to mimic Juicer: read file as lines, append '\n' after each line.
-std::vector<char> load_value_file_text(const std::string& file) {
+bool load_value_file_text(const std::string& file, std::vector<char>& out) {
     std::ifstream fval(file);
     if (!fval) {
         std::cerr << "Error: cannot open value file: " << file << std::endl;
-        exit(1);
+        return false;
     }
     std::string line, value;
     while (std::getline(fval, line)) {
         value += line + "\n";
     }
-    return std::vector<char>(value.begin(), value.end());
+    out.assign(value.begin(), value.end());
+    return true;
 }
 
 // Read null-terminated string from stream
@@ -56,41 +119,1184 @@ void writeNullTerminatedString(std::ofstream& fout, const std::string& str) {
     fout.put('\0');
 }
 
-int main(int argc, char** argv) {
-    if (argc != 7) {
-        std::cerr << "Usage: " << argv[0]
-                  << " <in.hic> <out.hic> statistics <file1> graphs <file2>\n";
-        std::cerr << "  (Only 'statistics' and 'graphs' can be inserted in order after 'software'.)\n";
-        return 1;
+static std::string parentDir(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    if (slash == std::string::npos) return ".";
+    if (slash == 0) return "/";
+    return path.substr(0, slash);
+}
+
+// --- Shared work-stealing thread pool ---
+//
+// Every parallel stage (batch files, chunked copy, ...) submits to the one
+// shared pool so nested parallelism never multiplies the thread count. Each
+// worker owns a deque: it pops its own newest task and, when empty, steals
+// the oldest task of another worker. Tasks submitted from inside a worker
+// land on that worker's deque, so a stage's subtasks stay cache-local unless
+// someone is idle. TaskGroup::wait() runs pending tasks instead of blocking,
+// which keeps nested waits from deadlocking the pool.
+
+// CPU limit imposed by the cgroup CPU quota (v2 cpu.max or v1 cfs_quota),
+// rounded up; 0 when unlimited or unknown.
+static unsigned cgroupCpuLimit() {
+    long long quota = -1, period = 0;
+    std::ifstream v2("/sys/fs/cgroup/cpu.max");
+    if (v2) {
+        std::string q;
+        if (v2 >> q >> period && q != "max") quota = std::atoll(q.c_str());
+    } else {
+        std::ifstream fq("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+        std::ifstream fp("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+        if (fq && fp) { fq >> quota; fp >> period; }
     }
-    const std::string inPath  = argv[1];
-    const std::string outPath = argv[2];
+    if (quota <= 0 || period <= 0) return 0;
+    return (unsigned)((quota + period - 1) / period);
+}
 
-    std::string statKey = argv[3], statFile = argv[4];
-    std::string graphKey = argv[5], graphFile = argv[6];
-    if (statKey != "statistics" || graphKey != "graphs") {
-        std::cerr << "Only 'statistics' and 'graphs' can be appended.\n";
-        return 1;
+static unsigned defaultWorkerCount() {
+    unsigned n = std::thread::hardware_concurrency();
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) n = CPU_COUNT(&set);
+    unsigned limit = cgroupCpuLimit();
+    if (limit && limit < n) n = limit;
+    return n ? n : 1;
+}
+
+// NUMA layout: the nodes that own at least one CPU we may run on. With
+// --numa, worker i is pinned to node i % nodes and allocates its buffers
+// after pinning, so first-touch places them on that node. Idle workers
+// steal from their own node first, and a task submitted with an affinity
+// never leaves its node.
+struct NumaNode {
+    int id;
+    cpu_set_t cpus;
+};
+
+static std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string part;
+    while (std::getline(ss, part, ',')) {
+        if (part.empty()) continue;
+        size_t dash = part.find('-');
+        int lo = std::atoi(part.c_str());
+        int hi = dash == std::string::npos ? lo : std::atoi(part.c_str() + dash + 1);
+        for (int c = lo; c <= hi; c++) cpus.push_back(c);
     }
+    return cpus;
+}
 
-    // Use Juicer-style text read for statistics/graphs
-    std::vector<char> statVal = load_value_file_text(statFile);
-    std::vector<char> graphVal = load_value_file_text(graphFile);
+static std::vector<NumaNode> detectNumaNodes() {
+    std::vector<NumaNode> nodes;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return nodes;
+    DIR* dir = opendir("/sys/devices/system/node");
+    if (!dir) return nodes;
+    std::vector<int> ids;
+    while (struct dirent* e = readdir(dir)) {
+        if (std::strncmp(e->d_name, "node", 4) == 0 && std::isdigit((unsigned char)e->d_name[4]))
+            ids.push_back(std::atoi(e->d_name + 4));
+    }
+    closedir(dir);
+    std::sort(ids.begin(), ids.end());
+    for (int id : ids) {
+        std::ifstream f("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+        if (!f) continue;
+        std::string list;
+        std::getline(f, list);
+        NumaNode node;
+        node.id = id;
+        CPU_ZERO(&node.cpus);
+        for (int cpu : parseCpuList(list))
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) CPU_SET(cpu, &node.cpus);
+        if (CPU_COUNT(&node.cpus) > 0) nodes.push_back(node);
+    }
+    return nodes;
+}
 
-    // --- PASS 1: Read Header & Original Attributes ---
+static unsigned g_poolThreads = 0;   // 0 = size from affinity and cgroup quota
+static bool g_numa = false;          // pin workers per NUMA node
+static thread_local int tlsWorkerIdx = -1;
 
-    std::ifstream fin(inPath, std::ios::binary);
-    if (!fin) { 
-        std::cerr << "Error: cannot open input file: " << inPath << std::endl;
-        return 1; 
+class ThreadPool {
+public:
+    typedef std::function<void()> Task;
+
+    static ThreadPool& shared() {
+        static ThreadPool pool(g_poolThreads ? g_poolThreads : defaultWorkerCount(), g_numa);
+        return pool;
+    }
+
+    ThreadPool(unsigned nWorkers, bool numa) : queued_(0), next_(0), stop_(false) {
+        if (numa) nodes_ = detectNumaNodes();
+        if (nodes_.size() < 2) nodes_.clear();
+        for (unsigned i = 0; i < nWorkers; i++) workers_.emplace_back(new Worker);
+        for (unsigned i = 0; i < nWorkers; i++)
+            threads_.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lk(sleepMu_);
+            stop_ = true;
+        }
+        sleepCv_.notify_all();
+        for (auto& t : threads_) t.join();
+    }
+
+    unsigned size() const { return (unsigned)workers_.size(); }
+
+    // Number of NUMA nodes workers are pinned across (1 when not pinning).
+    unsigned nodeCount() const { return nodes_.empty() ? 1 : (unsigned)nodes_.size(); }
+
+    // Affinity hint for the k-th worker on a node, for callers spreading
+    // work across nodes.
+    int workerOnNode(unsigned node, unsigned k) const {
+        unsigned n = nodeCount();
+        unsigned perNode = (size() - node % n + n - 1) / n;
+        if (perNode == 0) return -1;
+        return (int)(node % n + n * (k % perNode));
+    }
+
+    // affinity >= 0 is a hint naming the preferred worker (taken modulo the
+    // pool size); otherwise the calling worker, or round-robin from outside.
+    void submit(Task task, int affinity = -1) {
+        unsigned idx;
+        if (affinity >= 0) idx = (unsigned)affinity % size();
+        else if (tlsWorkerIdx >= 0) idx = (unsigned)tlsWorkerIdx;
+        else idx = next_++ % size();
+        {
+            std::lock_guard<std::mutex> lk(workers_[idx]->mu);
+            if (affinity >= 0 && !nodes_.empty()) workers_[idx]->pinned.push_back(std::move(task));
+            else workers_[idx]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lk(sleepMu_);
+            queued_++;
+        }
+        sleepCv_.notify_one();
+    }
+
+    // Run one pending task on the calling thread; false if none was found.
+    bool runOne() {
+        Task task;
+        if (!take(tlsWorkerIdx, task)) return false;
+        task();
+        return true;
+    }
+
+private:
+    struct Worker {
+        std::mutex mu;
+        std::deque<Task> tasks;
+        std::deque<Task> pinned;          // node-affine tasks (--numa): only this node takes them
+    };
+
+    static bool popFrom(std::deque<Task>& q, bool newest, Task& out) {
+        if (q.empty()) return false;
+        if (newest) { out = std::move(q.back()); q.pop_back(); }
+        else { out = std::move(q.front()); q.pop_front(); }
+        return true;
+    }
+
+    // Own deque first, then steal: victims on this worker's node before
+    // those on other nodes, which may not take pinned tasks.
+    bool take(int self, Task& out) {
+        if (self >= 0) {
+            Worker& w = *workers_[self];
+            std::lock_guard<std::mutex> lk(w.mu);
+            if (popFrom(w.tasks, true, out) || popFrom(w.pinned, true, out)) {
+                queued_--;
+                return true;
+            }
+        }
+        unsigned n = size(), nodes = nodeCount();
+        unsigned start = self >= 0 ? (unsigned)self + 1 : next_.load();
+        for (int remote = 0; remote < (self >= 0 && nodes > 1 ? 2 : 1); remote++) {
+            for (unsigned k = 0; k < n; k++) {
+                unsigned victim = (start + k) % n;
+                if ((int)victim == self) continue;
+                bool sameNode = self < 0 || victim % nodes == (unsigned)self % nodes;
+                if (sameNode == (remote != 0)) continue;
+                Worker& w = *workers_[victim];
+                std::lock_guard<std::mutex> lk(w.mu);
+                if (popFrom(w.tasks, false, out) || (sameNode && popFrom(w.pinned, false, out))) {
+                    queued_--;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(unsigned idx) {
+        tlsWorkerIdx = (int)idx;
+        if (!nodes_.empty()) {
+            const NumaNode& node = nodes_[idx % nodes_.size()];
+            pthread_setaffinity_np(pthread_self(), sizeof(node.cpus), &node.cpus);
+        }
+        while (true) {
+            Task task;
+            if (take((int)idx, task)) {
+                task();
+                continue;
+            }
+            std::unique_lock<std::mutex> lk(sleepMu_);
+            sleepCv_.wait(lk, [this] { return stop_ || queued_.load() > 0; });
+            if (stop_ && queued_.load() == 0) return;
+        }
+    }
+
+    std::vector<NumaNode> nodes_;
+    std::vector<std::unique_ptr<Worker> > workers_;
+    std::vector<std::thread> threads_;
+    std::atomic<long> queued_;
+    std::atomic<unsigned> next_;
+    std::mutex sleepMu_;
+    std::condition_variable sleepCv_;
+    bool stop_;
+};
+
+// Fork/join handle over the shared pool.
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool& pool = ThreadPool::shared()) : pool_(pool), pending_(0) {}
+    ~TaskGroup() { wait(); }
+
+    void run(std::function<void()> fn, int affinity = -1) {
+        pending_++;
+        pool_.submit([this, fn] {
+            fn();
+            std::lock_guard<std::mutex> lk(mu_);
+            if (--pending_ == 0) cv_.notify_all();
+        }, affinity);
+    }
+
+    void wait() {
+        while (pending_.load() > 0) {
+            if (pool_.runOne()) continue;
+            std::unique_lock<std::mutex> lk(mu_);
+            cv_.wait_for(lk, std::chrono::milliseconds(1), [this] { return pending_.load() == 0; });
+        }
+        // The last task decrements under mu_; taking it here makes sure that
+        // task is done touching this group before the caller may destroy it.
+        std::lock_guard<std::mutex> lk(mu_);
+    }
+
+private:
+    ThreadPool& pool_;
+    std::atomic<int> pending_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+};
+
+// --- Copy engine ---
+//
+// Copies a byte range between files in fixed chunks on the shared pool.
+// Each chunk tries copy_file_range() first (no user-space copy, and a reflink
+// on filesystems that support it) and falls back to pread/pwrite through a
+// per-thread buffer. When workers are pinned per NUMA node, consecutive
+// chunks are dealt to alternating nodes so each node's memory and CPUs carry
+// an equal share. Every chunk adds its bytes and time to g_copyStats, which
+// the batch controller reads; g_copyDepth caps the chunks in flight per
+// range (0: the whole range at once).
+
+static const int64_t COPY_CHUNK = 8 << 20;
+
+struct CopyStats {
+    std::atomic<int64_t> bytes, nanos;
+};
+static CopyStats g_copyStats = {{0}, {0}};
+static std::atomic<unsigned> g_copyDepth(0);
+
+static bool preadFull(int fd, char* p, size_t n, int64_t off) {
+    while (n > 0) {
+        ssize_t r = pread(fd, p, n, off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r; n -= r; off += r;
+    }
+    return true;
+}
+
+static bool pwriteFull(int fd, const char* p, size_t n, int64_t off) {
+    while (n > 0) {
+        ssize_t r = pwrite(fd, p, n, off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r; n -= r; off += r;
+    }
+    return true;
+}
+
+static bool copyChunk(int inFd, int64_t inOff, int outFd, int64_t outOff, int64_t len) {
+    loff_t in = inOff, out = outOff;
+    while (len > 0) {
+        ssize_t r = copy_file_range(inFd, &in, outFd, &out, (size_t)len, 0);
+        if (r > 0) { len -= r; continue; }
+        if (r < 0 && errno == EINTR) continue;
+        if (r == 0) return false;   // source shorter than expected
+        break;                      // unsupported here; fall back below
+    }
+    static thread_local std::vector<char> buf;
+    if (len > 0 && buf.empty()) buf.resize(1 << 20);
+    while (len > 0) {
+        size_t n = (size_t)std::min<int64_t>(len, buf.size());
+        if (!preadFull(inFd, buf.data(), n, in) || !pwriteFull(outFd, buf.data(), n, out))
+            return false;
+        in += n; out += n; len -= n;
+    }
+    return true;
+}
+
+static bool copyRange(int inFd, int64_t inOff, int outFd, int64_t outOff, int64_t len) {
+    std::atomic<bool> ok(true);
+    ThreadPool& pool = ThreadPool::shared();
+    unsigned nodes = pool.nodeCount();
+    TaskGroup group(pool);
+    unsigned chunk = 0, depth = g_copyDepth.load();
+    int64_t wave = depth ? (int64_t)depth * COPY_CHUNK : len;
+    for (int64_t start = 0; start < len; start += wave) {
+        for (int64_t done = start; done < std::min(len, start + wave); done += COPY_CHUNK, chunk++) {
+            int64_t n = std::min(COPY_CHUNK, len - done);
+            int affinity = nodes > 1 ? pool.workerOnNode(chunk % nodes, chunk / nodes) : -1;
+            group.run([=, &ok] {
+                auto t0 = std::chrono::steady_clock::now();
+                if (!copyChunk(inFd, inOff + done, outFd, outOff + done, n)) ok = false;
+                g_copyStats.bytes += n;
+                g_copyStats.nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - t0).count();
+            }, affinity);
+        }
+        group.wait();
+    }
+    return ok;
+}
+
+// --- Positional file I/O ---
+//
+// All .hic access goes through HicFile: reads and writes at explicit offsets
+// with no shared stream position, so independent regions can be read or
+// patched at the same time. Readers get their concurrency by issuing
+// reads from several pool tasks at once. writeAsync runs on the shared pool
+// and returns a future; awaitIo() waits for one while running other pool
+// tasks, so it is safe to call from inside a worker.
+
+static std::future<bool> runOnPool(std::function<bool()> op) {
+    std::shared_ptr<std::packaged_task<bool()> > task(new std::packaged_task<bool()>(op));
+    std::future<bool> f = task->get_future();
+    ThreadPool::shared().submit([task] { (*task)(); });
+    return f;
+}
+
+template <class T>
+static T awaitIo(std::future<T>& f) {
+    ThreadPool& pool = ThreadPool::shared();
+    while (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        if (!pool.runOne()) f.wait_for(std::chrono::milliseconds(1));
+    }
+    return f.get();
+}
+
+// Read-only positional view of a seekable zstd archive: independent frames
+// followed by a skippable frame holding the seek table (compressed and
+// decompressed size per frame). Reads decode only the frames they touch,
+// with a small cache of recently decoded frames.
+class SeekableArchive {
+public:
+    static const uint32_t SKIPPABLE_MAGIC = 0x184D2A5E;
+    static const uint32_t SEEKABLE_MAGIC = 0x8F92EAB1;
+
+    // Null unless fd holds a seekable archive (and zstd is compiled in).
+    static std::shared_ptr<SeekableArchive> open(int fd) {
+        std::shared_ptr<SeekableArchive> a;
+#ifdef HAVE_ZSTD
+        struct stat st;
+        char foot[9];
+        if (fstat(fd, &st) != 0 || st.st_size < 17 || !preadFull(fd, foot, 9, st.st_size - 9) ||
+            (uint32_t)readInt32LE(foot + 5) != SEEKABLE_MAGIC) return a;
+        int64_t nFrames = (uint32_t)readInt32LE(foot);
+        size_t entry = (foot[4] & 0x80) ? 12 : 8;
+        int64_t tableSize = nFrames * (int64_t)entry + 9;
+        if (tableSize + 8 > st.st_size) return a;
+        std::vector<char> table((size_t)tableSize + 8);
+        if (!preadFull(fd, table.data(), table.size(), st.st_size - (int64_t)table.size()) ||
+            (uint32_t)readInt32LE(table.data()) != SKIPPABLE_MAGIC ||
+            readInt32LE(table.data() + 4) != tableSize) return a;
+        a.reset(new SeekableArchive);
+        a->fd_ = fd;
+        a->cOff_.push_back(0);
+        a->dOff_.push_back(0);
+        for (int64_t i = 0; i < nFrames; i++) {
+            const char* e = table.data() + 8 + i * entry;
+            a->cOff_.push_back(a->cOff_.back() + (uint32_t)readInt32LE(e));
+            a->dOff_.push_back(a->dOff_.back() + (uint32_t)readInt32LE(e + 4));
+        }
+        if (a->cOff_.back() + (int64_t)table.size() != st.st_size) a.reset();
+#else
+        (void)fd;
+#endif
+        return a;
+    }
+
+    int64_t size() const { return dOff_.back(); }
+
+    // Decode the frames covering [off, off+n) into the cache.
+    void warm(int64_t off, int64_t n) {
+        if (off < 0 || n <= 0 || off + n > size()) return;
+        size_t i = std::upper_bound(dOff_.begin(), dOff_.end(), off) - dOff_.begin() - 1;
+        for (; i < frameCount() && dOff_[i] < off + n; i++) frame(i);
+    }
+
+    size_t frameCount() const { return cOff_.size() - 1; }
+    int64_t framesDecoded() const { return decoded_; }
+
+    bool read(void* p, size_t n, int64_t off) {
+        char* out = (char*)p;
+        if (off < 0 || off + (int64_t)n > size()) return false;
+        while (n > 0) {
+            size_t i = std::upper_bound(dOff_.begin(), dOff_.end(), off) - dOff_.begin() - 1;
+            std::shared_ptr<const std::vector<char> > f = frame(i);
+            if (!f) return false;
+            size_t at = (size_t)(off - dOff_[i]);
+            size_t take = std::min(n, f->size() - at);
+            std::memcpy(out, f->data() + at, take);
+            out += take;
+            off += (int64_t)take;
+            n -= take;
+        }
+        return true;
+    }
+
+private:
+    SeekableArchive() : fd_(-1), decoded_(0) {}
+
+    std::shared_ptr<const std::vector<char> > frame(size_t i) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            for (const auto& c : cache_) if (c.first == i) return c.second;
+        }
+        std::shared_ptr<std::vector<char> > f;
+#ifdef HAVE_ZSTD
+        std::vector<char> in((size_t)(cOff_[i + 1] - cOff_[i]));
+        f.reset(new std::vector<char>((size_t)(dOff_[i + 1] - dOff_[i])));
+        if (!preadFull(fd_, in.data(), in.size(), cOff_[i])) return nullptr;
+        size_t rc = ZSTD_decompress(f->data(), f->size(), in.data(), in.size());
+        if (ZSTD_isError(rc) || rc != f->size()) return nullptr;
+#endif
+        decoded_++;
+        std::lock_guard<std::mutex> lk(mu_);
+        cache_.push_front(std::make_pair(i, std::shared_ptr<const std::vector<char> >(f)));
+        if (cache_.size() > 8) cache_.pop_back();
+        return f;
+    }
+
+    int fd_;
+    std::vector<int64_t> cOff_, dOff_;   // frame start offsets, plus the end
+    std::mutex mu_;
+    std::deque<std::pair<size_t, std::shared_ptr<const std::vector<char> > > > cache_;
+    std::atomic<int64_t> decoded_;
+};
+
+class HicFile {
+public:
+    HicFile() : fd_(-1) {}
+    ~HicFile() { close(); }
+    HicFile(const HicFile&) = delete;
+    HicFile& operator=(const HicFile&) = delete;
+
+    bool open(const std::string& path, int flags = O_RDONLY) {
+        close();
+        fd_ = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+        return fd_ >= 0;
+    }
+
+    // Like open(path), but a seekable zstd archive is read through its
+    // decompressed view. Such a file is read-only.
+    bool openRead(const std::string& path) {
+        if (!open(path)) return false;
+        archive_ = SeekableArchive::open(fd_);
+        return true;
+    }
+    const SeekableArchive* archive() const { return archive_.get(); }
+
+    // Sparse in-memory file, for holding scattered regions of a stream.
+    bool openAnonymous(const char* name) {
+        close();
+        fd_ = memfd_create(name, MFD_CLOEXEC);
+        return fd_ >= 0;
+    }
+
+    bool close() {
+        archive_.reset();
+        int rc = fd_ >= 0 ? ::close(fd_) : 0;
+        fd_ = -1;
+        return rc == 0;
+    }
+
+    int fd() const { return fd_; }
+
+    int64_t size() const {
+        if (archive_) return archive_->size();
+        struct stat st;
+        return fstat(fd_, &st) == 0 ? (int64_t)st.st_size : -1;
+    }
+
+    bool read(void* p, size_t n, int64_t off) const {
+        return archive_ ? archive_->read(p, n, off) : preadFull(fd_, (char*)p, n, off);
+    }
+    bool write(const void* p, size_t n, int64_t off) const { return pwriteFull(fd_, (const char*)p, n, off); }
+    bool datasync() const { return fdatasync(fd_) == 0; }
+
+    // Up to n bytes at off, fewer only at the end of the file; -1 on error.
+    int64_t readUpTo(void* p, size_t n, int64_t off) const {
+        if (archive_) {
+            int64_t avail = std::max<int64_t>(0, std::min<int64_t>((int64_t)n, archive_->size() - off));
+            return archive_->read(p, (size_t)avail, off) ? avail : -1;
+        }
+        size_t got = 0;
+        while (got < n) {
+            ssize_t r = pread(fd_, (char*)p + got, n - got, off + (int64_t)got);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) return -1;
+            if (r == 0) break;
+            got += (size_t)r;
+        }
+        return (int64_t)got;
+    }
+
+    // Read-ahead hint: the kernel's for a plain file, a background decode
+    // of the covering frames for an archive.
+    void prefetch(int64_t off, int64_t n) const {
+        if (!archive_) {
+            posix_fadvise(fd_, off, n, POSIX_FADV_WILLNEED);
+            return;
+        }
+        std::shared_ptr<SeekableArchive> a = archive_;
+        ThreadPool::shared().submit([a, off, n] { a->warm(off, n); });
+    }
+
+    std::future<bool> writeAsync(const void* p, size_t n, int64_t off) const {
+        int fd = fd_;
+        return runOnPool([=] { return pwriteFull(fd, (const char*)p, n, off); });
+    }
+
+private:
+    int fd_;
+    std::shared_ptr<SeekableArchive> archive_;
+};
+
+// Buffered sequential reader over a HicFile for walking variable-length
+// records. Like an istream it latches failure: after a short read every
+// later read fails and the reader tests false.
+class HicReader {
+public:
+    explicit HicReader(const HicFile& file, int64_t pos = 0, size_t window = 1 << 16)
+        : file_(file), buf_(window), bufStart_(0), bufLen_(0), pos_(pos), ok_(true) {}
+
+    bool read(char* p, size_t n) {
+        while (ok_ && n > 0) {
+            if (pos_ < bufStart_ || pos_ >= bufStart_ + (int64_t)bufLen_) {
+                if (!fill()) { ok_ = false; break; }
+            }
+            size_t at = (size_t)(pos_ - bufStart_);
+            size_t take = std::min(n, bufLen_ - at);
+            std::memcpy(p, buf_.data() + at, take);
+            p += take; n -= take; pos_ += take;
+        }
+        return ok_;
+    }
+
+    bool get(char& c) { return read(&c, 1); }
+    void seek(int64_t pos) { pos_ = pos; }
+    void skip(int64_t n) { pos_ += n; }
+    int64_t tell() const { return pos_; }
+    explicit operator bool() const { return ok_; }
+    bool operator!() const { return !ok_; }
+
+    int32_t readInt32() { char b[4] = {0}; read(b, 4); return readInt32LE(b); }
+    int64_t readInt64() { char b[8] = {0}; read(b, 8); return readInt64LE(b); }
+    void skipString() { char c; while (get(c) && c != '\0') {} }
+
+private:
+    bool fill() {
+        bufStart_ = pos_;
+        int64_t n = file_.readUpTo(buf_.data(), buf_.size(), bufStart_);
+        bufLen_ = n > 0 ? (size_t)n : 0;
+        return bufLen_ > 0;
+    }
+
+    const HicFile& file_;
+    std::vector<char> buf_;
+    int64_t bufStart_;
+    size_t bufLen_;
+    int64_t pos_;
+    bool ok_;
+};
+
+// --- Compressed streams ---
+//
+// Archived maps are read and written as streams without a decompressed copy
+// on disk. Input is detected by magic: gzip (BGZF blocks are inflated in
+// parallel batches, any other gzip serially) or zstd (independent frames are
+// decompressed in parallel, a single large frame serially). Serial streams
+// still decode one piece ahead on the pool. Output codec follows the file
+// extension: .gz/.bgz is written as BGZF and .zst as independent frames,
+// both compressed in parallel, so the tool can read back what it writes at
+// full speed. zstd needs -DHAVE_ZSTD -lzstd at build time.
+
+enum class Codec { None, Gzip, Zstd };
+
+static const size_t STREAM_PIECE = 4 << 20;          // decompressed bytes per serial piece
+static const size_t STREAM_BATCH = 8 << 20;          // compressed bytes per parallel task
+static const size_t STREAM_MAX_FRAME = 64 << 20;     // larger zstd frames decode serially
+static const size_t BGZF_BLOCK_INPUT = 0xff00;       // bgzip's uncompressed block limit
+static const unsigned char BGZF_EOF[28] = {
+    0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 0x42, 0x43, 0x02, 0, 0x1b, 0, 0x03, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+static Codec codecForMagic(const unsigned char* b, size_t n) {
+    if (n >= 2 && b[0] == 0x1f && b[1] == 0x8b) return Codec::Gzip;
+    if (n >= 4 && b[0] == 0x28 && b[1] == 0xb5 && b[2] == 0x2f && b[3] == 0xfd) return Codec::Zstd;
+    return Codec::None;
+}
+
+static Codec codecForPath(const std::string& path) {
+    auto endsWith = [&](const char* ext) {
+        size_t n = std::strlen(ext);
+        return path.size() >= n && path.compare(path.size() - n, n, ext) == 0;
+    };
+    if (endsWith(".gz") || endsWith(".bgz")) return Codec::Gzip;
+    if (endsWith(".zst")) return Codec::Zstd;
+    return Codec::None;
+}
+
+static bool codecAvailable(Codec c) {
+#ifdef HAVE_ZSTD
+    (void)c;
+    return true;
+#else
+    return c != Codec::Zstd;
+#endif
+}
+
+// Total size of the BGZF block at p (its BSIZE + 1), or 0 if p does not
+// start a complete BGZF header.
+static size_t bgzfBlockSize(const unsigned char* p, size_t n) {
+    if (n < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 4)) return 0;
+    size_t xlen = p[10] | (p[11] << 8);
+    if (n < 12 + xlen) return 0;
+    for (size_t i = 12; i + 4 <= 12 + xlen; ) {
+        size_t slen = p[i + 2] | (p[i + 3] << 8);
+        if (p[i] == 'B' && p[i + 1] == 'C' && slen == 2 && i + 6 <= 12 + xlen)
+            return (size_t)(p[i + 4] | (p[i + 5] << 8)) + 1;
+        i += 4 + slen;
+    }
+    return 0;
+}
+
+// Inflate consecutive BGZF blocks.
+static bool inflateBgzf(const unsigned char* p, size_t n, std::vector<char>& out) {
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -15) != Z_OK) return false;
+    bool ok = true;
+    while (ok && n > 0) {
+        size_t size = bgzfBlockSize(p, n);
+        if (size < 26 || size > n) { ok = false; break; }
+        size_t xlen = p[10] | (p[11] << 8);
+        uint32_t isize = (uint32_t)readInt32LE((const char*)p + size - 4);
+        size_t at = out.size();
+        out.resize(at + isize);
+        inflateReset(&zs);
+        zs.next_in = (Bytef*)(p + 12 + xlen);
+        zs.avail_in = (uInt)(size - 12 - xlen - 8);
+        zs.next_out = (Bytef*)out.data() + at;
+        zs.avail_out = isize;
+        int rc = inflate(&zs, Z_FINISH);
+        if (rc != Z_STREAM_END || zs.avail_out != 0) ok = false;
+        p += size;
+        n -= size;
+    }
+    inflateEnd(&zs);
+    return ok;
+}
+
+// One BGZF block for up to BGZF_BLOCK_INPUT bytes.
+static bool deflateBgzf(const char* p, size_t n, int level, std::vector<char>& out) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        z_stream zs;
+        std::memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, attempt ? 0 : level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+        std::vector<char> data(deflateBound(&zs, (uLong)n));
+        zs.next_in = (Bytef*)p;
+        zs.avail_in = (uInt)n;
+        zs.next_out = (Bytef*)data.data();
+        zs.avail_out = (uInt)data.size();
+        int rc = deflate(&zs, Z_FINISH);
+        size_t len = data.size() - zs.avail_out;
+        deflateEnd(&zs);
+        if (rc != Z_STREAM_END) return false;
+        if (len + 26 > 65536) continue;   // incompressible: store instead
+        size_t at = out.size();
+        out.insert(out.end(), BGZF_EOF, BGZF_EOF + 18);
+        unsigned bsize = (unsigned)(len + 25);
+        out[at + 16] = (char)(bsize & 0xff);
+        out[at + 17] = (char)(bsize >> 8);
+        out.insert(out.end(), data.begin(), data.begin() + len);
+        char tail[8];
+        writeInt32LE(tail, (int32_t)crc32(crc32(0, Z_NULL, 0), (const Bytef*)p, (uInt)n));
+        writeInt32LE(tail + 4, (int32_t)n);
+        out.insert(out.end(), tail, tail + 8);
+        return true;
+    }
+    return false;
+}
+
+#ifdef HAVE_ZSTD
+// Decompress every frame in [p, p+n) (skippable frames yield nothing).
+static bool decompressZstdFrames(const char* p, size_t n, std::vector<char>& out) {
+    ZSTD_DStream* ds = ZSTD_createDStream();
+    ZSTD_initDStream(ds);
+    ZSTD_inBuffer in = {p, n, 0};
+    bool ok = true;
+    while (ok && in.pos < in.size) {
+        size_t at = out.size();
+        out.resize(at + ZSTD_DStreamOutSize());
+        ZSTD_outBuffer o = {out.data() + at, ZSTD_DStreamOutSize(), 0};
+        size_t rc = ZSTD_decompressStream(ds, &o, &in);
+        out.resize(at + o.pos);
+        if (ZSTD_isError(rc)) ok = false;
+    }
+    ZSTD_freeDStream(ds);
+    return ok;
+}
+#endif
+
+// Sequential reader over a possibly compressed file. next() hands out the
+// decompressed stream in order, piece by piece.
+class StreamReader {
+public:
+    StreamReader() : codec_(Codec::None), parallel_(false), inPos_(0), inSize_(0),
+                     ok_(true), serialDone_(false), frameEnded_(true) {
+        std::memset(&zs_, 0, sizeof(zs_));
+    }
+    ~StreamReader() {
+        drain();
+        if (codec_ == Codec::Gzip && !parallel_) inflateEnd(&zs_);
+#ifdef HAVE_ZSTD
+        if (zds_) ZSTD_freeDStream(zds_);
+#endif
+    }
+
+    bool open(const std::string& path) {
+        if (!file_.open(path)) return false;
+        inSize_ = file_.size();
+        unsigned char magic[32] = {0};
+        size_t n = (size_t)std::min<int64_t>(inSize_, sizeof(magic));
+        if (!file_.read(magic, n, 0)) return false;
+        codec_ = codecForMagic(magic, n);
+        if (!codecAvailable(codec_)) return false;
+        parallel_ = codec_ == Codec::Zstd || (codec_ == Codec::Gzip && bgzfBlockSize(magic, n) > 0);
+        if (codec_ == Codec::Gzip && !parallel_) startSerial();
+        return true;
+    }
+
+    Codec codec() const { return codec_; }
+    int64_t compressedSize() const { return inSize_; }
+    bool ok() const { return ok_; }
+
+    // Next piece of the decompressed stream; false at the end or on error.
+    bool next(std::vector<char>& out) {
+        ThreadPool& pool = ThreadPool::shared();
+        while (ok_) {
+            while (inflight_.size() < 2 * pool.size() + 1 && submit()) {}
+            if (inflight_.empty()) return false;
+            Pending p = std::move(inflight_.front());
+            inflight_.pop_front();
+            if (!awaitIo(p.done)) { ok_ = false; return false; }
+            if (p.data->empty()) continue;
+            out.swap(*p.data);
+            return true;
+        }
+        return false;
+    }
+
+private:
+    struct Pending {
+        std::shared_ptr<std::vector<char> > data;
+        std::future<bool> done;
+    };
+
+    // Queue the next unit of work; false when there is nothing to queue
+    // (end of input, or a serial piece is already in flight).
+    bool submit() {
+        if (!parallel_) return submitSerial();
+        if (inPos_ >= inSize_) return false;
+        size_t want = (size_t)std::min<int64_t>(inSize_ - inPos_, STREAM_BATCH);
+        std::shared_ptr<std::vector<char> > in(new std::vector<char>);
+        size_t used = 0;
+        while (true) {
+            in->resize(want);
+            if (!file_.read(in->data(), want, inPos_)) { ok_ = false; return false; }
+            used = splitUnits((const unsigned char*)in->data(), want);
+            if (used > 0 || want == (size_t)(inSize_ - inPos_)) break;
+            if (want >= STREAM_MAX_FRAME) break;
+            want = (size_t)std::min<int64_t>(inSize_ - inPos_, want * 2);
+        }
+        if (used == 0) {
+            // A frame too large for a batch: continue serially from here.
+            if (codec_ != Codec::Zstd || want < STREAM_MAX_FRAME) { ok_ = false; return false; }
+            parallel_ = false;
+            startSerial();
+            return submitSerial();
+        }
+        inPos_ += (int64_t)used;
+        Pending p;
+        p.data.reset(new std::vector<char>);
+        std::shared_ptr<std::vector<char> > out = p.data;
+        Codec codec = codec_;
+        p.done = runOnPool([in, used, out, codec] {
+            if (codec == Codec::Gzip) return inflateBgzf((const unsigned char*)in->data(), used, *out);
+#ifdef HAVE_ZSTD
+            return decompressZstdFrames(in->data(), used, *out);
+#else
+            return false;
+#endif
+        });
+        inflight_.push_back(std::move(p));
+        return true;
+    }
+
+    // Bytes of whole BGZF blocks / zstd frames at the start of [p, p+n).
+    size_t splitUnits(const unsigned char* p, size_t n) const {
+        size_t used = 0;
+        while (used < n) {
+            size_t size = 0;
+            if (codec_ == Codec::Gzip) {
+                size = bgzfBlockSize(p + used, n - used);
+                if (size == 0 && n - used >= 18) return used;   // not BGZF after all
+            } else {
+#ifdef HAVE_ZSTD
+                size = ZSTD_findFrameCompressedSize(p + used, n - used);
+                if (ZSTD_isError(size)) size = 0;
+#endif
+            }
+            if (size == 0 || size > n - used) break;
+            used += size;
+        }
+        return used;
+    }
+
+    void startSerial() {
+        buf_.resize(1 << 20);
+        bufPos_ = bufLen_ = 0;
+        frameEnded_ = true;
+        if (codec_ == Codec::Gzip) {
+            std::memset(&zs_, 0, sizeof(zs_));
+            if (inflateInit2(&zs_, 15 + 32) != Z_OK) ok_ = false;
+        }
+#ifdef HAVE_ZSTD
+        if (codec_ == Codec::Zstd) {
+            zds_ = ZSTD_createDStream();
+            ZSTD_initDStream(zds_);
+        }
+#endif
+    }
+
+    // One serial piece at a time: the decoder state is not shareable.
+    bool submitSerial() {
+        if (serialDone_ || !inflight_.empty()) return false;
+        Pending p;
+        p.data.reset(new std::vector<char>);
+        std::shared_ptr<std::vector<char> > out = p.data;
+        p.done = runOnPool([this, out] { return decodeSerial(*out); });
+        inflight_.push_back(std::move(p));
+        return true;
+    }
+
+    bool decodeSerial(std::vector<char>& out) {
+        out.resize(STREAM_PIECE);
+        if (codec_ == Codec::None) {
+            size_t n = (size_t)std::min<int64_t>(inSize_ - inPos_, out.size());
+            out.resize(n);
+            if (n == 0) serialDone_ = true;
+            else if (!file_.read(out.data(), n, inPos_)) return false;
+            inPos_ += (int64_t)n;
+            return true;
+        }
+        size_t have = 0;
+        while (have < out.size()) {
+            if (bufPos_ == bufLen_ && inPos_ < inSize_) {
+                size_t n = (size_t)std::min<int64_t>(inSize_ - inPos_, buf_.size());
+                if (!file_.read(buf_.data(), n, inPos_)) return false;
+                inPos_ += (int64_t)n;
+                bufPos_ = 0;
+                bufLen_ = n;
+            }
+            size_t before = have, consumed = bufPos_;
+            if (codec_ == Codec::Gzip) {
+                zs_.next_in = (Bytef*)buf_.data() + bufPos_;
+                zs_.avail_in = (uInt)(bufLen_ - bufPos_);
+                zs_.next_out = (Bytef*)out.data() + have;
+                zs_.avail_out = (uInt)(out.size() - have);
+                int rc = inflate(&zs_, Z_NO_FLUSH);
+                have = out.size() - zs_.avail_out;
+                bufPos_ = bufLen_ - zs_.avail_in;
+                if (rc == Z_STREAM_END) inflateReset(&zs_);   // concatenated members
+                else if (rc != Z_OK && rc != Z_BUF_ERROR) return false;
+                if (rc == Z_STREAM_END) frameEnded_ = true;
+                else if (have != before || bufPos_ != consumed) frameEnded_ = false;
+            } else {
+#ifdef HAVE_ZSTD
+                ZSTD_inBuffer in = {buf_.data(), bufLen_, bufPos_};
+                ZSTD_outBuffer o = {out.data(), out.size(), have};
+                size_t rc = ZSTD_decompressStream(zds_, &o, &in);
+                if (ZSTD_isError(rc)) return false;
+                have = o.pos;
+                bufPos_ = in.pos;
+                if (rc == 0) frameEnded_ = true;
+                else if (have != before || bufPos_ != consumed) frameEnded_ = false;
+#else
+                return false;
+#endif
+            }
+            // No progress with all input read: the stream is finished, or
+            // truncated if it stopped inside a gzip member or zstd frame.
+            if (have == before && bufPos_ == consumed && inPos_ >= inSize_) {
+                if (!frameEnded_) return false;
+                serialDone_ = true;
+                break;
+            }
+        }
+        out.resize(have);
+        return true;
+    }
+
+    void drain() {
+        for (auto& p : inflight_) awaitIo(p.done);
+        inflight_.clear();
+    }
+
+    HicFile file_;
+    Codec codec_;
+    bool parallel_;
+    int64_t inPos_, inSize_;
+    bool ok_;
+    std::deque<Pending> inflight_;
+    // serial decoder state
+    bool serialDone_;
+    bool frameEnded_;   // the last gzip member / zstd frame was complete
+    std::vector<char> buf_;
+    size_t bufPos_, bufLen_;
+    z_stream zs_;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream* zds_ = nullptr;
+#endif
+};
+
+// Sequential writer that compresses fixed-size pieces on the pool and
+// writes them back in order. zstd output is a seekable archive: every piece
+// is its own frame and a seek table frame closes the file; cut() ends the
+// current frame early so small structures get frames of their own.
+class StreamWriter {
+public:
+    StreamWriter() : codec_(Codec::None), cursor_(0), ok_(true) {}
+
+    bool open(const std::string& path, Codec codec) {
+        codec_ = codec;
+        cursor_ = 0;
+        return codecAvailable(codec) && file_.open(path, O_RDWR | O_CREAT | O_TRUNC);
+    }
+
+    bool write(const char* p, size_t n) {
+        if (codec_ == Codec::None) {
+            if (!file_.write(p, n, cursor_)) ok_ = false;
+            cursor_ += (int64_t)n;
+            return ok_;
+        }
+        while (n > 0) {
+            size_t take = std::min(n, STREAM_PIECE - pending_.size());
+            pending_.insert(pending_.end(), p, p + take);
+            p += take;
+            n -= take;
+            if (pending_.size() == STREAM_PIECE) flushPiece();
+        }
+        return ok_;
+    }
+
+    void cut() {
+        if (!pending_.empty()) flushPiece();
+    }
+
+    bool close() {
+        cut();
+        while (!inflight_.empty()) writeFront();
+        std::vector<char> tail;
+        if (codec_ == Codec::Gzip) tail.assign(BGZF_EOF, BGZF_EOF + sizeof(BGZF_EOF));
+        auto put32 = [&tail](uint32_t v) {
+            char b[4];
+            writeInt32LE(b, (int32_t)v);
+            tail.insert(tail.end(), b, b + 4);
+        };
+        if (codec_ == Codec::Zstd) {
+            put32((uint32_t)SeekableArchive::SKIPPABLE_MAGIC);
+            put32((uint32_t)(frames_.size() * 8 + 9));
+            for (const auto& f : frames_) {
+                put32(f.first);
+                put32(f.second);
+            }
+            put32((uint32_t)frames_.size());
+            tail.push_back(0);                // descriptor: no checksums
+            put32((uint32_t)SeekableArchive::SEEKABLE_MAGIC);
+        }
+        if (!tail.empty() && !file_.write(tail.data(), tail.size(), cursor_)) ok_ = false;
+        cursor_ += (int64_t)tail.size();
+        if (!file_.close()) ok_ = false;
+        return ok_;
+    }
+
+    int64_t bytesWritten() const { return cursor_; }
+
+private:
+    struct Pending {
+        std::shared_ptr<std::vector<char> > data;
+        std::future<bool> done;
+        size_t rawSize;
+    };
+
+    void flushPiece() {
+        std::shared_ptr<std::vector<char> > in(new std::vector<char>);
+        in->swap(pending_);
+        Pending p;
+        p.rawSize = in->size();
+        p.data.reset(new std::vector<char>);
+        std::shared_ptr<std::vector<char> > out = p.data;
+        Codec codec = codec_;
+        p.done = runOnPool([in, out, codec] {
+            if (codec == Codec::Gzip) {
+                for (size_t at = 0; at < in->size(); at += BGZF_BLOCK_INPUT)
+                    if (!deflateBgzf(in->data() + at, std::min(BGZF_BLOCK_INPUT, in->size() - at),
+                                     Z_DEFAULT_COMPRESSION, *out)) return false;
+                return true;
+            }
+#ifdef HAVE_ZSTD
+            out->resize(ZSTD_compressBound(in->size()));
+            size_t n = ZSTD_compress(out->data(), out->size(), in->data(), in->size(), 3);
+            if (ZSTD_isError(n)) return false;
+            out->resize(n);
+            return true;
+#else
+            return false;
+#endif
+        });
+        inflight_.push_back(std::move(p));
+        while (inflight_.size() > 2 * ThreadPool::shared().size()) writeFront();
+    }
+
+    void writeFront() {
+        Pending p = std::move(inflight_.front());
+        inflight_.pop_front();
+        if (!awaitIo(p.done) || !file_.write(p.data->data(), p.data->size(), cursor_)) ok_ = false;
+        cursor_ += (int64_t)p.data->size();
+        frames_.push_back(std::make_pair((uint32_t)p.data->size(), (uint32_t)p.rawSize));
+    }
+
+    HicFile file_;
+    Codec codec_;
+    int64_t cursor_;
+    bool ok_;
+    std::vector<char> pending_;
+    std::deque<Pending> inflight_;
+    std::vector<std::pair<uint32_t, uint32_t> > frames_;   // compressed, decompressed sizes
+};
+
+// --- Header model ---
+//
+// PASS 1 of every mode: the header from the magic string through the
+// resolution lists, split into the pieces modes rewrite independently, and
+// the restriction-site arrays that follow when there are fragment
+// resolutions. The arrays are only located, never decoded: rewrites carry
+// [sitesStart, dataStart) as one slice together with the body.
+
+// One chromosome's restriction sites: count int32 positions at offset.
+struct SiteSpan {
+    int64_t offset;
+    int32_t count;
+};
+
+struct HicHeader {
+    int32_t version;
+    std::vector<char> headerBuf;          // magic .. attribute list, as read
+    size_t footerPosField, nviPosField, attrCountField;
+    int64_t footerPos, nviPos, nviLen;
+    std::vector<AttrKV> attrs;
+    int64_t chrDictStart;                 // file offset of chrDictBuf
+    std::vector<char> chrDictBuf;         // nChrs + (name, length) entries
+    std::vector<std::string> chrNames;
+    std::vector<int64_t> chrLengths;
+    std::vector<char> resolutionBuf;      // bp and fragment resolution lists
+    std::vector<int32_t> bpResolutions, fragResolutions;
+    int64_t sitesStart;                   // end of the resolution lists
+    std::vector<SiteSpan> sites;          // per chromosome, empty without fragment resolutions
+    size_t dataStart;                     // first byte after the sites
+};
+
+// Locates the restriction-site arrays: per chromosome an int32 count and
+// that many int32 positions. A plain file is walked through a read-only
+// mapping touching only the counts, so even millions of sites cost one page
+// per chromosome; an archive is walked by skipping.
+static bool parseRestrictionSites(const HicFile& f, HicHeader& h) {
+    h.sites.clear();
+    int64_t pos = h.sitesStart, end = f.size();
+    if (h.fragResolutions.empty()) {
+        h.dataStart = (size_t)pos;
+        return true;
+    }
+    if (f.archive()) {
+        HicReader in(f, pos, 4096);
+        for (size_t c = 0; c < h.chrNames.size(); c++) {
+            int32_t count = in.readInt32();
+            if (!in || count < 0) return false;
+            h.sites.push_back({in.tell(), count});
+            in.skip((int64_t)count * 4);
+        }
+        pos = in.tell();
+    } else {
+        int64_t base = pos & ~((int64_t)sysconf(_SC_PAGESIZE) - 1);
+        if (end <= base) return false;
+        void* m = mmap(nullptr, (size_t)(end - base), PROT_READ, MAP_PRIVATE, f.fd(), base);
+        if (m == MAP_FAILED) return false;
+        const char* map = (const char*)m;
+        bool ok = true;
+        for (size_t c = 0; ok && c < h.chrNames.size(); c++) {
+            ok = pos + 4 <= end;
+            int32_t count = ok ? readInt32LE(map + (pos - base)) : -1;
+            ok = ok && count >= 0;
+            h.sites.push_back({pos + 4, count});
+            pos += 4 + (int64_t)count * 4;
+        }
+        munmap(m, (size_t)(end - base));
+        if (!ok) return false;
     }
+    if (pos > end) return false;
+    h.dataStart = (size_t)pos;
+    return true;
+}
 
-    std::vector<char> headerBuf;
+// With sites=false the restriction-site arrays are left in the body
+// (dataStart == sitesStart); streams pass them through with the body.
+static bool parseHicHeader(const HicFile& inFile, const std::string& inPath, HicHeader& h,
+                           bool quiet = false, bool sites = true) {
+    HicReader fin(inFile);
+    std::vector<char>& headerBuf = h.headerBuf;
+    headerBuf.clear();
     headerBuf.reserve(1<<20);
 
+    // On EOF the byte reads as '\0' so scanning loops stop; fin stays failed
+    // and is checked once the header has been walked.
     auto readPush = [&](char &c) {
         fin.read(&c,1);
-        if (!fin) { std::cerr<<"Unexpected EOF\n"; exit(1); }
+        if (!fin) { c = '\0'; return; }
         headerBuf.push_back(c);
     };
 
@@ -99,48 +1305,49 @@ int main(int argc, char** argv) {
     do { readPush(c); } while(c!='\0');
 
     // b) version (int32)
-    char tmp4[4];
+    char tmp4[4] = {0};
     fin.read(tmp4,4); headerBuf.insert(headerBuf.end(), tmp4, tmp4+4);
-    int32_t version = readInt32LE(tmp4);
+    h.version = readInt32LE(tmp4);
 
     // c) footerPosition (master index position)
-    size_t footerPosField = headerBuf.size();
-    char tmp8[8];
+    h.footerPosField = headerBuf.size();
+    char tmp8[8] = {0};
     fin.read(tmp8,8); headerBuf.insert(headerBuf.end(), tmp8, tmp8+8);
-    int64_t origFooterPos = readInt64LE(tmp8);
+    h.footerPos = readInt64LE(tmp8);
 
     // d) genomeID
     do { readPush(c); } while(c!='\0');
 
     // e) normVectorIndexPosition & length (if v9+)
-    size_t nviPosField = 0;
-    int64_t origNviPos = 0;
-    int64_t origNviLen = 0;
-    if (version > 8) {
-        nviPosField = headerBuf.size();
+    h.nviPosField = 0;
+    h.nviPos = 0;
+    h.nviLen = 0;
+    if (h.version > 8) {
+        h.nviPosField = headerBuf.size();
         fin.read(tmp8,8); headerBuf.insert(headerBuf.end(), tmp8, tmp8+8);
-        origNviPos = readInt64LE(tmp8);
+        h.nviPos = readInt64LE(tmp8);
         fin.read(tmp8,8); headerBuf.insert(headerBuf.end(), tmp8, tmp8+8);
-        origNviLen = readInt64LE(tmp8);
+        h.nviLen = readInt64LE(tmp8);
     }
 
     // f) attribute count
-    size_t attrCountField = headerBuf.size();
+    h.attrCountField = headerBuf.size();
     fin.read(tmp4,4); headerBuf.insert(headerBuf.end(), tmp4, tmp4+4);
-    int32_t origAttrCount = readInt32LE(tmp4);
+    int32_t attrCount = readInt32LE(tmp4);
 
     // g) read each existing key\0value\0
-    std::vector<AttrKV> origAttrs;
-    for (int i = 0; i < origAttrCount; i++) {
+    h.attrs.clear();
+    for (int i = 0; fin && i < attrCount; i++) {
         std::string key, value;
-        while (true) { fin.read(&c,1); headerBuf.push_back(c); if (c=='\0') break; key += c; }
-        while (true) { fin.read(&c,1); headerBuf.push_back(c); if (c=='\0') break; value += c; }
-        origAttrs.push_back({key, value});
+        while (true) { readPush(c); if (c=='\0') break; key += c; }
+        while (true) { readPush(c); if (c=='\0') break; value += c; }
+        h.attrs.push_back({key, value});
     }
-    size_t attrListEnd = headerBuf.size();
 
     // h) Read chromosome dictionary
-    std::vector<char> chrDictBuf;
+    h.chrDictStart = fin.tell();
+    std::vector<char>& chrDictBuf = h.chrDictBuf;
+    chrDictBuf.clear();
     chrDictBuf.reserve(1<<16);
     
     // Number of chromosomes
@@ -148,200 +1355,6130 @@ int main(int argc, char** argv) {
     int32_t nChrs = readInt32LE(tmp4);
     
     // Read each chromosome entry
-    for (int i = 0; i < nChrs; i++) {
+    h.chrNames.clear();
+    h.chrLengths.clear();
+    for (int i = 0; fin && i < nChrs; i++) {
         // Chromosome name (null-terminated)
+        std::string name;
         do { 
             fin.read(&c,1); 
+            if (!fin) c = '\0';
             chrDictBuf.push_back(c); 
+            if (c != '\0') name += c;
         } while(c!='\0');
+        h.chrNames.push_back(name);
         
         // Chromosome size (int32 for v8-, int64 for v9+)
-        if (version > 8) {
+        if (h.version > 8) {
             fin.read(tmp8,8); chrDictBuf.insert(chrDictBuf.end(), tmp8, tmp8+8);
+            h.chrLengths.push_back(readInt64LE(tmp8));
         } else {
             fin.read(tmp4,4); chrDictBuf.insert(chrDictBuf.end(), tmp4, tmp4+4);
+            h.chrLengths.push_back(readInt32LE(tmp4));
         }
     }
     
     // i) Read resolution arrays
-    std::vector<char> resolutionBuf;
+    std::vector<char>& resolutionBuf = h.resolutionBuf;
+    resolutionBuf.clear();
     resolutionBuf.reserve(1<<16);
     
     // BP resolutions
     fin.read(tmp4,4); resolutionBuf.insert(resolutionBuf.end(), tmp4, tmp4+4);
     int32_t nBpRes = readInt32LE(tmp4);
-    for (int i = 0; i < nBpRes; i++) {
+    h.bpResolutions.clear();
+    for (int i = 0; fin && i < nBpRes; i++) {
         fin.read(tmp4,4); resolutionBuf.insert(resolutionBuf.end(), tmp4, tmp4+4);
+        h.bpResolutions.push_back(readInt32LE(tmp4));
     }
     
     // Fragment resolutions
     fin.read(tmp4,4); resolutionBuf.insert(resolutionBuf.end(), tmp4, tmp4+4);
     int32_t nFragRes = readInt32LE(tmp4);
-    for (int i = 0; i < nFragRes; i++) {
+    h.fragResolutions.clear();
+    for (int i = 0; fin && i < nFragRes; i++) {
         fin.read(tmp4,4); resolutionBuf.insert(resolutionBuf.end(), tmp4, tmp4+4);
+        h.fragResolutions.push_back(readInt32LE(tmp4));
     }
     
-    size_t dataStart = fin.tellg();
-
-    // --- PASS 2: Build Updated Attribute List ---
-
-    // Remove any existing statistics/graphs
-    std::vector<AttrKV> newAttrs;
-    newAttrs.reserve(origAttrs.size() + 2);
-    int softwareIdx = -1;
-    for (size_t i = 0; i < origAttrs.size(); ++i) {
-        const std::string& k = origAttrs[i].key;
-        if (k == "software") softwareIdx = (int)newAttrs.size();
-        if (k != "statistics" && k != "graphs") newAttrs.push_back(origAttrs[i]);
+    h.sitesStart = fin.tell();
+    h.sites.clear();
+    h.dataStart = (size_t)h.sitesStart;
+    if (!fin || (sites && !parseRestrictionSites(inFile, h))) {
+        if (!quiet) std::cerr << "Unexpected EOF in header of " << inPath << std::endl;
+        return false;
     }
-    if (softwareIdx == -1) {
-        std::cerr << "Could not find 'software' attribute to insert after.\n";
-        return 1;
+    return true;
+}
+
+// Header bytes up to the attribute count, followed by attrs, the chromosome
+// dictionary and the resolution lists.
+static std::vector<char> buildHeader(const HicHeader& h, const std::vector<AttrKV>& attrs,
+                                     const std::vector<char>& chrDictBuf) {
+    std::vector<char> out(h.headerBuf.begin(), h.headerBuf.begin() + h.attrCountField);
+    char countBuf[4];
+    writeInt32LE(countBuf, (int32_t)attrs.size());
+    out.insert(out.end(), countBuf, countBuf + 4);
+    for (const auto& a : attrs) {
+        out.insert(out.end(), a.key.begin(), a.key.end());
+        out.push_back('\0');
+        out.insert(out.end(), a.value.begin(), a.value.end());
+        out.push_back('\0');
     }
+    out.insert(out.end(), chrDictBuf.begin(), chrDictBuf.end());
+    out.insert(out.end(), h.resolutionBuf.begin(), h.resolutionBuf.end());
+    return out;
+}
 
-    // Insert statistics/graphs after 'software'
-    auto it = newAttrs.begin() + (softwareIdx + 1);
-    it = newAttrs.insert(it, {"statistics", std::string(statVal.data(), statVal.size())});
-    it = newAttrs.insert(it+1, {"graphs", std::string(graphVal.data(), graphVal.size())});
+// --- Footer and matrix records ---
 
-    int32_t newAttrCount = newAttrs.size();
+struct MasterEntry {
+    std::string key;
+    int64_t position;
+    int32_t size;
+    int64_t fieldOffset;                  // file offset of the position field
+};
 
-    // Compute extra bytes (total size difference)
-    size_t origAttrBytes = 0, newAttrBytes = 0;
-    for (const auto& a : origAttrs)
-        origAttrBytes += a.key.size() + 1 + a.value.size() + 1;
-    for (const auto& a : newAttrs)
-        newAttrBytes += a.key.size() + 1 + a.value.size() + 1;
-    size_t delta = newAttrBytes - origAttrBytes;
+// Master index at footerPos, one entry at a time through a reader window of
+// the given size; end is set to the first byte after the last entry, where
+// the expected-value sections start.
+template <class Visit>
+static bool walkMasterIndex(const HicFile& f, int64_t footerPos, int32_t version, Visit visit,
+                            int64_t& end, size_t window = 1 << 16) {
+    HicReader r(f, footerPos, window);
+    r.skip(version > 8 ? 8 : 4);          // footer size
+    int32_t nEntries = r.readInt32();
+    for (int32_t i = 0; r && i < nEntries; i++) {
+        MasterEntry e;
+        char c;
+        while (r.get(c) && c != '\0') e.key += c;
+        e.fieldOffset = r.tell();
+        e.position = r.readInt64();
+        e.size = r.readInt32();
+        if (r) visit(e);
+    }
+    end = r.tell();
+    return (bool)r;
+}
 
-    // --- Write updated header ---
+static bool scanMasterIndex(const HicFile& f, int64_t footerPos, int32_t version,
+                            std::vector<MasterEntry>& entries, int64_t& end) {
+    return walkMasterIndex(f, footerPos, version, [&](const MasterEntry& e) { entries.push_back(e); }, end);
+}
 
-    std::ofstream fout(outPath, std::ios::binary);
-    if (!fout) { 
-        std::cerr << "Error: cannot open output file: " << outPath << std::endl;
-        return 1; 
+// Skip one expected-value section (normalized ones carry a type string).
+static void skipExpectedValues(HicReader& r, int32_t version, bool normalized) {
+    int32_t n = r.readInt32();
+    for (int32_t i = 0; r && i < n; i++) {
+        if (normalized) r.skipString();   // type
+        r.skipString();                   // unit
+        r.skip(4);                        // binSize
+        int64_t nValues = version > 8 ? r.readInt64() : r.readInt32();
+        r.skip(nValues * (version > 8 ? 4 : 8));
+        int32_t nFactors = r.readInt32();
+        r.skip((int64_t)nFactors * (version > 8 ? 8 : 12));
     }
-    
-    // Write header up to attribute count
-    fout.write(headerBuf.data(), attrCountField);
+}
 
-    // Write new attribute count
-    char countBuf[4];
-    writeInt32LE(countBuf, newAttrCount);
-    fout.write(countBuf,4);
+// Where the normalization-vector index starts, or 0 if the file has none.
+// v9 records it in the header; v8 keeps it after the expected values.
+static int64_t locateNormVectorIndex(const HicFile& f, const HicHeader& h,
+                                     int64_t masterEnd, int64_t delta) {
+    if (h.version > 8) return h.nviPos > 0 ? h.nviPos + delta : 0;
+    int64_t fileSize = f.size();
+    HicReader r(f, masterEnd);
+    skipExpectedValues(r, h.version, false);
+    if (!r || r.tell() >= fileSize) return 0;
+    skipExpectedValues(r, h.version, true);
+    if (!r || r.tell() >= fileSize) return 0;
+    return r.tell();
+}
 
-    // Write new attributes
-    for (const auto& a : newAttrs) {
-        fout.write(a.key.c_str(), a.key.size());
-        fout.put('\0');
-        if (!a.value.empty())
-            fout.write(a.value.c_str(), a.value.size());
-        fout.put('\0');
+// Offsets of the position fields in the normalization-vector index, in
+// file order.
+template <class Visit>
+static bool walkNormVectorIndex(const HicFile& f, int64_t nviPos, int32_t version, Visit visit,
+                                int64_t& end, size_t window = 1 << 16) {
+    HicReader r(f, nviPos, window);
+    int32_t nNorm = r.readInt32();
+    for (int32_t i = 0; r && i < nNorm; i++) {
+        r.skipString();                   // type
+        r.skip(4);                        // chrIdx
+        r.skipString();                   // unit
+        r.skip(4);                        // resolution
+        visit(r.tell());
+        r.skip(8 + (version > 8 ? 8 : 4)); // position, sizeInBytes
     }
+    end = r.tell();
+    return (bool)r;
+}
+
+static bool scanNormVectorIndex(const HicFile& f, int64_t nviPos, int32_t version,
+                                std::vector<int64_t>& fields, int64_t& end) {
+    return walkNormVectorIndex(f, nviPos, version, [&](int64_t field) { fields.push_back(field); }, end);
+}
+
+// End of the (unnormalized) expected values and of the whole footer: the
+// normalized expected values and, in v8 files that carry one, the
+// normalization-vector index after them.
+static bool scanFooterEnd(const HicFile& f, int32_t version, int64_t masterEnd,
+                          int64_t& expectedEnd, int64_t& end) {
+    HicReader r(f, masterEnd);
+    skipExpectedValues(r, version, false);
+    expectedEnd = r.tell();
+    skipExpectedValues(r, version, true);
+    end = r.tell();
+    if (!r) return false;
+    if (version > 8 || end >= f.size()) return true;
+    std::vector<int64_t> fields;
+    return scanNormVectorIndex(f, end, version, fields, end);
+}
+
+struct BlockIndexEntry {
+    int32_t number;
+    int64_t position;
+    int32_t size;
+};
 
-    // Write chromosome dictionary
-    fout.write(chrDictBuf.data(), chrDictBuf.size());
+struct ResolutionRecord {
+    std::string unit;
+    int32_t resIdx;
+    float sumCounts, occupiedCellCount, percent5, percent95;
+    int32_t binSize, blockBinCount, blockColumnCount;
+    int64_t blockIndexOffset;             // file offset of the first block entry
+    std::vector<BlockIndexEntry> blocks;
+};
+
+struct MatrixRecord {
+    int32_t chr1, chr2;
+    std::vector<ResolutionRecord> resolutions;
+};
 
-    // Write resolution arrays
-    fout.write(resolutionBuf.data(), resolutionBuf.size());
+static float readFloatLE(HicReader& r) {
+    char b[4] = {0};
+    r.read(b, 4);
+    float v; std::memcpy(&v, b, 4); return v;
+}
 
-    // Stream-copy the rest of the file
-    fin.seekg(dataStart, std::ios::beg);
-    const size_t BUF_SZ = 1<<20;
-    std::vector<char> buf(BUF_SZ);
-    while (fin) {
-        fin.read(buf.data(), BUF_SZ);
-        fout.write(buf.data(), fin.gcount());
+static bool readMatrixRecord(const HicFile& f, int64_t pos, MatrixRecord& m,
+                             int64_t* end = nullptr) {
+    HicReader r(f, pos);
+    m.chr1 = r.readInt32();
+    m.chr2 = r.readInt32();
+    int32_t nRes = r.readInt32();
+    m.resolutions.clear();
+    for (int32_t i = 0; r && i < nRes; i++) {
+        ResolutionRecord z;
+        char c;
+        while (r.get(c) && c != '\0') z.unit += c;
+        z.resIdx = r.readInt32();
+        z.sumCounts = readFloatLE(r);
+        z.occupiedCellCount = readFloatLE(r);
+        z.percent5 = readFloatLE(r);
+        z.percent95 = readFloatLE(r);
+        z.binSize = r.readInt32();
+        z.blockBinCount = r.readInt32();
+        z.blockColumnCount = r.readInt32();
+        int32_t nBlocks = r.readInt32();
+        z.blockIndexOffset = r.tell();
+        for (int32_t b = 0; r && b < nBlocks; b++) {
+            BlockIndexEntry e;
+            e.number = r.readInt32();
+            e.position = r.readInt64();
+            e.size = r.readInt32();
+            z.blocks.push_back(e);
+        }
+        m.resolutions.push_back(z);
     }
-    fin.close();
-    fout.close();
+    if (end) *end = r.tell();
+    return (bool)r;
+}
 
-    // --- PASS 3: Patch Pointers ---
+// --- Normalization vectors ---
 
-    std::fstream fupd(outPath, std::ios::in|std::ios::out|std::ios::binary);
-    if (!fupd) { 
-        std::cerr << "Error: cannot reopen output file for pointer updates" << std::endl;
-        return 1; 
+struct NormVectorEntry {
+    std::string type;
+    int32_t chrIdx;
+    std::string unit;
+    int32_t binSize;
+    int64_t position;
+    int64_t size;
+};
+
+static bool readNormVectorIndex(const HicFile& f, int64_t nviPos, int32_t version,
+                                std::vector<NormVectorEntry>& entries) {
+    HicReader r(f, nviPos);
+    int32_t nNorm = r.readInt32();
+    for (int32_t i = 0; r && i < nNorm; i++) {
+        NormVectorEntry e;
+        char c;
+        while (r.get(c) && c != '\0') e.type += c;
+        e.chrIdx = r.readInt32();
+        while (r.get(c) && c != '\0') e.unit += c;
+        e.binSize = r.readInt32();
+        e.position = r.readInt64();
+        e.size = version > 8 ? r.readInt64() : r.readInt32();
+        entries.push_back(e);
     }
+    return (bool)r;
+}
 
-    // a) header pointers
-    fupd.seekp(footerPosField, std::ios::beg);
-    writeInt64LE(tmp8, origFooterPos + (int64_t)delta);
-    fupd.write(tmp8,8);
+// Values of one normalization vector (float in v9, double before).
+static bool readNormVector(const HicFile& f, int32_t version, const NormVectorEntry& e,
+                           std::vector<double>& values) {
+    std::vector<char> buf((size_t)e.size);
+    if (e.size < 4 || !f.read(buf.data(), buf.size(), e.position)) return false;
+    int64_t n = version > 8 ? readInt64LE(buf.data()) : readInt32LE(buf.data());
+    size_t head = version > 8 ? 8 : 4, width = version > 8 ? 4 : 8;
+    if (n < 0 || head + (size_t)n * width > buf.size()) return false;
+    values.resize((size_t)n);
+    const char* p = buf.data() + head;
+    for (int64_t i = 0; i < n; i++, p += width) {
+        if (version > 8) { float v; std::memcpy(&v, p, 4); values[i] = v; }
+        else std::memcpy(&values[i], p, 8);
+    }
+    return true;
+}
 
-    if (version > 8) {
-        fupd.seekp(nviPosField, std::ios::beg);
-        writeInt64LE(tmp8, origNviPos + (int64_t)delta);
-        fupd.write(tmp8,8);
-        fupd.seekp(nviPosField + 8, std::ios::beg);
-        writeInt64LE(tmp8, origNviLen);
-        fupd.write(tmp8,8);
+// Expected contacts by diagonal distance for one unit and bin size, with
+// the per-chromosome factors that scale the genome-wide values.
+struct ExpectedValues {
+    std::vector<double> values;
+    std::map<int32_t, double> factors;    // chrIdx -> normalization factor
+};
+
+// Finds the expected values of `type` ("NONE" is the unnormalized section)
+// in the footer after the master index. False if the file has none.
+static bool readExpectedValues(const HicFile& f, int32_t version, int64_t masterEnd,
+                               const std::string& type, const std::string& unit, int32_t binSize,
+                               ExpectedValues& out) {
+    HicReader r(f, masterEnd);
+    bool normalized = type != "NONE";
+    if (normalized) {
+        skipExpectedValues(r, version, false);
+        if (!r || r.tell() >= f.size()) return false;
     }
+    int32_t n = r.readInt32();
+    for (int32_t i = 0; r && i < n; i++) {
+        std::string t = "NONE", u;
+        char c;
+        if (normalized) {
+            t.clear();
+            while (r.get(c) && c != '\0') t += c;
+        }
+        while (r.get(c) && c != '\0') u += c;
+        int32_t bs = r.readInt32();
+        int64_t nValues = version > 8 ? r.readInt64() : r.readInt32();
+        if (nValues < 0) return false;
+        if (t != type || u != unit || bs != binSize) {
+            r.skip(nValues * (version > 8 ? 4 : 8));
+            int32_t nFactors = r.readInt32();
+            r.skip((int64_t)nFactors * (version > 8 ? 8 : 12));
+            continue;
+        }
+        out.values.resize((size_t)nValues);
+        for (int64_t k = 0; r && k < nValues; k++) {
+            if (version > 8) { out.values[k] = readFloatLE(r); continue; }
+            char b[8] = {0};
+            r.read(b, 8);
+            std::memcpy(&out.values[k], b, 8);
+        }
+        int32_t nFactors = r.readInt32();
+        for (int32_t k = 0; r && k < nFactors; k++) {
+            int32_t chr = r.readInt32();
+            double v;
+            if (version > 8) v = readFloatLE(r);
+            else { char b[8] = {0}; r.read(b, 8); std::memcpy(&v, b, 8); }
+            out.factors[chr] = v;
+        }
+        return (bool)r;
+    }
+    return false;
+}
 
-    // b) master-index entries
-    int64_t newFooterPos = origFooterPos + (int64_t)delta;
-    fupd.seekg(newFooterPos, std::ios::beg);
+// --- Decode buffers ---
+//
+// Compressed blocks, inflated payloads and decoded columns live in
+// std::vectors whose storage is recycled through power-of-two size classes
+// (4 KiB to 64 MiB). Each thread caches a few buffers per class and spills
+// the rest to shared lists holding up to 64 MiB per element type, so once a
+// decode loop has seen its working set it allocates nothing. `bench decode`
+// and query print the counters.
 
-    // Read footer size
-    long footerSize;
-    if (version > 8) {
-        fupd.read(tmp8,8);
-        footerSize = readInt64LE(tmp8);
+struct BufferPoolStats {
+    int64_t takes, localHits, sharedHits, allocations, drops;
+};
+
+template <class T>
+class BufferPool {
+public:
+    static BufferPool& shared() {
+        static BufferPool* pool = new BufferPool;   // never destroyed: workers may outlive statics
+        return *pool;
+    }
+
+    // An empty vector with room for at least n elements.
+    std::vector<T> take(size_t n) {
+        takes_++;
+        std::vector<T> v;
+        int c = classAbove(n * sizeof(T));
+        if (c < 0) {
+            allocations_++;
+            v.reserve(n);
+            return v;
+        }
+        std::vector<std::vector<T> >& local = cache().free[c];
+        if (!local.empty()) {
+            v.swap(local.back());
+            local.pop_back();
+            localHits_++;
+            return v;
+        }
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            if (!shared_[c].empty()) {
+                v.swap(shared_[c].back());
+                shared_[c].pop_back();
+                sharedBytes_ -= v.capacity() * sizeof(T);
+                sharedHits_++;
+                return v;
+            }
+        }
+        allocations_++;
+        v.reserve(((size_t)MIN_CLASS_BYTES << c) / sizeof(T));
+        return v;
+    }
+
+    // Takes back v's storage; v is left empty without capacity.
+    void give(std::vector<T>& v) {
+        std::vector<T> held;
+        held.swap(v);
+        int c = classBelow(held.capacity() * sizeof(T));
+        if (c < 0) return;
+        held.clear();
+        std::vector<std::vector<T> >& local = cache().free[c];
+        if (local.size() < LOCAL_DEPTH) {
+            local.push_back(std::move(held));
+            return;
+        }
+        std::lock_guard<std::mutex> lk(mu_);
+        size_t bytes = held.capacity() * sizeof(T);
+        if (sharedBytes_ + bytes > SHARED_BYTES) {
+            drops_++;
+            return;
+        }
+        sharedBytes_ += bytes;
+        shared_[c].push_back(std::move(held));
+    }
+
+    BufferPoolStats stats() const {
+        BufferPoolStats st = {takes_, localHits_, sharedHits_, allocations_, drops_};
+        return st;
+    }
+
+private:
+    static const size_t MIN_CLASS_BYTES = 4096;
+    static const int NUM_CLASSES = 15;
+    static const size_t LOCAL_DEPTH = 4, SHARED_BYTES = 64 << 20;
+
+    struct Local {
+        std::vector<std::vector<T> > free[NUM_CLASSES];
+        Local() { for (auto& f : free) f.reserve(LOCAL_DEPTH); }
+    };
+
+    BufferPool() : sharedBytes_(0), takes_(0), localHits_(0), sharedHits_(0), allocations_(0), drops_(0) {}
+
+    static Local& cache() {
+        static thread_local Local local;
+        return local;
+    }
+
+    // Smallest class holding bytes, or -1 above the largest.
+    static int classAbove(size_t bytes) {
+        int c = 0;
+        while (c < NUM_CLASSES && (MIN_CLASS_BYTES << c) < bytes) c++;
+        return c < NUM_CLASSES ? c : -1;
+    }
+    // Largest class a buffer of this capacity can serve, or -1 when it is
+    // too small to keep or too large to hold on to.
+    static int classBelow(size_t bytes) {
+        if (bytes < MIN_CLASS_BYTES) return -1;
+        int c = 0;
+        while (c < NUM_CLASSES && (MIN_CLASS_BYTES << (c + 1)) <= bytes) c++;
+        return c < NUM_CLASSES ? c : -1;
+    }
+
+    std::mutex mu_;
+    std::vector<std::vector<T> > shared_[NUM_CLASSES];
+    size_t sharedBytes_;
+    std::atomic<int64_t> takes_, localHits_, sharedHits_, allocations_, drops_;
+};
+
+// Makes room for n elements in v, growing through the pool.
+template <class T>
+static void reservePooled(std::vector<T>& v, size_t n) {
+    if (v.capacity() >= n) return;
+    std::vector<T> bigger = BufferPool<T>::shared().take(n);
+    bigger.insert(bigger.end(), v.begin(), v.end());
+    BufferPool<T>::shared().give(v);
+    v.swap(bigger);
+}
+
+// Counters of the byte, int32 and float pools together.
+static BufferPoolStats decodePoolStats() {
+    BufferPoolStats a = BufferPool<char>::shared().stats(), b = BufferPool<int32_t>::shared().stats(),
+                    c = BufferPool<float>::shared().stats();
+    BufferPoolStats t = {a.takes + b.takes + c.takes, a.localHits + b.localHits + c.localHits,
+                         a.sharedHits + b.sharedHits + c.sharedHits,
+                         a.allocations + b.allocations + c.allocations, a.drops + b.drops + c.drops};
+    return t;
+}
+
+// --- Block decoding ---
+//
+// Blocks are zlib streams holding contact records. Decoded blocks are kept
+// as structure-of-arrays so later passes can stream one column at a time.
+// Their columns, like the buffers in DecodeScratch, come from the pool and
+// go back to it on destruction.
+
+struct DecodedBlock {
+    std::vector<int32_t> binX, binY;
+    std::vector<float> counts;
+
+    DecodedBlock() {}
+    DecodedBlock(const DecodedBlock&) = default;
+    DecodedBlock(DecodedBlock&&) = default;
+    DecodedBlock& operator=(const DecodedBlock&) = default;
+    DecodedBlock& operator=(DecodedBlock&&) = default;
+    ~DecodedBlock() {
+        BufferPool<int32_t>::shared().give(binX);
+        BufferPool<int32_t>::shared().give(binY);
+        BufferPool<float>::shared().give(counts);
+    }
+
+    void clear() { binX.clear(); binY.clear(); counts.clear(); }
+    size_t size() const { return counts.size(); }
+    void reserve(size_t n) { reservePooled(binX, n); reservePooled(binY, n); reservePooled(counts, n); }
+    void push(int32_t x, int32_t y, float c) { binX.push_back(x); binY.push_back(y); counts.push_back(c); }
+};
+
+// A caller's buffers for readBlock: the compressed block and its inflated
+// payload.
+struct DecodeScratch {
+    std::vector<char> compressed, inflated;
+
+    DecodeScratch() {}
+    DecodeScratch(const DecodeScratch&) = delete;
+    DecodeScratch& operator=(const DecodeScratch&) = delete;
+    ~DecodeScratch() {
+        BufferPool<char>::shared().give(compressed);
+        BufferPool<char>::shared().give(inflated);
+    }
+};
+
+// One inflate state per thread, reset for each block instead of set up and
+// torn down.
+static bool inflateBlock(const char* data, size_t n, std::vector<char>& out) {
+    struct Inflater {
+        z_stream zs;
+        bool ready;
+        Inflater() { std::memset(&zs, 0, sizeof(zs)); ready = inflateInit(&zs) == Z_OK; }
+        ~Inflater() { if (ready) inflateEnd(&zs); }
+    };
+    static thread_local Inflater inf;
+    if (!inf.ready || inflateReset(&inf.zs) != Z_OK) return false;
+    z_stream& zs = inf.zs;
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = (uInt)n;
+    out.clear();
+    reservePooled(out, std::max<size_t>(n * 4, 1024));
+    out.resize(out.capacity());
+    size_t have = 0;
+    int rc;
+    do {
+        if (have == out.size()) {
+            reservePooled(out, out.size() * 2);
+            out.resize(out.capacity());
+        }
+        zs.next_out = (Bytef*)(out.data() + have);
+        zs.avail_out = (uInt)(out.size() - have);
+        rc = inflate(&zs, Z_NO_FLUSH);
+        have = out.size() - zs.avail_out;
+    } while (rc == Z_OK);
+    out.resize(have);
+    return rc == Z_STREAM_END;
+}
+
+// Little-endian cursor over an inflated block; latches failure on overrun.
+struct BlockCursor {
+    const char* p;
+    const char* end;
+    bool ok;
+
+    bool need(size_t n) { if (ok && (size_t)(end - p) < n) ok = false; return ok; }
+    int32_t i32() { if (!need(4)) return 0; int32_t v; std::memcpy(&v, p, 4); p += 4; return v; }
+    int16_t i16() { if (!need(2)) return 0; int16_t v; std::memcpy(&v, p, 2); p += 2; return v; }
+    int8_t i8() { if (!need(1)) return 0; return (int8_t)*p++; }
+    float f32() { if (!need(4)) return 0; float v; std::memcpy(&v, p, 4); p += 4; return v; }
+    int32_t bin(bool isShort) { return isShort ? i16() : i32(); }
+};
+
+// Decode a compressed block into out (cleared first).
+static bool decodeBlock(const char* data, size_t n, int32_t version, DecodedBlock& out,
+                        std::vector<char>& scratch) {
+    out.clear();
+    if (!inflateBlock(data, n, scratch)) return false;
+    BlockCursor c = {scratch.data(), scratch.data() + scratch.size(), true};
+    int32_t nRecords = c.i32();
+    if (nRecords < 0) return false;
+    out.reserve((size_t)nRecords);
+
+    if (version < 7) {
+        for (int32_t i = 0; c.ok && i < nRecords; i++) {
+            int32_t x = c.i32(), y = c.i32();
+            out.push(x, y, c.f32());
+        }
+        return c.ok;
+    }
+
+    int32_t binXOffset = c.i32();
+    int32_t binYOffset = c.i32();
+    bool useShortCounts = c.i8() == 0;   // the flag is 0 for short counts
+    bool shortX = true, shortY = true;
+    if (version > 8) {                   // and so are the bin-width flags
+        shortX = c.i8() == 0;
+        shortY = c.i8() == 0;
+    }
+    int8_t type = c.i8();
+    if (type == 1) {
+        // Rows of (y, [x, count]...); y/row counts follow shortY, x/column
+        // counts follow shortX.
+        int32_t rowCount = c.bin(shortY);
+        for (int32_t i = 0; c.ok && i < rowCount; i++) {
+            int32_t y = c.bin(shortY) + binYOffset;
+            int32_t colCount = c.bin(shortX);
+            for (int32_t j = 0; c.ok && j < colCount; j++) {
+                int32_t x = c.bin(shortX) + binXOffset;
+                float v = useShortCounts ? (float)c.i16() : c.f32();
+                out.push(x, y, v);
+            }
+        }
+    } else if (type == 2) {
+        // Dense w-wide grid; missing cells are -32768 or NaN.
+        int32_t nPts = c.i32();
+        int32_t w = c.i16();
+        if (w <= 0) return false;
+        for (int32_t i = 0; c.ok && i < nPts; i++) {
+            int32_t row = i / w, col = i - row * w;
+            if (useShortCounts) {
+                int16_t v = c.i16();
+                if (v != -32768) out.push(binXOffset + col, binYOffset + row, v);
+            } else {
+                float v = c.f32();
+                if (!std::isnan(v)) out.push(binXOffset + col, binYOffset + row, v);
+            }
+        }
     } else {
-        fupd.read(tmp4,4);
-        footerSize = readInt32LE(tmp4);
+        return false;
     }
+    return c.ok;
+}
 
-    // Read number of entries
-    fupd.read(tmp4,4);
-    int32_t nEntries = readInt32LE(tmp4);
+// Read and decode one indexed block.
+static bool readBlock(const HicFile& f, int32_t version, const BlockIndexEntry& b,
+                      DecodedBlock& out, DecodeScratch& scratch) {
+    if (b.size <= 0) { out.clear(); return b.size == 0; }
+    std::vector<char>& compressed = scratch.compressed;
+    compressed.clear();
+    reservePooled(compressed, (size_t)b.size);
+    compressed.resize((size_t)b.size);
+    return f.read(compressed.data(), compressed.size(), b.position) &&
+           decodeBlock(compressed.data(), compressed.size(), version, out, scratch.inflated);
+}
 
-    // Update each master index entry
-    for (int32_t i = 0; i < nEntries; i++) {
-        // Skip key string
-        char ch;
-        do { fupd.get(ch); } while(ch!='\0');
-        
-        // Update position
-        std::streamoff posField = fupd.tellg();
-        fupd.read(tmp8,8);
-        int64_t origPos = readInt64LE(tmp8);
-        writeInt64LE(tmp8, origPos + (int64_t)delta);
-        fupd.seekp(posField, std::ios::beg);
-        fupd.write(tmp8,8);
-        fupd.seekg(4, std::ios::cur); // Skip size field
+// --- Normalization kernels ---
+//
+// Normalizing a decoded block is a gather from two norm vectors (and, for
+// observed/expected, one expected vector indexed by |x - y|) per contact.
+// The SoA columns let AVX2 and AVX-512 do that 4 or 8 contacts at a time
+// with masked gathers; the best kernel the CPU supports is picked once at
+// run time, and all of them give bit-identical results to the scalar one.
+// As in straw, a bin outside a vector reads as NaN and a NaN or zero norm
+// leaves a NaN or infinite value, which callers drop.
+
+struct NormTables {
+    const double* n1;                     // nullptr: observed counts
+    size_t len1;
+    const double* n2;
+    size_t len2;
+    const double* expected;               // nullptr: no O/E; one value for inter matrices
+    size_t nExpected;
+};
+
+typedef void (*NormKernel)(const NormTables& t, const int32_t* x, const int32_t* y,
+                           const float* counts, size_t n, double* out);
+
+// out[i] = counts[i] / (n1[x] * n2[y]), then / expected[min(|x - y|, nExpected - 1)].
+static void normalizeScalar(const NormTables& t, const int32_t* x, const int32_t* y,
+                            const float* counts, size_t n, double* out) {
+    for (size_t i = 0; i < n; i++) {
+        double v = counts[i];
+        if (t.n1) {
+            double a = (uint32_t)x[i] < t.len1 ? t.n1[x[i]] : NAN;
+            double b = (uint32_t)y[i] < t.len2 ? t.n2[y[i]] : NAN;
+            v /= a * b;
+        }
+        if (t.expected) {
+            uint32_t d = (uint32_t)std::abs((int64_t)x[i] - y[i]);
+            v /= t.expected[std::min<size_t>(d, t.nExpected - 1)];
+        }
+        out[i] = v;
+    }
+}
+
+#ifdef HIC_X86_KERNELS
+// Lanes with 0 <= idx < len, widened to a 64-bit gather mask.
+__attribute__((target("avx2")))
+static inline __m256d inRangeAvx2(__m128i idx, __m128i len, __m128i zero) {
+    __m128i m = _mm_andnot_si128(_mm_cmpgt_epi32(zero, idx), _mm_cmpgt_epi32(len, idx));
+    return _mm256_castsi256_pd(_mm256_cvtepi32_epi64(m));
+}
+
+__attribute__((target("avx2")))
+static void normalizeAvx2(const NormTables& t, const int32_t* x, const int32_t* y,
+                          const float* counts, size_t n, double* out) {
+    const __m256d nan = _mm256_set1_pd(NAN);
+    const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i len1 = _mm_set1_epi32((int32_t)std::min<size_t>(t.len1, INT32_MAX));
+    const __m128i len2 = _mm_set1_epi32((int32_t)std::min<size_t>(t.len2, INT32_MAX));
+    const __m128i lastE = _mm_set1_epi32((int32_t)std::min<size_t>(t.nExpected - 1, INT32_MAX));
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i xi = _mm_loadu_si128((const __m128i*)(x + i));
+        __m128i yi = _mm_loadu_si128((const __m128i*)(y + i));
+        __m256d v = _mm256_cvtps_pd(_mm_loadu_ps(counts + i));
+        if (t.n1) {
+            __m256d a = _mm256_mask_i32gather_pd(nan, t.n1, xi, inRangeAvx2(xi, len1, zero), 8);
+            __m256d b = _mm256_mask_i32gather_pd(nan, t.n2, yi, inRangeAvx2(yi, len2, zero), 8);
+            v = _mm256_div_pd(v, _mm256_mul_pd(a, b));
+        }
+        if (t.expected) {
+            __m128i d = _mm_min_epu32(_mm_abs_epi32(_mm_sub_epi32(xi, yi)), lastE);
+            v = _mm256_div_pd(v, _mm256_mask_i32gather_pd(nan, t.expected, d, all, 8));
+        }
+        _mm256_storeu_pd(out + i, v);
+    }
+    normalizeScalar(t, x + i, y + i, counts + i, n - i, out + i);
+}
+
+__attribute__((target("avx512f")))
+static void normalizeAvx512(const NormTables& t, const int32_t* x, const int32_t* y,
+                            const float* counts, size_t n, double* out) {
+    const __m512d nan = _mm512_set1_pd(NAN);
+    const __m512i len1 = _mm512_set1_epi64((int64_t)t.len1);
+    const __m512i len2 = _mm512_set1_epi64((int64_t)t.len2);
+    const __m512i lastE = _mm512_set1_epi64((int64_t)t.nExpected - 1);
+    const __mmask8 all = 0xff;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i xi = _mm256_loadu_si256((const __m256i*)(x + i));
+        __m256i yi = _mm256_loadu_si256((const __m256i*)(y + i));
+        __m512i x64 = _mm512_maskz_cvtepi32_epi64(all, xi), y64 = _mm512_maskz_cvtepi32_epi64(all, yi);
+        __m512d v = _mm512_maskz_cvtps_pd(all, _mm256_loadu_ps(counts + i));
+        if (t.n1) {
+            // Unsigned compares also reject negative bins.
+            __m512d a = _mm512_mask_i32gather_pd(nan, _mm512_cmplt_epu64_mask(x64, len1), xi, t.n1, 8);
+            __m512d b = _mm512_mask_i32gather_pd(nan, _mm512_cmplt_epu64_mask(y64, len2), yi, t.n2, 8);
+            v = _mm512_div_pd(v, _mm512_mul_pd(a, b));
+        }
+        if (t.expected) {
+            __m512i d = _mm512_maskz_min_epu64(all, _mm512_maskz_abs_epi64(all, _mm512_sub_epi64(x64, y64)), lastE);
+            v = _mm512_div_pd(v, _mm512_mask_i64gather_pd(nan, all, d, t.expected, 8));
+        }
+        _mm512_storeu_pd(out + i, v);
+    }
+    normalizeScalar(t, x + i, y + i, counts + i, n - i, out + i);
+}
+#endif
+
+// The kernels this CPU can run, scalar first and best last.
+static std::vector<std::pair<const char*, NormKernel> > normKernels() {
+    std::vector<std::pair<const char*, NormKernel> > k;
+    k.push_back(std::make_pair("scalar", &normalizeScalar));
+#ifdef HIC_X86_KERNELS
+    if (__builtin_cpu_supports("avx2")) k.push_back(std::make_pair("avx2", &normalizeAvx2));
+    if (__builtin_cpu_supports("avx512f")) k.push_back(std::make_pair("avx512", &normalizeAvx512));
+#endif
+    return k;
+}
+
+// Normalizes a decoded block into out (resized to the block's size).
+static void normalizeBlock(const NormTables& t, const DecodedBlock& b, std::vector<double>& out) {
+    static const NormKernel best = normKernels().back().second;
+    out.resize(b.size());
+    best(t, b.binX.data(), b.binY.data(), b.counts.data(), b.size(), out.data());
+}
+
+// --- Block and record encoding ---
+
+static void appendInt32(std::vector<char>& out, int32_t v) {
+    char b[4]; writeInt32LE(b, v); out.insert(out.end(), b, b + 4);
+}
+static void appendInt64(std::vector<char>& out, int64_t v) {
+    char b[8]; writeInt64LE(b, v); out.insert(out.end(), b, b + 8);
+}
+static void appendInt16(std::vector<char>& out, int16_t v) {
+    char b[2]; std::memcpy(b, &v, 2); out.insert(out.end(), b, b + 2);
+}
+static void appendFloat(std::vector<char>& out, float v) {
+    char b[4]; std::memcpy(b, &v, 4); out.insert(out.end(), b, b + 4);
+}
+static void appendDouble(std::vector<char>& out, double v) {
+    char b[8]; std::memcpy(b, &v, 8); out.insert(out.end(), b, b + 8);
+}
+static void appendString(std::vector<char>& out, const std::string& s) {
+    out.insert(out.end(), s.begin(), s.end());
+    out.push_back('\0');
+}
+
+// Block holding (binX, binY). v9 intra-chromosomal matrices tile along the
+// diagonal: the column is the position along the diagonal and the row the
+// log2 depth away from it. Everything else uses a plain row/column grid.
+static int32_t blockNumberFor(int32_t version, bool intra, int32_t binX, int32_t binY,
+                              int32_t blockBinCount, int32_t blockColumnCount) {
+    if (version > 8 && intra) {
+        int32_t positionAlongDiagonal = (binX + binY) / 2 / blockBinCount;
+        int32_t depth = (int32_t)std::log2(1 + std::abs(binX - binY) / std::sqrt(2.0) / blockBinCount);
+        return depth * blockColumnCount + positionAlongDiagonal;
+    }
+    return (binY / blockBinCount) * blockColumnCount + binX / blockBinCount;
+}
+
+struct ContactCell {
+    int32_t binX, binY;
+    float count;
+
+    bool operator<(const ContactCell& o) const {
+        return binY != o.binY ? binY < o.binY : binX < o.binX;
+    }
+};
+
+// Encode cells (sorted by binY, then binX) as a type-1 block and deflate it
+// into out. Bins and counts are written as shorts whenever they fit. Fails
+// only for pre-v9 blocks whose bin span does not fit a short.
+static bool encodeBlock(const ContactCell* cells, size_t n, int32_t version,
+                        std::vector<char>& out, std::vector<char>& raw) {
+    int32_t minX = INT32_MAX, maxX = INT32_MIN, minY = INT32_MAX, maxY = INT32_MIN;
+    bool shortCounts = true;
+    for (size_t i = 0; i < n; i++) {
+        minX = std::min(minX, cells[i].binX); maxX = std::max(maxX, cells[i].binX);
+        minY = std::min(minY, cells[i].binY); maxY = std::max(maxY, cells[i].binY);
+        float c = cells[i].count;
+        if (c != std::floor(c) || std::fabs(c) > 32767) shortCounts = false;
     }
+    if (n == 0) { minX = maxX = minY = maxY = 0; }
+    bool shortX = (int64_t)maxX - minX < 32767;
+    bool shortY = (int64_t)maxY - minY < 32767;
+    if (version <= 8 && (!shortX || !shortY)) return false;
 
-    // c) normalization-vector index (if version > 8)
+    raw.clear();
+    appendInt32(raw, (int32_t)n);
+    appendInt32(raw, minX);
+    appendInt32(raw, minY);
+    raw.push_back(shortCounts ? 0 : 1);
     if (version > 8) {
-        int64_t newNviPos = origNviPos + (int64_t)delta;
-        fupd.seekg(newNviPos, std::ios::beg);
-        fupd.read(tmp4,4);
-        int32_t nNorm = readInt32LE(tmp4);
-        
-        for (int i = 0; i < nNorm; i++) {
-            // Skip type string
-            char ch;
-            do { fupd.get(ch); } while(ch!='\0');
-            fupd.seekg(4, std::ios::cur); // Skip chrIdx
-            // Skip unit string
-            do { fupd.get(ch); } while(ch!='\0');
-            fupd.seekg(4, std::ios::cur); // Skip resolution
-            
-            // Update position
-            std::streamoff pp = fupd.tellg();
-            fupd.read(tmp8,8);
-            int64_t oP = readInt64LE(tmp8);
-            writeInt64LE(tmp8, oP + (int64_t)delta);
-            fupd.seekp(pp, std::ios::beg);
-            fupd.write(tmp8,8);
-            fupd.seekg(8, std::ios::cur); // Skip sizeInBytes
-        }
-    }
-
-    fupd.close();
-    std::cout << "Successfully wrote " << outPath
-              << " with statistics/graphs inserted after software, pointers bumped by "
-              << delta << " bytes.\n";
-    return 0;
-} 
\ No newline at end of file
+        raw.push_back(shortX ? 0 : 1);
+        raw.push_back(shortY ? 0 : 1);
+    }
+    raw.push_back(1);                     // type 1: list of rows
+
+    auto putBin = [&raw](bool isShort, int32_t v) {
+        if (isShort) appendInt16(raw, (int16_t)v); else appendInt32(raw, v);
+    };
+    int32_t rowCount = 0;
+    for (size_t i = 0; i < n; i++)
+        if (i == 0 || cells[i].binY != cells[i - 1].binY) rowCount++;
+    putBin(shortY, rowCount);
+    for (size_t i = 0; i < n; ) {
+        size_t j = i;
+        while (j < n && cells[j].binY == cells[i].binY) j++;
+        putBin(shortY, cells[i].binY - minY);
+        putBin(shortX, (int32_t)(j - i));
+        for (size_t k = i; k < j; k++) {
+            putBin(shortX, cells[k].binX - minX);
+            if (shortCounts) appendInt16(raw, (int16_t)cells[k].count);
+            else appendFloat(raw, cells[k].count);
+        }
+        i = j;
+    }
+
+    uLongf outLen = compressBound((uLong)raw.size());
+    out.resize(outLen);
+    if (compress2((Bytef*)out.data(), &outLen, (const Bytef*)raw.data(), (uLong)raw.size(),
+                  Z_DEFAULT_COMPRESSION) != Z_OK) return false;
+    out.resize(outLen);
+    return true;
+}
+
+static void appendMatrixRecord(std::vector<char>& out, const MatrixRecord& m) {
+    appendInt32(out, m.chr1);
+    appendInt32(out, m.chr2);
+    appendInt32(out, (int32_t)m.resolutions.size());
+    for (const auto& z : m.resolutions) {
+        appendString(out, z.unit);
+        appendInt32(out, z.resIdx);
+        appendFloat(out, z.sumCounts);
+        appendFloat(out, z.occupiedCellCount);
+        appendFloat(out, z.percent5);
+        appendFloat(out, z.percent95);
+        appendInt32(out, z.binSize);
+        appendInt32(out, z.blockBinCount);
+        appendInt32(out, z.blockColumnCount);
+        appendInt32(out, (int32_t)z.blocks.size());
+        for (const auto& b : z.blocks) {
+            appendInt32(out, b.number);
+            appendInt64(out, b.position);
+            appendInt32(out, b.size);
+        }
+    }
+}
+
+// Output file with an atomic append cursor for parallel writers.
+struct OutputSink {
+    HicFile file;
+    std::atomic<uint64_t> cursor;
+    std::atomic<bool> ok;
+    uint64_t alignment;
+
+    explicit OutputSink(uint64_t align = 1) : cursor(0), ok(true), alignment(align) {}
+
+    // Claim len bytes at the next aligned offset.
+    uint64_t claim(uint64_t len) {
+        uint64_t want = (len + alignment - 1) / alignment * alignment;
+        return cursor.fetch_add(want);
+    }
+    void write(const void* p, size_t n, uint64_t off) {
+        if (n && !file.write(p, n, (int64_t)off)) ok = false;
+    }
+    uint64_t append(const std::vector<char>& bytes) {
+        uint64_t off = claim(bytes.size());
+        write(bytes.data(), bytes.size(), off);
+        return off;
+    }
+};
+
+// --- Hashing ---
+//
+// XXH64 fingerprints of byte ranges, read from the file in bounded
+// pieces.
+
+// Streaming XXH64 (seed 0).
+class Xxh64 {
+public:
+    Xxh64() : total_(0), buffered_(0) {
+        v_[0] = P1 + P2;
+        v_[1] = P2;
+        v_[2] = 0;
+        v_[3] = 0 - P1;
+    }
+
+    void update(const void* data, size_t n) {
+        const unsigned char* p = (const unsigned char*)data;
+        total_ += n;
+        if (buffered_ + n < 32) {
+            std::memcpy(buf_ + buffered_, p, n);
+            buffered_ += n;
+            return;
+        }
+        if (buffered_) {
+            size_t fill = 32 - buffered_;
+            std::memcpy(buf_ + buffered_, p, fill);
+            stripe(buf_);
+            p += fill;
+            n -= fill;
+            buffered_ = 0;
+        }
+        for (; n >= 32; p += 32, n -= 32) stripe(p);
+        std::memcpy(buf_, p, n);
+        buffered_ = n;
+    }
+
+    uint64_t digest() const {
+        uint64_t h;
+        if (total_ >= 32) {
+            h = rotl(v_[0], 1) + rotl(v_[1], 7) + rotl(v_[2], 12) + rotl(v_[3], 18);
+            for (int i = 0; i < 4; i++) h = (h ^ round(0, v_[i])) * P1 + P4;
+        } else {
+            h = P5;
+        }
+        h += total_;
+        const unsigned char* p = buf_;
+        size_t n = buffered_;
+        for (; n >= 8; p += 8, n -= 8) h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+        if (n >= 4) {
+            uint32_t k;
+            std::memcpy(&k, p, 4);
+            h = rotl(h ^ (uint64_t)k * P1, 23) * P2 + P3;
+            p += 4;
+            n -= 4;
+        }
+        for (; n > 0; p++, n--) h = rotl(h ^ *p * P5, 11) * P1;
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        return h ^ (h >> 32);
+    }
+
+private:
+    static const uint64_t P1 = 11400714785074694791ULL, P2 = 14029467366897019727ULL,
+                          P3 = 1609587929392839161ULL, P4 = 9650029242287828579ULL,
+                          P5 = 2870177450012600261ULL;
+
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    static uint64_t round(uint64_t acc, uint64_t in) { return rotl(acc + in * P2, 31) * P1; }
+    static uint64_t read64(const unsigned char* p) { uint64_t v; std::memcpy(&v, p, 8); return v; }
+
+    void stripe(const unsigned char* p) {
+        for (int i = 0; i < 4; i++) v_[i] = round(v_[i], read64(p + 8 * i));
+    }
+
+    uint64_t v_[4];
+    uint64_t total_;
+    unsigned char buf_[32];
+    size_t buffered_;
+};
+
+// XXH64 of [off, off+n) of f, read in pieces.
+static bool hashRange(const HicFile& f, int64_t off, int64_t n, uint64_t& out) {
+    Xxh64 h;
+    std::vector<char> buf((size_t)std::min<int64_t>(n, STREAM_PIECE));
+    while (n > 0) {
+        size_t len = (size_t)std::min<int64_t>(n, (int64_t)buf.size());
+        if (!f.read(buf.data(), len, off)) return false;
+        h.update(buf.data(), len);
+        off += (int64_t)len;
+        n -= (int64_t)len;
+    }
+    out = h.digest();
+    return true;
+}
+
+// --- Metadata cache ---
+//
+// Read-only modes start from the same parsed metadata: the header, the
+// master index and the normalization-vector index. With HIC_METADATA_CACHE
+// naming a directory, loadMetadata keeps one entry per file there, keyed by
+// device, inode, size, mtime and an XXH64 of the header bytes. A repeat run
+// costs a stat, one header read and a mapping of the entry instead of a
+// walk of the footer. An entry that no longer matches is rebuilt. Entries
+// are written under a temporary name and renamed, so concurrent runs never
+// see a torn one.
+
+struct HicMetadata {
+    HicHeader h;
+    std::vector<MasterEntry> master;
+    int64_t masterEnd;
+    int64_t nviPos;                       // 0 when the file has no index
+    std::vector<NormVectorEntry> norms;   // read when asked for, or cached
+    bool cached;                          // loaded from the cache
+};
+
+// Fixed part of a cache entry; the encoded metadata follows.
+struct MetaCacheHeader {
+    char magic[8];
+    uint32_t formatVersion;
+    uint32_t reserved;
+    uint64_t dev, ino;
+    int64_t size, mtimeSec, mtimeNsec;
+    int64_t headerLen;                    // bytes of the .hic covered by headerHash
+    uint64_t headerHash;
+    uint64_t payloadLen, payloadHash;
+};
+static_assert(sizeof(MetaCacheHeader) == 88, "MetaCacheHeader layout");
+
+static const char META_CACHE_MAGIC[8] = {'H', 'I', 'C', 'M', 'E', 'T', 'A', '\0'};
+static const uint32_t META_CACHE_FORMAT = 1;
+
+// Bounds-checked reader over a mapped entry. Like HicReader it latches
+// failure; arrays of fixed-width values are copied in bulk.
+class MetaCursor {
+public:
+    MetaCursor(const char* p, size_t n) : p_(p), end_(p + n), ok_(true) {}
+
+    const char* take(size_t n) {
+        if (!ok_ || (size_t)(end_ - p_) < n) { ok_ = false; return nullptr; }
+        const char* r = p_;
+        p_ += n;
+        return r;
+    }
+    int32_t i32() { const char* p = take(4); return p ? readInt32LE(p) : 0; }
+    int64_t i64() { const char* p = take(8); return p ? readInt64LE(p) : 0; }
+    std::string str() {
+        int32_t n = i32();
+        const char* p = n >= 0 ? take((size_t)n) : nullptr;
+        return p ? std::string(p, (size_t)n) : std::string();
+    }
+    template <class T> void array(std::vector<T>& v) {
+        int64_t n = i64();
+        const char* p = n >= 0 && (uint64_t)n <= (uint64_t)(end_ - p_) / sizeof(T) ? take((size_t)n * sizeof(T)) : nullptr;
+        v.resize(p ? (size_t)n : 0);
+        if (p && n > 0) std::memcpy(v.data(), p, (size_t)n * sizeof(T));
+        if (!p) ok_ = false;
+    }
+    bool ok() const { return ok_; }
+    bool atEnd() const { return ok_ && p_ == end_; }
+
+private:
+    const char* p_;
+    const char* end_;
+    bool ok_;
+};
+
+static void encodeMetadata(const HicMetadata& m, std::vector<char>& out) {
+    auto str = [&](const std::string& s) {
+        appendInt32(out, (int32_t)s.size());
+        out.insert(out.end(), s.begin(), s.end());
+    };
+    auto array = [&](const void* p, size_t n, size_t width) {
+        appendInt64(out, (int64_t)n);
+        out.insert(out.end(), (const char*)p, (const char*)p + n * width);
+    };
+    const HicHeader& h = m.h;
+    appendInt32(out, h.version);
+    appendInt64(out, (int64_t)h.footerPosField);
+    appendInt64(out, (int64_t)h.nviPosField);
+    appendInt64(out, (int64_t)h.attrCountField);
+    appendInt64(out, h.footerPos);
+    appendInt64(out, h.nviPos);
+    appendInt64(out, h.nviLen);
+    array(h.headerBuf.data(), h.headerBuf.size(), 1);
+    appendInt32(out, (int32_t)h.attrs.size());
+    for (const auto& a : h.attrs) { str(a.key); str(a.value); }
+    appendInt64(out, h.chrDictStart);
+    array(h.chrDictBuf.data(), h.chrDictBuf.size(), 1);
+    appendInt32(out, (int32_t)h.chrNames.size());
+    for (const auto& n : h.chrNames) str(n);
+    array(h.chrLengths.data(), h.chrLengths.size(), 8);
+    array(h.resolutionBuf.data(), h.resolutionBuf.size(), 1);
+    array(h.bpResolutions.data(), h.bpResolutions.size(), 4);
+    array(h.fragResolutions.data(), h.fragResolutions.size(), 4);
+    appendInt64(out, h.sitesStart);
+    appendInt64(out, (int64_t)h.sites.size());
+    for (const auto& s : h.sites) { appendInt64(out, s.offset); appendInt32(out, s.count); }
+    appendInt64(out, (int64_t)h.dataStart);
+
+    appendInt32(out, (int32_t)m.master.size());
+    for (const auto& e : m.master) {
+        str(e.key);
+        appendInt64(out, e.position);
+        appendInt32(out, e.size);
+        appendInt64(out, e.fieldOffset);
+    }
+    appendInt64(out, m.masterEnd);
+    appendInt64(out, m.nviPos);
+    appendInt32(out, (int32_t)m.norms.size());
+    for (const auto& e : m.norms) {
+        str(e.type);
+        appendInt32(out, e.chrIdx);
+        str(e.unit);
+        appendInt32(out, e.binSize);
+        appendInt64(out, e.position);
+        appendInt64(out, e.size);
+    }
+}
+
+static bool decodeMetadata(MetaCursor& c, HicMetadata& m) {
+    HicHeader& h = m.h;
+    h.version = c.i32();
+    h.footerPosField = (size_t)c.i64();
+    h.nviPosField = (size_t)c.i64();
+    h.attrCountField = (size_t)c.i64();
+    h.footerPos = c.i64();
+    h.nviPos = c.i64();
+    h.nviLen = c.i64();
+    c.array(h.headerBuf);
+    int32_t nAttrs = c.i32();
+    h.attrs.clear();
+    for (int32_t i = 0; c.ok() && i < nAttrs; i++) {
+        AttrKV a;
+        a.key = c.str();
+        a.value = c.str();
+        h.attrs.push_back(a);
+    }
+    h.chrDictStart = c.i64();
+    c.array(h.chrDictBuf);
+    int32_t nChrs = c.i32();
+    h.chrNames.clear();
+    for (int32_t i = 0; c.ok() && i < nChrs; i++) h.chrNames.push_back(c.str());
+    c.array(h.chrLengths);
+    c.array(h.resolutionBuf);
+    c.array(h.bpResolutions);
+    c.array(h.fragResolutions);
+    h.sitesStart = c.i64();
+    int64_t nSites = c.i64();
+    h.sites.clear();
+    for (int64_t i = 0; c.ok() && i < nSites; i++) {
+        SiteSpan s;
+        s.offset = c.i64();
+        s.count = c.i32();
+        h.sites.push_back(s);
+    }
+    h.dataStart = (size_t)c.i64();
+
+    int32_t nMaster = c.i32();
+    m.master.clear();
+    for (int32_t i = 0; c.ok() && i < nMaster; i++) {
+        MasterEntry e;
+        e.key = c.str();
+        e.position = c.i64();
+        e.size = c.i32();
+        e.fieldOffset = c.i64();
+        m.master.push_back(e);
+    }
+    m.masterEnd = c.i64();
+    m.nviPos = c.i64();
+    int32_t nNorms = c.i32();
+    m.norms.clear();
+    for (int32_t i = 0; c.ok() && i < nNorms; i++) {
+        NormVectorEntry e;
+        e.type = c.str();
+        e.chrIdx = c.i32();
+        e.unit = c.str();
+        e.binSize = c.i32();
+        e.position = c.i64();
+        e.size = c.i64();
+        m.norms.push_back(e);
+    }
+    return c.atEnd() && (int64_t)h.chrNames.size() == (int64_t)h.chrLengths.size();
+}
+
+static std::string metadataCachePath(const std::string& dir, const struct stat& st) {
+    Xxh64 id;
+    uint64_t key[2] = {(uint64_t)st.st_dev, (uint64_t)st.st_ino};
+    id.update(key, sizeof(key));
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.meta", (unsigned long long)id.digest());
+    return dir + "/" + name;
+}
+
+static bool readMetadataCache(const HicFile& f, const struct stat& st, const std::string& entry,
+                              HicMetadata& m) {
+    int fd = ::open(entry.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat cs;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &cs) == 0 && cs.st_size >= (off_t)sizeof(MetaCacheHeader))
+        map = mmap(nullptr, (size_t)cs.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) return false;
+
+    const char* p = (const char*)map;
+    MetaCacheHeader ch;
+    std::memcpy(&ch, p, sizeof(ch));
+    bool ok = std::memcmp(ch.magic, META_CACHE_MAGIC, 8) == 0 && ch.formatVersion == META_CACHE_FORMAT &&
+              ch.dev == (uint64_t)st.st_dev && ch.ino == (uint64_t)st.st_ino &&
+              ch.size == (int64_t)st.st_size && ch.mtimeSec == (int64_t)st.st_mtim.tv_sec &&
+              ch.mtimeNsec == (int64_t)st.st_mtim.tv_nsec &&
+              ch.payloadLen == (uint64_t)cs.st_size - sizeof(ch) && ch.headerLen >= 0;
+    if (ok) {
+        Xxh64 payload;
+        payload.update(p + sizeof(ch), (size_t)ch.payloadLen);
+        uint64_t headerHash;
+        ok = payload.digest() == ch.payloadHash && hashRange(f, 0, ch.headerLen, headerHash) &&
+             headerHash == ch.headerHash;
+    }
+    if (ok) {
+        MetaCursor c(p + sizeof(ch), (size_t)ch.payloadLen);
+        ok = decodeMetadata(c, m) && m.h.sitesStart == ch.headerLen;
+    }
+    munmap(map, (size_t)cs.st_size);
+    return ok;
+}
+
+// Best effort: a cache that cannot be written is simply not used.
+static void writeMetadataCache(const HicFile& f, const struct stat& st, const std::string& dir,
+                               const std::string& entry, const HicMetadata& m) {
+    MetaCacheHeader ch;
+    std::memset(&ch, 0, sizeof(ch));
+    std::memcpy(ch.magic, META_CACHE_MAGIC, 8);
+    ch.formatVersion = META_CACHE_FORMAT;
+    ch.dev = (uint64_t)st.st_dev;
+    ch.ino = (uint64_t)st.st_ino;
+    ch.size = (int64_t)st.st_size;
+    ch.mtimeSec = (int64_t)st.st_mtim.tv_sec;
+    ch.mtimeNsec = (int64_t)st.st_mtim.tv_nsec;
+    ch.headerLen = m.h.sitesStart;
+    if (!hashRange(f, 0, ch.headerLen, ch.headerHash)) return;
+    std::vector<char> buf(sizeof(ch));
+    encodeMetadata(m, buf);
+    Xxh64 payload;
+    payload.update(buf.data() + sizeof(ch), buf.size() - sizeof(ch));
+    ch.payloadLen = buf.size() - sizeof(ch);
+    ch.payloadHash = payload.digest();
+    std::memcpy(buf.data(), &ch, sizeof(ch));
+
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) return;
+    std::string tmp = entry + ".tmp." + std::to_string(getpid()) + "." +
+                      std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    HicFile out;
+    if (!out.open(tmp, O_WRONLY | O_CREAT | O_TRUNC)) return;
+    bool ok = out.write(buf.data(), buf.size(), 0) && out.close();
+    if (!ok || std::rename(tmp.c_str(), entry.c_str()) != 0) std::remove(tmp.c_str());
+}
+
+static bool parseMetadata(const HicFile& f, const std::string& path, HicMetadata& m, bool norms) {
+    m.master.clear();
+    m.norms.clear();
+    m.cached = false;
+    if (!parseHicHeader(f, path, m.h)) return false;
+    if (!scanMasterIndex(f, m.h.footerPos, m.h.version, m.master, m.masterEnd)) {
+        std::cerr << "Error: cannot read master index of " << path << std::endl;
+        return false;
+    }
+    m.nviPos = locateNormVectorIndex(f, m.h, m.masterEnd, 0);
+    if (norms && m.nviPos > 0 && !readNormVectorIndex(f, m.nviPos, m.h.version, m.norms)) {
+        std::cerr << "Error: cannot read normalization-vector index of " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Header, master index and, when norms is set or the cache is on, the
+// normalization-vector index of f.
+static bool loadMetadata(const HicFile& f, const std::string& path, HicMetadata& m, bool norms) {
+    const char* dir = std::getenv("HIC_METADATA_CACHE");
+    struct stat st;
+    if (!dir || !*dir || fstat(f.fd(), &st) != 0) return parseMetadata(f, path, m, norms);
+    std::string entry = metadataCachePath(dir, st);
+    if (readMetadataCache(f, st, entry, m)) {
+        m.cached = true;
+        return true;
+    }
+    if (!parseMetadata(f, path, m, true)) return false;
+    writeMetadataCache(f, st, dir, entry, m);
+    return true;
+}
+
+// --- Relocation ---
+//
+// Every pointer in a .hic is an absolute file offset into the region after
+// the header, so growing or shrinking the header by delta shifts them all by
+// delta: the header's footer/NVI fields, the master index, the block index
+// of every matrix record, and the normalization-vector index.
+
+// Memory for pointer patching (--max-memory in the header-update and batch
+// modes). Footers, normalization-vector indices and matrix records are
+// streamed through fixed windows sized from it, so fragment-resolution maps
+// with huge indices relocate in bounded memory.
+static int64_t g_relocMemory = 256 << 20;
+
+static size_t relocWindow() {
+    int64_t w = g_relocMemory / (2 * ((int64_t)ThreadPool::shared().size() + 1));
+    return (size_t)std::min<int64_t>(std::max<int64_t>(w, 64 << 10), 64 << 20);
+}
+
+// Shifts 8-byte pointer fields by delta inside a window of the file that is
+// written back when the next field falls outside it. Fields visited in
+// increasing order are patched in bulk, one read and one write per window;
+// any order is still correct.
+class WindowPatcher {
+public:
+    WindowPatcher(const HicFile& f, int64_t delta, size_t window)
+        : f_(f), delta_(delta), buf_(std::max<size_t>(window, 8)), start_(0), len_(0), dirty_(0), ok_(true) {}
+
+    void add(int64_t field) {
+        if (field < start_ || field + 8 > start_ + (int64_t)len_) {
+            flush();
+            int64_t n = f_.readUpTo(buf_.data(), buf_.size(), field);
+            start_ = field;
+            len_ = n > 0 ? (size_t)n : 0;
+            if (len_ < 8) ok_ = false;
+        }
+        if (!ok_) return;
+        char* p = buf_.data() + (field - start_);
+        writeInt64LE(p, readInt64LE(p) + delta_);
+        dirty_ = std::max(dirty_, (size_t)(field - start_) + 8);
+    }
+
+    bool finish() {
+        flush();
+        return ok_;
+    }
+
+private:
+    void flush() {
+        if (dirty_ && ok_ && !f_.write(buf_.data(), dirty_, start_)) ok_ = false;
+        dirty_ = 0;
+    }
+
+    const HicFile& f_;
+    int64_t delta_;
+    std::vector<char> buf_;
+    int64_t start_;
+    size_t len_, dirty_;
+    bool ok_;
+};
+
+// Block-index position fields of the record at pos, streamed: each
+// resolution's entries are a fixed 16-byte stride after its header.
+static bool patchMatrixRecord(const HicFile& f, int64_t pos, int64_t delta, size_t window) {
+    HicReader r(f, pos, window);
+    WindowPatcher patch(f, delta, window);
+    r.skip(8);                            // chr1, chr2
+    int32_t nRes = r.readInt32();
+    for (int32_t i = 0; r && i < nRes; i++) {
+        r.skipString();                   // unit
+        r.skip(4 + 16 + 12);              // resIdx, sums and percentiles, bin and block sizes
+        int32_t nBlocks = r.readInt32();
+        int64_t first = r.tell();
+        for (int32_t b = 0; b < nBlocks; b++) patch.add(first + (int64_t)b * 16 + 4);
+        r.seek(first + (int64_t)nBlocks * 16);
+    }
+    return r && patch.finish();
+}
+
+static bool relocateBody(const HicFile& f, const HicHeader& h, int64_t delta) {
+    if (delta == 0) return true;
+    int64_t footerPos = h.footerPos + delta;
+    size_t window = relocWindow();
+    std::atomic<bool> ok(true);
+    TaskGroup group;
+
+    // Matrix records are independent; each is patched as a task as soon as
+    // the master-index walk reaches it, while the walk patches the index.
+    WindowPatcher masterPatch(f, delta, window);
+    int64_t masterEnd;
+    bool walked = walkMasterIndex(f, footerPos, h.version, [&](const MasterEntry& e) {
+        int64_t recPos = e.position + delta;
+        group.run([&f, recPos, delta, window, &ok] {
+            if (!patchMatrixRecord(f, recPos, delta, window)) ok = false;
+        });
+        masterPatch.add(e.fieldOffset);
+    }, masterEnd, window);
+    if (!walked || !masterPatch.finish()) ok = false;
+
+    if (walked) {
+        group.run([&f, &h, masterEnd, delta, window, &ok] {
+            int64_t nviPos = locateNormVectorIndex(f, h, masterEnd, delta);
+            if (nviPos == 0) return;
+            WindowPatcher patch(f, delta, window);
+            int64_t end;
+            if (!walkNormVectorIndex(f, nviPos, h.version, [&](int64_t field) { patch.add(field); }, end, window) ||
+                !patch.finish()) ok = false;
+        });
+    }
+    group.wait();
+    return ok;
+}
+
+// Write outPath as newHeader followed by the input's restriction sites and
+// body, relocating every pointer by the header size change. newHeader keeps
+// the input's layout up to the attribute count, so the footer/NVI fields sit
+// at the same offsets.
+static bool writeRelocated(const HicFile& inFile, const HicHeader& h,
+                           std::vector<char> newHeader, const std::string& outPath,
+                           int64_t& delta) {
+    delta = (int64_t)newHeader.size() - h.sitesStart;
+
+    // a) header pointers
+    writeInt64LE(newHeader.data() + h.footerPosField, h.footerPos + delta);
+    if (h.version > 8 && h.nviPos > 0) {
+        writeInt64LE(newHeader.data() + h.nviPosField, h.nviPos + delta);
+        writeInt64LE(newHeader.data() + h.nviPosField + 8, h.nviLen);
+    }
+
+    HicFile outFile;
+    if (!outFile.open(outPath, O_RDWR | O_CREAT | O_TRUNC)) { 
+        std::cerr << "Error: cannot open output file: " << outPath << std::endl;
+        return false; 
+    }
+
+    // Header and body are written concurrently; the sites and body go
+    // through the copy engine as one range.
+    int64_t newSitesStart = newHeader.size();
+    int64_t bodyLen = inFile.size() - h.sitesStart;
+    bool written = bodyLen >= 0 && ftruncate(outFile.fd(), newSitesStart + bodyLen) == 0;
+    if (written) {
+        std::future<bool> headerDone = outFile.writeAsync(newHeader.data(), newHeader.size(), 0);
+        bool copied = copyRange(inFile.fd(), h.sitesStart, outFile.fd(), newSitesStart, bodyLen);
+        written = awaitIo(headerDone) && copied;
+    }
+    if (!written) {
+        std::cerr << "Error: writing " << outPath << " failed" << std::endl;
+        return false;
+    }
+
+    // b) body pointers
+    if (!relocateBody(outFile, h, delta) || !outFile.close()) {
+        std::cerr << "Error: updating pointers in " << outPath << " failed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// --- Streaming relocation ---
+//
+// The writeRelocated() equivalent for inputs or outputs that are compressed
+// streams, where nothing can be patched after the fact. Pass 1 decodes the
+// input once and keeps only the header, the footer and the v9
+// normalization-vector index, in a sparse in-memory image at their real
+// offsets so the usual parsers work on it. Pass 2 decodes again and writes
+// the new header followed by the body; matrix records, the footer and the
+// index are held back until complete, shifted by delta and then written.
+
+struct StreamIndex {
+    HicFile image;                        // sparse: header, footer, v9 NVI
+    HicHeader h;
+    std::vector<MasterEntry> master;
+    int64_t footerEnd;
+    int64_t nviPos;                       // 0 when the file has no index
+    std::vector<int64_t> nviFields;
+    int64_t streamSize;
+};
+
+static bool scanStream(const std::string& inPath, StreamIndex& idx) {
+    // A seekable archive is its own index: read the metadata frames only.
+    bool seekable = idx.image.openRead(inPath) && idx.image.archive();
+    StreamReader in;
+    if (!seekable && (!in.open(inPath) || !idx.image.openAnonymous("hic-stream-index"))) {
+        std::cerr << "Error: cannot open input file: " << inPath
+                  << (codecAvailable(Codec::Zstd) ? "" : " (zstd input needs a -DHAVE_ZSTD build)")
+                  << std::endl;
+        return false;
+    }
+    HicHeader& h = idx.h;
+    bool headerDone = false, footerDone = false;
+    int64_t offset = 0, nextParse = 1 << 20, masterEnd = 0, expectedEnd;
+    std::vector<char> piece;
+    bool ok = true;
+    auto capture = [&](int64_t from, int64_t to) {
+        int64_t a = std::max(from, offset), b = std::min(to, offset + (int64_t)piece.size());
+        if (a < b && !idx.image.write(piece.data() + (a - offset), (size_t)(b - a), a)) ok = false;
+    };
+    auto tryFooter = [&](bool atEnd) {
+        idx.master.clear();
+        return scanMasterIndex(idx.image, h.footerPos, h.version, idx.master, masterEnd) &&
+               scanFooterEnd(idx.image, h.version, masterEnd, expectedEnd, idx.footerEnd) &&
+               (h.version > 8 || atEnd || idx.footerEnd < idx.image.size());
+    };
+    if (seekable) {
+        headerDone = true;
+        offset = idx.image.size();
+        if (!parseHicHeader(idx.image, inPath, h, false, false)) return false;
+    }
+    while (!seekable && ok && in.next(piece)) {
+        if (!headerDone) {
+            capture(0, INT64_MAX);
+        } else {
+            if (!footerDone) capture(h.footerPos, INT64_MAX);
+            if (h.version > 8 && h.nviPos > 0) capture(h.nviPos, h.nviPos + h.nviLen);
+        }
+        offset += (int64_t)piece.size();
+        if (!headerDone && offset >= nextParse) {
+            headerDone = parseHicHeader(idx.image, inPath, h, true, false);
+            nextParse *= 2;
+        }
+        if (headerDone && !footerDone && offset > h.footerPos) footerDone = tryFooter(false);
+    }
+    if (!ok || (!seekable && !in.ok())) {
+        std::cerr << "Error: decoding " << inPath << " failed" << std::endl;
+        return false;
+    }
+    if (!headerDone && !parseHicHeader(idx.image, inPath, h, false, false)) return false;
+    if (!footerDone && !tryFooter(true)) {
+        std::cerr << "Error: cannot read footer of " << inPath << std::endl;
+        return false;
+    }
+    idx.streamSize = offset;
+    idx.nviPos = locateNormVectorIndex(idx.image, h, masterEnd, 0);
+    int64_t nviEnd;
+    if (idx.nviPos > 0 && !scanNormVectorIndex(idx.image, idx.nviPos, h.version, idx.nviFields, nviEnd)) {
+        std::cerr << "Error: cannot read normalization-vector index of " << inPath << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Offsets (within rec) of the block position fields of a matrix record.
+static bool recordBlockFields(const std::vector<char>& rec, std::vector<int64_t>& fields) {
+    size_t p = 12;
+    if (rec.size() < p) return false;
+    int32_t nRes = readInt32LE(rec.data() + 8);
+    for (int32_t i = 0; i < nRes; i++) {
+        while (p < rec.size() && rec[p] != '\0') p++;
+        p += 1 + 32;                      // unit terminator, resIdx .. blockColumnCount
+        if (p + 4 > rec.size()) return false;
+        int32_t nBlocks = readInt32LE(rec.data() + p);
+        p += 4;
+        if (nBlocks < 0 || p + (size_t)nBlocks * 16 > rec.size()) return false;
+        for (int32_t b = 0; b < nBlocks; b++, p += 16) fields.push_back((int64_t)p + 4);
+    }
+    return p == rec.size();
+}
+
+static bool writeStreamRelocated(const std::string& inPath, const StreamIndex& idx,
+                                 std::vector<char> newHeader, const std::string& outPath,
+                                 int64_t& delta) {
+    const HicHeader& h = idx.h;
+    delta = (int64_t)newHeader.size() - h.sitesStart;
+    writeInt64LE(newHeader.data() + h.footerPosField, h.footerPos + delta);
+    if (h.version > 8 && h.nviPos > 0) {
+        writeInt64LE(newHeader.data() + h.nviPosField, h.nviPos + delta);
+        writeInt64LE(newHeader.data() + h.nviPosField + 8, h.nviLen);
+    }
+
+    // Regions held back and patched: each record (fields found once it is
+    // complete), the footer, and the v9 index.
+    struct Held {
+        int64_t start, end;
+        bool record;
+        std::vector<int64_t> fields;      // absolute offsets
+    };
+    std::vector<Held> held;
+    Held footer = {h.footerPos, idx.footerEnd, false, {}};
+    for (const auto& e : idx.master) footer.fields.push_back(e.fieldOffset);
+    if (h.version <= 8) footer.fields.insert(footer.fields.end(), idx.nviFields.begin(), idx.nviFields.end());
+    held.push_back(footer);
+    if (h.version > 8 && idx.nviPos > 0) {
+        Held nvi = {idx.nviPos, idx.nviPos + h.nviLen, false, idx.nviFields};
+        held.push_back(nvi);
+    }
+    for (const auto& e : idx.master) {
+        Held rec = {e.position, e.position + e.size, true, {}};
+        held.push_back(rec);
+    }
+    std::sort(held.begin(), held.end(), [](const Held& a, const Held& b) { return a.start < b.start; });
+    for (size_t i = 0; i < held.size(); i++) {
+        if (held[i].start < (int64_t)h.dataStart || held[i].end > idx.streamSize ||
+            (i > 0 && held[i].start < held[i - 1].end)) {
+            std::cerr << "Error: overlapping or out-of-range structures in " << inPath << std::endl;
+            return false;
+        }
+    }
+
+    StreamReader in;
+    StreamWriter out;
+    if (!in.open(inPath)) {
+        std::cerr << "Error: cannot open input file: " << inPath << std::endl;
+        return false;
+    }
+    if (!out.open(outPath, codecForPath(outPath))) {
+        std::cerr << "Error: cannot open output file: " << outPath
+                  << (codecAvailable(codecForPath(outPath)) ? "" : " (zstd output needs a -DHAVE_ZSTD build)")
+                  << std::endl;
+        return false;
+    }
+    out.write(newHeader.data(), newHeader.size());
+    out.cut();
+
+    std::vector<char> piece, buf;
+    size_t next = 0;
+    int64_t offset = 0;
+    bool ok = true;
+    while (ok && in.next(piece)) {
+        int64_t end = offset + (int64_t)piece.size();
+        int64_t at = std::max(offset, h.sitesStart);
+        while (ok && at < end) {
+            const char* p = piece.data() + (at - offset);
+            if (next == held.size() || at < held[next].start) {
+                int64_t upto = next == held.size() ? end : std::min(end, held[next].start);
+                out.write(p, (size_t)(upto - at));
+                at = upto;
+                continue;
+            }
+            Held& r = held[next];
+            if (!r.record && buf.empty()) out.cut();
+            int64_t upto = std::min(end, r.end);
+            buf.insert(buf.end(), p, p + (upto - at));
+            at = upto;
+            if (at < r.end) break;
+            std::vector<int64_t> local;
+            if (r.record) ok = recordBlockFields(buf, local);
+            else for (int64_t f : r.fields) local.push_back(f - r.start);
+            for (int64_t f : local) {
+                if (f < 0 || f + 8 > (int64_t)buf.size()) { ok = false; break; }
+                writeInt64LE(buf.data() + f, readInt64LE(buf.data() + f) + delta);
+            }
+            out.write(buf.data(), buf.size());
+            if (!r.record) out.cut();
+            buf.clear();
+            next++;
+        }
+        offset = end;
+    }
+    if (!ok || !in.ok() || next != held.size() || !out.close()) {
+        std::cerr << "Error: writing " << outPath << " failed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Rewrite one .hic with statistics/graphs inserted after 'software'.
+// Returns 0 on success, 1 on error (message already printed). finalPath is
+// the name reported when outPath is a temporary that is renamed later.
+static int updateHicHeader(const std::string& inPath, const std::string& outPath,
+                           const std::vector<char>& statVal,
+                           const std::vector<char>& graphVal,
+                           const std::string& finalPath = std::string()) {
+    // --- PASS 1: Read Header & Original Attributes ---
+
+    HicFile inFile;
+    if (!inFile.open(inPath)) { 
+        std::cerr << "Error: cannot open input file: " << inPath << std::endl;
+        return 1; 
+    }
+    // Compressed input or output goes through the streaming path.
+    unsigned char magic[4] = {0};
+    inFile.read(magic, std::min<int64_t>(inFile.size(), 4), 0);
+    bool streaming = codecForMagic(magic, 4) != Codec::None || codecForPath(outPath) != Codec::None;
+    StreamIndex idx;
+    if (streaming && !scanStream(inPath, idx)) return 1;
+    HicHeader parsed;
+    if (!streaming && !parseHicHeader(inFile, inPath, parsed)) return 1;
+    const HicHeader& h = streaming ? idx.h : parsed;
+    const std::vector<AttrKV>& origAttrs = h.attrs;
+
+    // --- PASS 2: Build Updated Attribute List ---
+
+    // Remove any existing statistics/graphs
+    std::vector<AttrKV> newAttrs;
+    newAttrs.reserve(origAttrs.size() + 2);
+    int softwareIdx = -1;
+    for (size_t i = 0; i < origAttrs.size(); ++i) {
+        const std::string& k = origAttrs[i].key;
+        if (k == "software") softwareIdx = (int)newAttrs.size();
+        if (k != "statistics" && k != "graphs") newAttrs.push_back(origAttrs[i]);
+    }
+    if (softwareIdx == -1) {
+        std::cerr << "Could not find 'software' attribute to insert after.\n";
+        return 1;
+    }
+
+    // Insert statistics/graphs after 'software'
+    auto it = newAttrs.begin() + (softwareIdx + 1);
+    it = newAttrs.insert(it, {"statistics", std::string(statVal.data(), statVal.size())});
+    it = newAttrs.insert(it+1, {"graphs", std::string(graphVal.data(), graphVal.size())});
+
+    // --- Write updated header, copy body, PASS 3: Patch Pointers ---
+
+    int64_t delta;
+    std::vector<char> newHeader = buildHeader(h, newAttrs, h.chrDictBuf);
+    if (streaming ? !writeStreamRelocated(inPath, idx, newHeader, outPath, delta)
+                  : !writeRelocated(inFile, h, newHeader, outPath, delta))
+        return 1;
+
+    std::ostringstream msg;
+    msg << "Successfully wrote " << (finalPath.empty() ? outPath : finalPath)
+        << " with statistics/graphs inserted after software, pointers bumped by "
+        << delta << " bytes.\n";
+    std::cout << msg.str();
+    return 0;
+}
+
+// --- Chromosome rename ---
+//
+// Renames chromosome dictionary entries from a two-column "old new" mapping
+// file. Only the dictionary changes; matrix data is keyed by chromosome index
+// and is never touched. When the dictionary keeps its byte length the file
+// is patched in place (with --in-place) or copied unchanged but for the
+// dictionary; otherwise the header is rebuilt and the body relocated.
+
+static bool loadRenameMap(const std::string& path, std::map<std::string, std::string>& renames) {
+    std::ifstream fm(path);
+    if (!fm) {
+        std::cerr << "Error: cannot open mapping file: " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    int lineNo = 0;
+    while (std::getline(fm, line)) {
+        lineNo++;
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#') continue;
+        std::istringstream ss(line);
+        std::string from, to, extra;
+        if (!(ss >> from >> to) || (ss >> extra)) {
+            std::cerr << "Error: " << path << ":" << lineNo << ": expected <old> <new>\n";
+            return false;
+        }
+        renames[from] = to;
+    }
+    return true;
+}
+
+static int runRenameChroms(int argc, char** argv) {
+    bool inPlace = false;
+    std::vector<std::string> args;
+    for (int i = 2; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--in-place") inPlace = true;
+        else args.push_back(a);
+    }
+    if (args.size() != (inPlace ? 2u : 3u)) {
+        std::cerr << "Usage: " << argv[0] << " rename-chroms <in.hic> <out.hic> <mapping.txt>\n"
+                  << "       " << argv[0] << " rename-chroms --in-place <file.hic> <mapping.txt>\n";
+        return 1;
+    }
+    const std::string inPath = args[0];
+    const std::string outPath = inPlace ? inPath : args[1];
+    std::map<std::string, std::string> renames;
+    if (!loadRenameMap(args.back(), renames)) return 1;
+
+    HicFile inFile;
+    if (!inFile.open(inPath, inPlace ? O_RDWR : O_RDONLY)) {
+        std::cerr << "Error: cannot open input file: " << inPath << std::endl;
+        return 1;
+    }
+    HicHeader h;
+    if (!parseHicHeader(inFile, inPath, h)) return 1;
+
+    // Master-index keys are "<chr1Idx>_<chr2Idx>" in every released version;
+    // refuse files whose keys carry names, since renaming would desync them.
+    std::vector<MasterEntry> master;
+    int64_t masterEnd;
+    if (!scanMasterIndex(inFile, h.footerPos, h.version, master, masterEnd)) {
+        std::cerr << "Error: cannot read master index of " << inPath << std::endl;
+        return 1;
+    }
+    auto isIndex = [](const std::string& k) {
+        return !k.empty() && k.find_first_not_of("0123456789") == std::string::npos;
+    };
+    for (const auto& e : master) {
+        size_t us = e.key.find('_');
+        std::string a = e.key.substr(0, us);
+        std::string b = us == std::string::npos ? "" : e.key.substr(us + 1);
+        if ((!isIndex(a) && renames.count(a)) || (!isIndex(b) && renames.count(b))) {
+            std::cerr << "Error: master index key '" << e.key
+                      << "' embeds a chromosome name; renaming it is not supported.\n";
+            return 1;
+        }
+    }
+
+    // Rebuild the dictionary with the new names.
+    std::vector<char> newDict(h.chrDictBuf.begin(), h.chrDictBuf.begin() + 4);
+    size_t lenBytes = h.version > 8 ? 8 : 4;
+    size_t at = 4;
+    int renamed = 0;
+    for (size_t i = 0; i < h.chrNames.size(); i++) {
+        std::string name = h.chrNames[i];
+        auto r = renames.find(name);
+        if (r != renames.end()) { name = r->second; renamed++; }
+        newDict.insert(newDict.end(), name.begin(), name.end());
+        newDict.push_back('\0');
+        at += h.chrNames[i].size() + 1;
+        newDict.insert(newDict.end(), h.chrDictBuf.begin() + at, h.chrDictBuf.begin() + at + lenBytes);
+        at += lenBytes;
+    }
+    std::set<std::string> seen;
+    for (size_t i = 0; i < h.chrNames.size(); i++) {
+        auto r = renames.find(h.chrNames[i]);
+        if (!seen.insert(r != renames.end() ? r->second : h.chrNames[i]).second) {
+            std::cerr << "Error: renaming would create duplicate chromosome names.\n";
+            return 1;
+        }
+    }
+
+    int64_t delta = 0;
+    if (newDict.size() == h.chrDictBuf.size()) {
+        // Same length: only the dictionary bytes differ.
+        if (inPlace) {
+            if (!inFile.write(newDict.data(), newDict.size(), h.chrDictStart) || !inFile.datasync()) {
+                std::cerr << "Error: patching " << inPath << " failed" << std::endl;
+                return 1;
+            }
+        } else if (!writeRelocated(inFile, h, buildHeader(h, h.attrs, newDict), outPath, delta)) {
+            return 1;
+        }
+    } else {
+        // Different length: rebuild the header and relocate the body. In
+        // place means a temp file renamed over the original.
+        std::string target = inPlace ? inPath + ".tmp." + std::to_string(getpid()) : outPath;
+        if (!writeRelocated(inFile, h, buildHeader(h, h.attrs, newDict), target, delta)) {
+            if (inPlace) std::remove(target.c_str());
+            return 1;
+        }
+        if (inPlace && std::rename(target.c_str(), inPath.c_str()) != 0) {
+            std::cerr << "Error: cannot replace " << inPath << ": " << std::strerror(errno) << std::endl;
+            std::remove(target.c_str());
+            return 1;
+        }
+    }
+
+    std::cout << "Renamed " << renamed << " chromosome(s) in " << outPath;
+    if (delta == 0) std::cout << " (same length, no relocation).\n";
+    else std::cout << ", pointers moved by " << delta << " bytes.\n";
+    return 0;
+}
+
+// --- export-csr ---
+//
+// Converts selected resolutions into the memory-mappable CSR layout
+// described in hic_csr.h. Each (matrix, resolution) is a pool task spawned
+// from the master-index walk: it decodes its blocks, builds the CSR arrays
+// in memory, claims an aligned range of the output with an atomic cursor
+// and writes it there. The directory and header go last.
+
+static bool parseIntList(const std::string& s, std::set<int32_t>& out) {
+    std::stringstream ss(s);
+    std::string part;
+    while (std::getline(ss, part, ',')) {
+        char* end;
+        long v = std::strtol(part.c_str(), &end, 10);
+        if (part.empty() || *end || v <= 0) return false;
+        out.insert((int32_t)v);
+    }
+    return true;
+}
+
+static bool buildCsrMatrix(const HicFile& f, int32_t version, const MatrixRecord& m,
+                           const ResolutionRecord& z, int64_t nRows, int64_t nCols,
+                           OutputSink& sink, hic_csr::MatrixEntry& entry) {
+    DecodedBlock block, all;
+    DecodeScratch scratch;
+    for (const auto& b : z.blocks) {
+        if (!readBlock(f, version, b, block, scratch)) return false;
+        all.binX.insert(all.binX.end(), block.binX.begin(), block.binX.end());
+        all.binY.insert(all.binY.end(), block.binY.begin(), block.binY.end());
+        all.counts.insert(all.counts.end(), block.counts.begin(), block.counts.end());
+    }
+    for (size_t i = 0; i < all.size(); i++) {
+        if (all.binX[i] < 0 || all.binY[i] < 0) return false;
+        nRows = std::max<int64_t>(nRows, (int64_t)all.binX[i] + 1);
+        nCols = std::max<int64_t>(nCols, (int64_t)all.binY[i] + 1);
+    }
+
+    // Counting sort by row, then order each row by column.
+    int64_t nnz = (int64_t)all.size();
+    std::vector<int64_t> rowPtr((size_t)nRows + 1, 0);
+    for (size_t i = 0; i < all.size(); i++) rowPtr[all.binX[i] + 1]++;
+    for (int64_t r = 0; r < nRows; r++) rowPtr[r + 1] += rowPtr[r];
+    std::vector<int64_t> fill(rowPtr.begin(), rowPtr.end() - 1);
+    std::vector<std::pair<int32_t, float> > cells((size_t)nnz);
+    for (size_t i = 0; i < all.size(); i++)
+        cells[fill[all.binX[i]]++] = std::make_pair(all.binY[i], all.counts[i]);
+    all.clear();
+    for (int64_t r = 0; r < nRows; r++)
+        std::sort(cells.begin() + rowPtr[r], cells.begin() + rowPtr[r + 1]);
+    std::vector<int32_t> colIdx((size_t)nnz);
+    std::vector<float> counts((size_t)nnz);
+    for (int64_t k = 0; k < nnz; k++) { colIdx[k] = cells[k].first; counts[k] = cells[k].second; }
+
+    entry.chr1 = m.chr1;
+    entry.chr2 = m.chr2;
+    entry.binSize = z.binSize;
+    entry.unit = z.unit == "FRAG" ? hic_csr::FRAG : hic_csr::BP;
+    entry.nRows = nRows;
+    entry.nCols = nCols;
+    entry.nnz = nnz;
+    uint64_t rowBytes = rowPtr.size() * sizeof(int64_t);
+    uint64_t colBytes = colIdx.size() * sizeof(int32_t);
+    uint64_t cntBytes = counts.size() * sizeof(float);
+    uint64_t base = sink.claim(hic_csr::alignUp(rowBytes) + hic_csr::alignUp(colBytes) + cntBytes);
+    entry.rowPtrOffset = base;
+    entry.colIdxOffset = base + hic_csr::alignUp(rowBytes);
+    entry.countsOffset = entry.colIdxOffset + hic_csr::alignUp(colBytes);
+    sink.write(rowPtr.data(), rowBytes, entry.rowPtrOffset);
+    sink.write(colIdx.data(), colBytes, entry.colIdxOffset);
+    sink.write(counts.data(), cntBytes, entry.countsOffset);
+    return true;
+}
+
+static int runExportCsr(int argc, char** argv) {
+    std::set<int32_t> wanted;
+    std::set<std::string> normTypes;
+    std::vector<std::string> args;
+    for (int i = 2; i < argc; i++) {
+        std::string a = argv[i];
+        if ((a == "-r" || a == "--resolutions") && i + 1 < argc) {
+            if (!parseIntList(argv[++i], wanted)) {
+                std::cerr << "Error: bad resolution list: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (a == "--norm" && i + 1 < argc) {
+            normTypes.insert(argv[++i]);
+        } else if (a == "--threads" && i + 1 < argc) {
+            g_poolThreads = std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            args.push_back(a);
+        }
+    }
+    if (args.size() != 2) {
+        std::cerr << "Usage: " << argv[0]
+                  << " export-csr [-r res1,res2,...] [--norm TYPE]... [--threads N] <in.hic> <out.csr>\n";
+        return 1;
+    }
+    const std::string inPath = args[0], outPath = args[1];
+
+    HicFile inFile;
+    if (!inFile.openRead(inPath)) {
+        std::cerr << "Error: cannot open input file: " << inPath << std::endl;
+        return 1;
+    }
+    HicMetadata meta;
+    if (!loadMetadata(inFile, inPath, meta, !normTypes.empty())) return 1;
+    const HicHeader& h = meta.h;
+    const std::vector<MasterEntry>& master = meta.master;
+    for (int32_t r : wanted) {
+        if (std::find(h.bpResolutions.begin(), h.bpResolutions.end(), r) == h.bpResolutions.end() &&
+            std::find(h.fragResolutions.begin(), h.fragResolutions.end(), r) == h.fragResolutions.end()) {
+            std::cerr << "Error: " << inPath << " has no resolution " << r << std::endl;
+            return 1;
+        }
+    }
+    if (wanted.empty()) wanted.insert(h.bpResolutions.begin(), h.bpResolutions.end());
+
+    OutputSink sink(hic_csr::ALIGN);
+    if (!sink.file.open(outPath, O_RDWR | O_CREAT | O_TRUNC)) {
+        std::cerr << "Error: cannot open output file: " << outPath << std::endl;
+        return 1;
+    }
+
+    // Chromosome table and names.
+    uint32_t nChroms = (uint32_t)h.chrNames.size();
+    uint64_t chromOffset = hic_csr::alignUp(sizeof(hic_csr::FileHeader));
+    uint64_t namesOffset = chromOffset + nChroms * sizeof(hic_csr::Chromosome);
+    std::vector<hic_csr::Chromosome> chroms(nChroms);
+    std::string names;
+    for (uint32_t i = 0; i < nChroms; i++) {
+        chroms[i].length = h.chrLengths[i];
+        chroms[i].nameOffset = namesOffset + names.size();
+        chroms[i].nameLength = (uint32_t)h.chrNames[i].size();
+        chroms[i].reserved = 0;
+        names += h.chrNames[i];
+    }
+    sink.write(chroms.data(), chroms.size() * sizeof(hic_csr::Chromosome), chromOffset);
+    sink.write(names.data(), names.size(), namesOffset);
+    sink.cursor = hic_csr::alignUp(namesOffset + names.size());
+
+    // Matrices: one task per (matrix, resolution) from the master-index walk.
+    std::mutex dirMu;
+    std::vector<hic_csr::MatrixEntry> matrixDir;
+    std::atomic<bool> ok(true);
+    TaskGroup group;
+    for (const auto& e : master) {
+        int64_t recPos = e.position;
+        group.run([&, recPos] {
+            std::shared_ptr<MatrixRecord> m(new MatrixRecord);
+            if (!readMatrixRecord(inFile, recPos, *m)) { ok = false; return; }
+            for (size_t zi = 0; zi < m->resolutions.size(); zi++) {
+                const ResolutionRecord& z = m->resolutions[zi];
+                if (!wanted.count(z.binSize)) continue;
+                int64_t nRows = 0, nCols = 0;
+                if (z.unit == "BP" && m->chr1 >= 0 && m->chr2 < (int32_t)nChroms && m->chr1 < (int32_t)nChroms) {
+                    nRows = h.chrLengths[m->chr1] / z.binSize + 1;
+                    nCols = h.chrLengths[m->chr2] / z.binSize + 1;
+                }
+                group.run([&, m, zi, nRows, nCols] {
+                    hic_csr::MatrixEntry entry;
+                    std::memset(&entry, 0, sizeof(entry));
+                    if (!buildCsrMatrix(inFile, h.version, *m, m->resolutions[zi], nRows, nCols, sink, entry)) {
+                        ok = false;
+                        return;
+                    }
+                    std::lock_guard<std::mutex> lk(dirMu);
+                    matrixDir.push_back(entry);
+                });
+            }
+        });
+    }
+    group.wait();
+    if (!ok) {
+        std::cerr << "Error: decoding matrices of " << inPath << " failed" << std::endl;
+        return 1;
+    }
+
+    // Normalization vectors of the requested types at exported resolutions.
+    std::vector<hic_csr::NormEntry> normDir;
+    if (!normTypes.empty()) {
+        for (const auto& e : meta.norms) {
+            if (!normTypes.count(e.type) || !wanted.count(e.binSize)) continue;
+            std::vector<double> values;
+            if (!readNormVector(inFile, h.version, e, values)) {
+                std::cerr << "Error: cannot read " << e.type << " vector for chromosome "
+                          << e.chrIdx << " at " << e.binSize << std::endl;
+                return 1;
+            }
+            hic_csr::NormEntry n;
+            std::memset(&n, 0, sizeof(n));
+            std::strncpy(n.type, e.type.c_str(), sizeof(n.type) - 1);
+            n.chrIdx = e.chrIdx;
+            n.binSize = e.binSize;
+            n.unit = e.unit == "FRAG" ? hic_csr::FRAG : hic_csr::BP;
+            n.nValues = (int64_t)values.size();
+            n.offset = sink.claim(values.size() * sizeof(double));
+            sink.write(values.data(), values.size() * sizeof(double), n.offset);
+            normDir.push_back(n);
+        }
+    }
+
+    // Directory, sorted for binary search, then the header.
+    std::sort(matrixDir.begin(), matrixDir.end(),
+              [](const hic_csr::MatrixEntry& a, const hic_csr::MatrixEntry& b) {
+                  if (a.chr1 != b.chr1) return a.chr1 < b.chr1;
+                  if (a.chr2 != b.chr2) return a.chr2 < b.chr2;
+                  if (a.unit != b.unit) return a.unit < b.unit;
+                  return a.binSize < b.binSize;
+              });
+    hic_csr::FileHeader fh;
+    std::memset(&fh, 0, sizeof(fh));
+    std::memcpy(fh.magic, hic_csr::MAGIC, 8);
+    fh.formatVersion = hic_csr::FORMAT_VERSION;
+    fh.hicVersion = (uint32_t)h.version;
+    fh.nChromosomes = nChroms;
+    fh.nMatrices = (uint32_t)matrixDir.size();
+    fh.nNorms = (uint32_t)normDir.size();
+    fh.chromosomeOffset = chromOffset;
+    fh.matrixDirOffset = sink.claim(matrixDir.size() * sizeof(hic_csr::MatrixEntry));
+    fh.normDirOffset = sink.claim(normDir.size() * sizeof(hic_csr::NormEntry));
+    sink.write(matrixDir.data(), matrixDir.size() * sizeof(hic_csr::MatrixEntry), fh.matrixDirOffset);
+    sink.write(normDir.data(), normDir.size() * sizeof(hic_csr::NormEntry), fh.normDirOffset);
+    sink.write(&fh, sizeof(fh), 0);
+    if (!sink.ok || ftruncate(sink.file.fd(), (off_t)sink.cursor.load()) != 0 || !sink.file.close()) {
+        std::cerr << "Error: writing " << outPath << " failed" << std::endl;
+        return 1;
+    }
+
+    std::cout << "Exported " << matrixDir.size() << " matrices and " << normDir.size()
+              << " normalization vectors to " << outPath << ".\n";
+    return 0;
+}
+
+// --- export-tiles ---
+//
+// Writes the dense tile pyramid described in hic_tiles.h. As in export-csr,
+// each (matrix, resolution) is a pool task: it decodes its blocks, applies
+// the normalization, sorts the cells by tile and then builds, converts and
+// writes one tile at a time into a claimed range, so memory stays at the
+// sparse cells of one matrix rather than its dense tiles.
+
+// IEEE 754 binary32 to binary16, rounding to nearest even.
+static uint16_t floatToHalf(float f) {
+    uint32_t x;
+    std::memcpy(&x, &f, 4);
+    uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+    uint32_t mant = x & 0x7fffff;
+    int32_t exp = (int32_t)((x >> 23) & 0xff);
+    if (exp == 0xff) return sign | 0x7c00 | (mant ? 0x200 : 0);
+    exp -= 127 - 15;
+    if (exp >= 0x1f) return sign | 0x7c00;
+    if (exp <= 0) {
+        if (exp < -10) return sign;
+        mant |= 0x800000;
+        uint32_t shift = (uint32_t)(14 - exp);
+        uint32_t h = mant >> shift, rest = mant & ((1u << shift) - 1), half = 1u << (shift - 1);
+        if (rest > half || (rest == half && (h & 1))) h++;
+        return sign | (uint16_t)h;
+    }
+    uint32_t h = ((uint32_t)exp << 10) | (mant >> 13), rest = mant & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) h++;   // may carry into the exponent
+    return sign | (uint16_t)h;
+}
+
+struct TileCell {
+    uint64_t tile;                        // row << 32 | col
+    uint32_t at;                          // index within the tile
+    float value;
+};
+
+static bool buildTiles(const HicFile& f, int32_t version, const MatrixRecord& m, const ResolutionRecord& z,
+                       uint32_t tileSize, hic_tiles::CellType cellType,
+                       const std::vector<double>* n1, const std::vector<double>* n2,
+                       OutputSink& sink, std::vector<hic_tiles::TileEntry>& entries) {
+    bool intra = m.chr1 == m.chr2;
+    std::vector<TileCell> cells;
+    auto place = [&](int64_t x, int64_t y, float v) {
+        uint64_t r = (uint64_t)(x / tileSize), c = (uint64_t)(y / tileSize);
+        cells.push_back(TileCell{r << 32 | c, (uint32_t)((x % tileSize) * tileSize + y % tileSize), v});
+    };
+    DecodedBlock block;
+    DecodeScratch scratch;
+    std::vector<double> normalized;
+    NormTables t = {n1 ? n1->data() : nullptr, n1 ? n1->size() : 0,
+                    n2 ? n2->data() : nullptr, n2 ? n2->size() : 0, nullptr, 0};
+    for (const auto& b : z.blocks) {
+        if (!readBlock(f, version, b, block, scratch)) return false;
+        if (n1) normalizeBlock(t, block, normalized);
+        for (size_t i = 0; i < block.size(); i++) {
+            int64_t x = block.binX[i], y = block.binY[i];
+            if (x < 0 || y < 0) return false;
+            if (intra && x > y) std::swap(x, y);
+            float v = block.counts[i];
+            if (n1) {
+                v = (float)normalized[i];
+                if (!std::isfinite(v)) continue;     // dropped, as query and straw do
+            }
+            place(x, y, v);
+            if (intra && x != y && x / tileSize == y / tileSize) place(y, x, v);
+        }
+    }
+    std::sort(cells.begin(), cells.end(),
+              [](const TileCell& a, const TileCell& b) { return a.tile < b.tile; });
+
+    size_t n = (size_t)tileSize * tileSize;
+    size_t cellBytes = cellType == hic_tiles::FLOAT16 ? 2 : 4;
+    std::vector<float> dense(n);
+    std::vector<char> out(n * cellBytes);
+    for (size_t i = 0; i < cells.size();) {
+        size_t j = i;
+        std::fill(dense.begin(), dense.end(), 0.0f);
+        for (; j < cells.size() && cells[j].tile == cells[i].tile; j++) dense[cells[j].at] += cells[j].value;
+        if (cellType == hic_tiles::FLOAT16) {
+            for (size_t k = 0; k < n; k++) {
+                uint16_t h = floatToHalf(dense[k]);
+                std::memcpy(&out[2 * k], &h, 2);
+            }
+        } else {
+            std::memcpy(out.data(), dense.data(), out.size());
+        }
+        hic_tiles::TileEntry e;
+        std::memset(&e, 0, sizeof(e));
+        e.chr1 = m.chr1;
+        e.chr2 = m.chr2;
+        e.binSize = z.binSize;
+        e.row = (int32_t)(cells[i].tile >> 32);
+        e.col = (int32_t)(cells[i].tile & 0xffffffffu);
+        e.offset = sink.claim(out.size());
+        sink.write(out.data(), out.size(), e.offset);
+        entries.push_back(e);
+        i = j;
+    }
+    return true;
+}
+
+static int runExportTiles(int argc, char** argv) {
+    std::set<int32_t> wanted;
+    std::string norm = "NONE";
+    uint32_t tileSize = 256;
+    hic_tiles::CellType cellType = hic_tiles::FLOAT32;
+    std::vector<std::string> args;
+    for (int i = 2; i < argc; i++) {
+        std::string a = argv[i];
+        if ((a == "-r" || a == "--resolutions") && i + 1 < argc) {
+            if (!parseIntList(argv[++i], wanted)) {
+                std::cerr << "Error: bad resolution list: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (a == "--norm" && i + 1 < argc) {
+            norm = argv[++i];
+        } else if (a == "--tile-size" && i + 1 < argc) {
+            tileSize = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+        } else if (a == "--float16") {
+            cellType = hic_tiles::FLOAT16;
+        } else if (a == "--threads" && i + 1 < argc) {
+            g_poolThreads = std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            args.push_back(a);
+        }
+    }
+    if (args.size() != 2 || tileSize == 0 || tileSize > 4096) {
+        std::cerr << "Usage: " << argv[0]
+                  << " export-tiles [-r res1,res2,...] [--norm TYPE] [--tile-size N] [--float16] [--threads N]"
+                     " <in.hic> <out.tiles>\n";
+        return 1;
+    }
+    const std::string inPath = args[0], outPath = args[1];
+
+    HicFile inFile;
+    if (!inFile.openRead(inPath)) {
+        std::cerr << "Error: cannot open input file: " << inPath << std::endl;
+        return 1;
+    }
+    HicMetadata meta;
+    if (!loadMetadata(inFile, inPath, meta, norm != "NONE")) return 1;
+    const HicHeader& h = meta.h;
+    const std::vector<MasterEntry>& master = meta.master;
+    for (int32_t r : wanted) {
+        if (std::find(h.bpResolutions.begin(), h.bpResolutions.end(), r) == h.bpResolutions.end()) {
+            std::cerr << "Error: " << inPath << " has no " << r << " bp resolution" << std::endl;
+            return 1;
+        }
+    }
+    if (wanted.empty()) wanted.insert(h.bpResolutions.begin(), h.bpResolutions.end());
+
+    // Normalization vectors are loaded up front so the tasks only read them.
+    std::map<std::pair<int32_t, int32_t>, std::vector<double> > norms;
+    if (norm != "NONE") {
+        if (meta.nviPos == 0) {
+            std::cerr << "Error: " << inPath << " has no normalization vectors" << std::endl;
+            return 1;
+        }
+        for (const auto& e : meta.norms) {
+            if (e.type != norm || e.unit != "BP" || !wanted.count(e.binSize)) continue;
+            if (!readNormVector(inFile, h.version, e, norms[std::make_pair(e.chrIdx, e.binSize)])) {
+                std::cerr << "Error: cannot read " << e.type << " vector for chromosome "
+                          << e.chrIdx << " at " << e.binSize << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    OutputSink sink(hic_tiles::ALIGN);
+    if (!sink.file.open(outPath, O_RDWR | O_CREAT | O_TRUNC)) {
+        std::cerr << "Error: cannot open output file: " << outPath << std::endl;
+        return 1;
+    }
+    uint32_t nChroms = (uint32_t)h.chrNames.size();
+    uint64_t chromOffset = hic_tiles::alignUp(sizeof(hic_tiles::FileHeader));
+    uint64_t namesOffset = chromOffset + nChroms * sizeof(hic_tiles::Chromosome);
+    std::vector<hic_tiles::Chromosome> chroms(nChroms);
+    std::string names;
+    for (uint32_t i = 0; i < nChroms; i++) {
+        chroms[i].length = h.chrLengths[i];
+        chroms[i].nameOffset = namesOffset + names.size();
+        chroms[i].nameLength = (uint32_t)h.chrNames[i].size();
+        chroms[i].reserved = 0;
+        names += h.chrNames[i];
+    }
+    sink.write(chroms.data(), chroms.size() * sizeof(hic_tiles::Chromosome), chromOffset);
+    sink.write(names.data(), names.size(), namesOffset);
+    sink.cursor = hic_tiles::alignUp(namesOffset + names.size());
+
+    std::mutex dirMu;
+    std::vector<hic_tiles::TileEntry> tileDir;
+    std::atomic<bool> ok(true);
+    std::atomic<int> missingNorm(0);
+    TaskGroup group;
+    for (const auto& e : master) {
+        int64_t recPos = e.position;
+        group.run([&, recPos] {
+            std::shared_ptr<MatrixRecord> m(new MatrixRecord);
+            if (!readMatrixRecord(inFile, recPos, *m)) { ok = false; return; }
+            if (m->chr1 == 0 || m->chr2 == 0) return;           // the All matrix is not tiled
+            for (size_t zi = 0; zi < m->resolutions.size(); zi++) {
+                const ResolutionRecord& z = m->resolutions[zi];
+                if (z.unit != "BP" || !wanted.count(z.binSize)) continue;
+                const std::vector<double>* n1 = nullptr;
+                const std::vector<double>* n2 = nullptr;
+                if (norm != "NONE") {
+                    auto a = norms.find(std::make_pair(m->chr1, z.binSize));
+                    auto b = norms.find(std::make_pair(m->chr2, z.binSize));
+                    if (a == norms.end() || b == norms.end()) { missingNorm++; continue; }
+                    n1 = &a->second;
+                    n2 = &b->second;
+                }
+                group.run([&, m, zi, n1, n2] {
+                    std::vector<hic_tiles::TileEntry> entries;
+                    if (!buildTiles(inFile, h.version, *m, m->resolutions[zi], tileSize, cellType,
+                                    n1, n2, sink, entries)) {
+                        ok = false;
+                        return;
+                    }
+                    std::lock_guard<std::mutex> lk(dirMu);
+                    tileDir.insert(tileDir.end(), entries.begin(), entries.end());
+                });
+            }
+        });
+    }
+    group.wait();
+    if (!ok) {
+        std::cerr << "Error: decoding matrices of " << inPath << " failed" << std::endl;
+        return 1;
+    }
+
+    std::sort(tileDir.begin(), tileDir.end(),
+              [](const hic_tiles::TileEntry& a, const hic_tiles::TileEntry& b) {
+                  if (a.chr1 != b.chr1) return a.chr1 < b.chr1;
+                  if (a.chr2 != b.chr2) return a.chr2 < b.chr2;
+                  if (a.binSize != b.binSize) return a.binSize < b.binSize;
+                  if (a.row != b.row) return a.row < b.row;
+                  return a.col < b.col;
+              });
+    std::vector<int32_t> levels(wanted.begin(), wanted.end());
+    hic_tiles::FileHeader fh;
+    std::memset(&fh, 0, sizeof(fh));
+    std::memcpy(fh.magic, hic_tiles::MAGIC, 8);
+    fh.formatVersion = hic_tiles::FORMAT_VERSION;
+    fh.hicVersion = (uint32_t)h.version;
+    fh.nChromosomes = nChroms;
+    fh.nLevels = (uint32_t)levels.size();
+    fh.tileSize = tileSize;
+    fh.cellType = cellType;
+    fh.nTiles = tileDir.size();
+    fh.chromosomeOffset = chromOffset;
+    std::strncpy(fh.norm, norm.c_str(), sizeof(fh.norm) - 1);
+    fh.levelOffset = sink.claim(levels.size() * sizeof(int32_t));
+    fh.tileDirOffset = sink.claim(tileDir.size() * sizeof(hic_tiles::TileEntry));
+    sink.write(levels.data(), levels.size() * sizeof(int32_t), fh.levelOffset);
+    sink.write(tileDir.data(), tileDir.size() * sizeof(hic_tiles::TileEntry), fh.tileDirOffset);
+    sink.write(&fh, sizeof(fh), 0);
+    if (!sink.ok || ftruncate(sink.file.fd(), (off_t)sink.cursor.load()) != 0 || !sink.file.close()) {
+        std::cerr << "Error: writing " << outPath << " failed" << std::endl;
+        return 1;
+    }
+
+    if (missingNorm) std::cerr << "Warning: skipped " << missingNorm << " matrices without " << norm << " vectors.\n";
+    std::cout << "Exported " << tileDir.size() << " tiles of " << tileSize << "x" << tileSize << " at "
+              << levels.size() << " resolution(s) to " << outPath << ".\n";
+    return 0;
+}
+
+// --- pre: build a .hic from pairs ---
+//
+// Reads 4DN .pairs or Juicer short-format contacts, sorted or not, and
+// writes a v9 .hic. The input is split into line-aligned chunks parsed as
+// pool tasks; each worker bins every contact at all resolutions into its
+// own hash maps, so the single pass needs no locking. Each chromosome pair
+// then becomes a task that merges the per-worker maps, groups cells into
+// blocks, deflates them and writes them at offsets claimed from the output
+// cursor, followed by its matrix record. Expected values, the master index
+// and the header are written last.
+
+static const int32_t DEFAULT_PRE_RESOLUTIONS[] = {
+    2500000, 1000000, 500000, 250000, 100000, 50000, 25000, 10000, 5000
+};
+static const int32_t PRE_BLOCK_BIN_COUNT = 1000;
+static const int64_t PRE_CHUNK = 32 << 20;
+
+// "64G", "512M", "1048576" -> bytes; 0 on error.
+static int64_t parseByteSize(const std::string& s) {
+    char* end;
+    double v = std::strtod(s.c_str(), &end);
+    std::string unit(end);
+    int64_t mult = 1;
+    if (unit == "K" || unit == "k") mult = 1LL << 10;
+    else if (unit == "M" || unit == "m") mult = 1LL << 20;
+    else if (unit == "G" || unit == "g") mult = 1LL << 30;
+    else if (unit == "T" || unit == "t") mult = 1LL << 40;
+    else if (!unit.empty()) return 0;
+    return v > 0 ? (int64_t)(v * mult) : 0;
+}
+
+typedef std::unordered_map<uint64_t, float> CellMap;
+
+static uint64_t packBins(int32_t binX, int32_t binY) {
+    return ((uint64_t)(uint32_t)binX << 32) | (uint32_t)binY;
+}
+
+struct PreOptions {
+    std::vector<std::string> chrNames;    // index 0 is "All"
+    std::vector<int64_t> chrLengths;
+    std::unordered_map<std::string, int32_t> chrIndex;
+    std::vector<int32_t> resolutions;     // coarsest first
+    int minMapq;
+    bool shortFormat;
+};
+
+// Per-worker accumulator: chromosome pair -> one CellMap per resolution.
+struct PreBins {
+    std::unordered_map<uint64_t, std::vector<CellMap> > pairs;
+    int64_t contacts, skipped;
+    PreBins() : contacts(0), skipped(0) {}
+};
+
+static bool loadChromSizes(const std::string& path, PreOptions& opt) {
+    std::ifstream fs(path);
+    if (!fs) {
+        std::cerr << "Error: cannot open chrom.sizes file: " << path << std::endl;
+        return false;
+    }
+    opt.chrNames.assign(1, "All");
+    opt.chrLengths.assign(1, 0);
+    std::string line;
+    int64_t genomeLength = 0;
+    while (std::getline(fs, line)) {
+        std::istringstream ss(line);
+        std::string name;
+        int64_t len;
+        if (!(ss >> name >> len) || name[0] == '#') continue;
+        opt.chrIndex[name] = (int32_t)opt.chrNames.size();
+        opt.chrNames.push_back(name);
+        opt.chrLengths.push_back(len);
+        genomeLength += len;
+    }
+    // Juicer sizes the whole-genome pseudo-chromosome in kb.
+    opt.chrLengths[0] = genomeLength / 1000;
+    if (opt.chrNames.size() < 2) {
+        std::cerr << "Error: no chromosomes in " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static int32_t lookupChrom(const PreOptions& opt, const char* p, size_t n) {
+    std::string name(p, n);
+    auto it = opt.chrIndex.find(name);
+    if (it != opt.chrIndex.end()) return it->second;
+    // Tolerate "chr" prefix mismatches between pairs and chrom.sizes.
+    it = opt.chrIndex.find(name.compare(0, 3, "chr") == 0 ? name.substr(3) : "chr" + name);
+    return it != opt.chrIndex.end() ? it->second : -1;
+}
+
+static void binContact(const PreOptions& opt, PreBins& bins, int32_t c1, int64_t p1,
+                       int32_t c2, int64_t p2) {
+    if (c1 > c2 || (c1 == c2 && p1 > p2)) { std::swap(c1, c2); std::swap(p1, p2); }
+    std::vector<CellMap>& maps = bins.pairs[((uint64_t)c1 << 32) | (uint32_t)c2];
+    if (maps.empty()) maps.resize(opt.resolutions.size());
+    for (size_t r = 0; r < opt.resolutions.size(); r++) {
+        int32_t res = opt.resolutions[r];
+        maps[r][packBins((int32_t)(p1 / res), (int32_t)(p2 / res))] += 1.0f;
+    }
+    bins.contacts++;
+}
+
+// Parse the lines that start in [start, end), calling emit(c1, p1, c2, p2)
+// for each usable contact.
+template <class Emit>
+static bool parsePairsChunk(const HicFile& f, int64_t fileSize, int64_t start, int64_t end,
+                            const PreOptions& opt, Emit& emit, int64_t& skipped) {
+    int64_t from = start > 0 ? start - 1 : 0;
+    int64_t span = end - from + (1 << 16);
+    std::vector<char> buf;
+    while (true) {
+        int64_t len = std::min(span, fileSize - from);
+        buf.resize((size_t)len);
+        if (!f.read(buf.data(), buf.size(), from)) return false;
+        // Done if the last line starting before end is complete.
+        const char* nl = (const char*)std::memchr(buf.data() + (end - from) - 1, '\n', buf.size() - (end - from) + 1);
+        if (nl || from + len == fileSize) break;
+        span *= 2;
+    }
+
+    const char* p = buf.data();
+    const char* bufEnd = buf.data() + buf.size();
+    if (start > 0) {
+        // A line belongs to the chunk holding its first byte.
+        const char* nl = (const char*)std::memchr(p, '\n', bufEnd - p);
+        p = nl ? nl + 1 : bufEnd;
+    }
+    const char* fields[12];
+    size_t lens[12];
+    while (p < bufEnd && p - buf.data() + from < end) {
+        const char* eol = (const char*)std::memchr(p, '\n', bufEnd - p);
+        if (!eol) eol = bufEnd;
+        if (*p != '#' && eol > p) {
+            int nf = 0;
+            const char* q = p;
+            while (q < eol && nf < 12) {
+                while (q < eol && (*q == ' ' || *q == '\t' || *q == '\r')) q++;
+                if (q == eol) break;
+                fields[nf] = q;
+                while (q < eol && *q != ' ' && *q != '\t' && *q != '\r') q++;
+                lens[nf] = q - fields[nf];
+                nf++;
+            }
+            // short: str1 chr1 pos1 frag1 str2 chr2 pos2 frag2 [mapq1 mapq2]
+            // pairs: readID chr1 pos1 chr2 pos2 ...
+            int ic1 = 1, ip1 = 2, ic2 = opt.shortFormat ? 5 : 3, ip2 = opt.shortFormat ? 6 : 4;
+            bool ok = nf > ip2;
+            if (ok && opt.shortFormat && opt.minMapq > 0 && nf >= 10)
+                ok = std::atoi(fields[8]) >= opt.minMapq && std::atoi(fields[9]) >= opt.minMapq;
+            int32_t c1 = ok ? lookupChrom(opt, fields[ic1], lens[ic1]) : -1;
+            int32_t c2 = ok ? lookupChrom(opt, fields[ic2], lens[ic2]) : -1;
+            int64_t p1 = ok ? std::atoll(fields[ip1]) : -1;
+            int64_t p2 = ok ? std::atoll(fields[ip2]) : -1;
+            if (c1 > 0 && c2 > 0 && p1 >= 0 && p2 >= 0) emit(c1, p1, c2, p2);
+            else skipped++;
+        }
+        p = eol + 1;
+    }
+    return true;
+}
+
+// 5th/95th percentile of the non-zero cell counts, as Juicer reports them.
+static void countPercentiles(std::vector<float>& counts, float& p5, float& p95) {
+    p5 = p95 = 0;
+    if (counts.empty()) return;
+    size_t i5 = counts.size() * 5 / 100, i95 = std::min(counts.size() - 1, counts.size() * 95 / 100);
+    std::nth_element(counts.begin(), counts.begin() + i5, counts.end());
+    p5 = counts[i5];
+    std::nth_element(counts.begin(), counts.begin() + i95, counts.end());
+    p95 = counts[i95];
+}
+
+// Sort cells into blocks, encode them in parallel and write them to sink;
+// fills z.blocks (sorted by block number).
+static bool writeBlocks(std::vector<ContactCell>& cells, int32_t version, bool intra,
+                        ResolutionRecord& z, OutputSink& sink) {
+    std::vector<std::pair<int32_t, ContactCell> > keyed(cells.size());
+    for (size_t i = 0; i < cells.size(); i++)
+        keyed[i] = std::make_pair(blockNumberFor(version, intra, cells[i].binX, cells[i].binY,
+                                                 z.blockBinCount, z.blockColumnCount), cells[i]);
+    std::sort(keyed.begin(), keyed.end(),
+              [](const std::pair<int32_t, ContactCell>& a, const std::pair<int32_t, ContactCell>& b) {
+                  return a.first != b.first ? a.first < b.first : a.second < b.second;
+              });
+    for (size_t i = 0; i < keyed.size(); i++) cells[i] = keyed[i].second;
+
+    z.blocks.clear();
+    std::vector<std::pair<size_t, size_t> > ranges;
+    for (size_t i = 0; i < keyed.size(); ) {
+        size_t j = i;
+        while (j < keyed.size() && keyed[j].first == keyed[i].first) j++;
+        BlockIndexEntry b = {keyed[i].first, 0, 0};
+        z.blocks.push_back(b);
+        ranges.push_back(std::make_pair(i, j));
+        i = j;
+    }
+    keyed.clear();
+    keyed.shrink_to_fit();
+
+    std::atomic<bool> ok(true);
+    TaskGroup group;
+    for (size_t k = 0; k < ranges.size(); k++) {
+        group.run([&, k] {
+            std::vector<char> out, raw;
+            const ContactCell* first = cells.data() + ranges[k].first;
+            if (!encodeBlock(first, ranges[k].second - ranges[k].first, version, out, raw)) {
+                ok = false;
+                return;
+            }
+            z.blocks[k].position = (int64_t)sink.append(out);
+            z.blocks[k].size = (int32_t)out.size();
+        });
+    }
+    group.wait();
+    return ok && sink.ok;
+}
+
+// Expected-value accumulation across intra-chromosomal matrices.
+struct ExpectedAccumulator {
+    std::mutex mu;
+    std::vector<std::vector<double> > distanceSums;      // [resolution][distance]
+    std::vector<std::map<int32_t, double> > chrTotals;   // [resolution][chrIdx]
+};
+
+// Juicer's distance-normalized expected vector: observed sum over possible
+// cells per distance, widened until each window holds 400 contacts, plus a
+// per-chromosome factor that rescales expected to the observed total. With
+// normType set, the section is the normalized one for that type; v8 files
+// store the values and factors as doubles.
+static void appendExpectedValues(std::vector<char>& out, const PreOptions& opt,
+                                 const ExpectedAccumulator& acc, int32_t version = 9,
+                                 const std::string& normType = std::string()) {
+    auto appendValue = [&](double v) {
+        if (version > 8) appendFloat(out, (float)v);
+        else appendDouble(out, v);
+    };
+    appendInt32(out, (int32_t)opt.resolutions.size());
+    for (size_t r = 0; r < opt.resolutions.size(); r++) {
+        int32_t res = opt.resolutions[r];
+        int64_t nBins = 0;
+        for (size_t c = 1; c < opt.chrLengths.size(); c++)
+            nBins = std::max(nBins, opt.chrLengths[c] / res + 1);
+        std::vector<double> actual(acc.distanceSums[r]);
+        actual.resize((size_t)nBins, 0.0);
+        std::vector<double> possible((size_t)nBins, 0.0);
+        for (size_t c = 1; c < opt.chrLengths.size(); c++) {
+            int64_t n = opt.chrLengths[c] / res + 1;
+            for (int64_t d = 0; d < n; d++) possible[d] += (double)(n - d);
+        }
+
+        std::vector<double> density((size_t)nBins, 0.0);
+        double numSum = actual[0], denSum = possible[0];
+        int64_t bound1 = 0, bound2 = 0;
+        for (int64_t i = 0; i < nBins; i++) {
+            if (numSum < 400) {
+                while (numSum < 400 && bound2 + 1 < nBins) {
+                    bound2++;
+                    numSum += actual[bound2];
+                    denSum += possible[bound2];
+                }
+            } else {
+                while (bound2 - bound1 > 0 && numSum - actual[bound1] - actual[bound2] >= 400) {
+                    numSum -= actual[bound1] + actual[bound2];
+                    denSum -= possible[bound1] + possible[bound2];
+                    bound1++;
+                    bound2--;
+                }
+            }
+            density[i] = denSum > 0 ? numSum / denSum : 0;
+            if (bound2 + 2 < nBins) {
+                numSum += actual[bound2 + 1] + actual[bound2 + 2];
+                denSum += possible[bound2 + 1] + possible[bound2 + 2];
+                bound2 += 2;
+            } else if (bound2 + 1 < nBins) {
+                numSum += actual[bound2 + 1];
+                denSum += possible[bound2 + 1];
+                bound2++;
+            }
+        }
+
+        if (!normType.empty()) appendString(out, normType);
+        appendString(out, "BP");
+        appendInt32(out, res);
+        if (version > 8) appendInt64(out, nBins);
+        else appendInt32(out, (int32_t)nBins);
+        for (double v : density) appendValue(v);
+
+        const std::map<int32_t, double>& totals = acc.chrTotals[r];
+        appendInt32(out, (int32_t)totals.size());
+        for (const auto& t : totals) {
+            int64_t n = opt.chrLengths[t.first] / res + 1;
+            double expectedCount = 0;
+            for (int64_t d = 0; d < n && d < nBins; d++) expectedCount += density[d] * (double)(n - d);
+            appendInt32(out, t.first);
+            appendValue(t.second > 0 ? expectedCount / t.second : 1.0);
+        }
+    }
+}
+
+// Merge the per-worker maps of one chromosome pair and write its blocks and
+// matrix record.
+static bool writePreMatrix(int32_t c1, int32_t c2, std::vector<std::vector<CellMap>*>& parts,
+                           const PreOptions& opt, ExpectedAccumulator& acc, OutputSink& sink,
+                           MasterEntry& entry) {
+    const int32_t version = 9;
+    bool intra = c1 == c2;
+    MatrixRecord m;
+    m.chr1 = c1;
+    m.chr2 = c2;
+    for (size_t r = 0; r < opt.resolutions.size(); r++) {
+        CellMap merged;
+        for (auto* p : parts) {
+            CellMap& src = (*p)[r];
+            if (merged.empty()) merged.swap(src);
+            else for (const auto& kv : src) merged[kv.first] += kv.second;
+            CellMap().swap(src);
+        }
+        ResolutionRecord z;
+        z.unit = "BP";
+        z.resIdx = (int32_t)r;
+        z.binSize = opt.resolutions[r];
+        int64_t nBins = std::max(opt.chrLengths[c1], opt.chrLengths[c2]) / z.binSize + 1;
+        z.blockBinCount = PRE_BLOCK_BIN_COUNT;
+        z.blockColumnCount = (int32_t)(nBins / PRE_BLOCK_BIN_COUNT + 1);
+
+        std::vector<ContactCell> cells;
+        cells.reserve(merged.size());
+        std::vector<float> counts;
+        counts.reserve(merged.size());
+        double sum = 0;
+        std::vector<double> dist;
+        for (const auto& kv : merged) {
+            ContactCell cell = {(int32_t)(kv.first >> 32), (int32_t)(uint32_t)kv.first, kv.second};
+            cells.push_back(cell);
+            counts.push_back(cell.count);
+            sum += cell.count;
+            if (intra) {
+                size_t d = (size_t)(cell.binY - cell.binX);
+                if (dist.size() <= d) dist.resize(d + 1, 0.0);
+                dist[d] += cell.count;
+            }
+        }
+        CellMap().swap(merged);
+        z.sumCounts = (float)sum;
+        z.occupiedCellCount = (float)cells.size();
+        countPercentiles(counts, z.percent5, z.percent95);
+        if (!writeBlocks(cells, version, intra, z, sink)) return false;
+        m.resolutions.push_back(z);
+
+        if (intra) {
+            std::lock_guard<std::mutex> lk(acc.mu);
+            std::vector<double>& total = acc.distanceSums[r];
+            if (total.size() < dist.size()) total.resize(dist.size(), 0.0);
+            for (size_t d = 0; d < dist.size(); d++) total[d] += dist[d];
+            acc.chrTotals[r][c1] += sum;
+        }
+    }
+    std::vector<char> rec;
+    appendMatrixRecord(rec, m);
+    entry.key = std::to_string(c1) + "_" + std::to_string(c2);
+    entry.position = (int64_t)sink.append(rec);
+    entry.size = (int32_t)rec.size();
+    return sink.ok;
+}
+
+// "short" when the file has Juicer's 8+ column short format, else "pairs".
+// 4DN files announce themselves. Otherwise the first data line decides by
+// column types: Juicer short format has integer strands, positions and
+// fragments (str1 chr1 pos1 frag1 str2 chr2 pos2 frag2 ...), 4DN pairs have
+// +/- strands after the positions (readID chr1 pos1 chr2 pos2 strand1
+// strand2 ...). Returns "" when neither fits.
+static std::string detectPairsFormat(const HicFile& pairsFile) {
+    char head[65536] = {0};
+    pairsFile.read(head, std::min<int64_t>(pairsFile.size(), sizeof(head) - 1), 0);
+    std::istringstream lines(head);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.compare(0, 15, "## pairs format") == 0) return "pairs";
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream ss(line);
+        std::vector<std::string> c;
+        std::string tok;
+        while (ss >> tok) c.push_back(tok);
+        if (c.empty()) continue;
+        auto isInt = [](const std::string& t) {
+            size_t i = t[0] == '-' ? 1 : 0;
+            return i < t.size() && t.find_first_not_of("0123456789", i) == std::string::npos;
+        };
+        auto isStrand = [](const std::string& t) { return t == "+" || t == "-"; };
+        if (c.size() >= 8 && isInt(c[0]) && isInt(c[2]) && isInt(c[3]) && isInt(c[4]) && isInt(c[6]) &&
+            isInt(c[7]))
+            return "short";
+        if (c.size() >= 5 && isInt(c[2]) && isInt(c[4]) &&
+            (c.size() < 7 || (isStrand(c[5]) && isStrand(c[6]))))
+            return "pairs";
+        return "";
+    }
+    return "";
+}
+
+// One pass over the pairs file: chunks are binned into the running worker's
+// maps, then grouped by chromosome pair.
+static bool binPairs(const HicFile& pairsFile, const PreOptions& opt, std::vector<PreBins>& bins,
+                     std::map<uint64_t, std::vector<std::vector<CellMap>*> >& byPair,
+                     int64_t& contacts, int64_t& skipped) {
+    ThreadPool& pool = ThreadPool::shared();
+    int64_t pairsSize = pairsFile.size();
+    bins.assign(pool.size() + 1, PreBins());
+    std::atomic<bool> ok(true);
+    {
+        TaskGroup group(pool);
+        for (int64_t start = 0; start < pairsSize; start += PRE_CHUNK) {
+            int64_t end = std::min(pairsSize, start + PRE_CHUNK);
+            group.run([&, start, end] {
+                PreBins& mine = bins[tlsWorkerIdx >= 0 ? tlsWorkerIdx : pool.size()];
+                auto emit = [&](int32_t c1, int64_t p1, int32_t c2, int64_t p2) {
+                    binContact(opt, mine, c1, p1, c2, p2);
+                };
+                if (!parsePairsChunk(pairsFile, pairsSize, start, end, opt, emit, mine.skipped)) ok = false;
+            });
+        }
+    }
+    for (auto& b : bins) {
+        contacts += b.contacts;
+        skipped += b.skipped;
+        for (auto& kv : b.pairs) byPair[kv.first].push_back(&kv.second);
+    }
+    return ok;
+}
+
+// In-memory path: bin everything, then merge and write each chromosome
+// pair as a task.
+static bool preInMemory(const HicFile& pairsFile, const PreOptions& opt, ExpectedAccumulator& acc,
+                        OutputSink& sink, std::vector<MasterEntry>& master,
+                        int64_t& contacts, int64_t& skipped) {
+    ThreadPool& pool = ThreadPool::shared();
+    std::vector<PreBins> bins;
+    std::map<uint64_t, std::vector<std::vector<CellMap>*> > byPair;
+    if (!binPairs(pairsFile, opt, bins, byPair, contacts, skipped)) return false;
+    std::atomic<bool> ok(true);
+
+    master.resize(byPair.size());
+    TaskGroup group(pool);
+    size_t k = 0;
+    for (auto& kv : byPair) {
+        int32_t c1 = (int32_t)(kv.first >> 32), c2 = (int32_t)(uint32_t)kv.first;
+        std::vector<std::vector<CellMap>*>* parts = &kv.second;
+        MasterEntry* entry = &master[k++];
+        group.run([&, c1, c2, parts, entry] {
+            if (!writePreMatrix(c1, c2, *parts, opt, acc, sink, *entry)) ok = false;
+        });
+    }
+    group.wait();
+    return ok;
+}
+
+// --- pre: out-of-core sort ---
+//
+// With --max-memory, pre never holds the binned map in memory. Chunks are
+// parsed as before, but each contact is stored as a packed 64-bit key
+// (pos1 << 32 | pos2) in a per-worker buffer for its chromosome pair. When
+// a worker's buffers reach their half of the budget they are radix sorted
+// and spilled as runs to that worker's (unlinked) temp file. Each
+// chromosome pair then k-way merges its runs with a heap and streams the
+// sorted contacts into per-resolution block streamers, which encode a
+// block as soon as no later contact can fall into it.
+//
+// The merge runs only as many pairs at once as the other half of the
+// budget allows. A pair's share pays for its run readers and its pending
+// blocks: far-off-diagonal and coarse blocks close late, so when their
+// cells outgrow the share they are parked in the pair's own temp file and
+// read back when the block closes. Beyond the budget, only the block being
+// encoded is resident.
+
+struct SpillRun {
+    int file;
+    int64_t offset;
+    int64_t count;
+};
+
+struct SpillWorker {
+    std::unordered_map<uint64_t, std::vector<uint64_t> > buffers;
+    size_t buffered;
+    int fd;
+    int64_t fileSize;
+    int64_t contacts, skipped;
+    SpillWorker() : buffered(0), fd(-1), fileSize(0), contacts(0), skipped(0) {}
+};
+
+struct SpillSet {
+    std::string tmpDir;
+    std::vector<SpillWorker> workers;
+    std::mutex runsMu;
+    std::map<uint64_t, std::vector<SpillRun> > runs;   // chromosome pair -> runs
+    size_t capPerWorker;                               // keys per worker buffer
+    std::atomic<bool> ok;
+    SpillSet() : capPerWorker(0), ok(true) {}
+};
+
+// An unlinked temp file in dir, or -1.
+static int openSpillFile(const std::string& dir) {
+    std::string tmpl = dir + "/pre-spill-XXXXXX";
+    std::vector<char> name(tmpl.begin(), tmpl.end());
+    name.push_back('\0');
+    int fd = mkstemp(name.data());
+    if (fd >= 0) unlink(name.data());
+    return fd;
+}
+
+// LSD radix sort on 16-bit digits, skipping digits that are constant.
+static void radixSort64(std::vector<uint64_t>& keys, std::vector<uint64_t>& tmp) {
+    if (keys.size() < 64) { std::sort(keys.begin(), keys.end()); return; }
+    tmp.resize(keys.size());
+    std::vector<size_t> count(1 << 16);
+    for (int shift = 0; shift < 64; shift += 16) {
+        std::fill(count.begin(), count.end(), 0);
+        for (uint64_t k : keys) count[(k >> shift) & 0xffff]++;
+        if (count[(keys[0] >> shift) & 0xffff] == keys.size()) continue;
+        size_t sum = 0;
+        for (auto& c : count) { size_t n = c; c = sum; sum += n; }
+        for (uint64_t k : keys) tmp[count[(k >> shift) & 0xffff]++] = k;
+        keys.swap(tmp);
+    }
+}
+
+static void spillWorker(SpillSet& set, int w) {
+    SpillWorker& sw = set.workers[w];
+    std::vector<uint64_t> tmp;
+    for (auto& kv : sw.buffers) {
+        std::vector<uint64_t>& keys = kv.second;
+        if (keys.empty()) continue;
+        radixSort64(keys, tmp);
+        size_t bytes = keys.size() * sizeof(uint64_t);
+        if (!pwriteFull(sw.fd, (const char*)keys.data(), bytes, sw.fileSize)) set.ok = false;
+        SpillRun run = {w, sw.fileSize, (int64_t)keys.size()};
+        sw.fileSize += bytes;
+        {
+            std::lock_guard<std::mutex> lk(set.runsMu);
+            set.runs[kv.first].push_back(run);
+        }
+        keys.clear();
+    }
+    sw.buffered = 0;
+}
+
+// Sorted reader over one spilled run.
+struct RunReader {
+    int fd;
+    int64_t offset, remaining;
+    std::vector<uint64_t> buf;
+    size_t pos;
+
+    bool refill() {
+        size_t n = (size_t)std::min<int64_t>(remaining, (int64_t)buf.capacity());
+        buf.resize(n);
+        pos = 0;
+        if (n == 0 || !preadFull(fd, (char*)buf.data(), n * sizeof(uint64_t), offset)) return false;
+        offset += n * sizeof(uint64_t);
+        remaining -= n;
+        return true;
+    }
+    bool next(uint64_t& key) {
+        if (pos == buf.size() && !refill()) return false;
+        key = buf[pos++];
+        return true;
+    }
+};
+
+// Rough heap cost of one pending cell (a CellMap node and its bucket).
+static const size_t PENDING_CELL_BYTES = 48;
+static const int64_t MIN_MERGE_BUDGET = 16 << 20;   // per concurrently merged pair
+
+// Where a chromosome pair parks pending cells beyond its budget, opened on
+// first use.
+struct ParkingFile {
+    std::string dir;
+    int fd;
+    int64_t size;
+    ParkingFile() : fd(-1), size(0) {}
+    ~ParkingFile() { if (fd >= 0) close(fd); }
+};
+
+// Accumulates sorted contacts of one matrix at one resolution and writes
+// each block once the stream has moved past every bin it could hold.
+struct BlockStreamer {
+    bool intra;
+    ResolutionRecord z;
+    std::map<int32_t, CellMap> pending;             // block number -> cells
+    std::map<int32_t, std::vector<SpillRun> > parked; // block number -> ContactCell runs
+    std::multimap<int32_t, int32_t> closing;        // first binX past a block -> block number
+    size_t pendingCells;
+    ParkingFile* parking;
+    int32_t lastBinX;
+    double sum;
+    int64_t occupied;
+    std::map<float, int64_t> histogram;
+    std::vector<double> dist;
+    std::vector<ContactCell> cells;
+    std::vector<char> out, raw;
+
+    void add(int32_t binX, int32_t binY, OutputSink& sink, bool& ok) {
+        if (binX != lastBinX) {
+            lastBinX = binX;
+            flush(binX, sink, ok);
+        }
+        int32_t bn = blockNumberFor(9, intra, binX, binY, z.blockBinCount, z.blockColumnCount);
+        CellMap& block = pending[bn];
+        if (block.empty() && !parked.count(bn)) {
+            int32_t lane = intra ? (binX + binY) / 2 / z.blockBinCount : binX / z.blockBinCount;
+            closing.insert(std::make_pair((lane + 1) * z.blockBinCount, bn));
+        }
+        auto cell = block.emplace(packBins(binX, binY), 0.0f);
+        if (cell.second) pendingCells++;
+        cell.first->second += 1.0f;
+    }
+
+    // Move every pending cell to the parking file.
+    void park(bool& ok) {
+        if (parking->fd < 0 && (parking->fd = openSpillFile(parking->dir)) < 0) {
+            ok = false;
+            return;
+        }
+        for (const auto& kv : pending) {
+            cells.clear();
+            for (const auto& c : kv.second)
+                cells.push_back(ContactCell{(int32_t)(c.first >> 32), (int32_t)(uint32_t)c.first, c.second});
+            size_t bytes = cells.size() * sizeof(ContactCell);
+            if (!pwriteFull(parking->fd, (const char*)cells.data(), bytes, parking->size)) ok = false;
+            parked[kv.first].push_back(SpillRun{0, parking->size, (int64_t)cells.size()});
+            parking->size += (int64_t)bytes;
+        }
+        pending.clear();
+        pendingCells = 0;
+    }
+
+    // Write every pending block that closes at or before binX.
+    void flush(int32_t binX, OutputSink& sink, bool& ok) {
+        while (!closing.empty() && closing.begin()->first <= binX) {
+            int32_t number = closing.begin()->second;
+            closing.erase(closing.begin());
+            CellMap block;
+            auto it = pending.find(number);
+            if (it != pending.end()) {
+                pendingCells -= it->second.size();
+                block.swap(it->second);
+                pending.erase(it);
+            }
+            auto pk = parked.find(number);
+            if (pk != parked.end()) {
+                for (const SpillRun& run : pk->second) {
+                    cells.resize((size_t)run.count);
+                    if (!preadFull(parking->fd, (char*)cells.data(), cells.size() * sizeof(ContactCell), run.offset))
+                        ok = false;
+                    for (const ContactCell& c : cells) block[packBins(c.binX, c.binY)] += c.count;
+                }
+                parked.erase(pk);
+            }
+            cells.clear();
+            for (const auto& kv : block) {
+                ContactCell c = {(int32_t)(kv.first >> 32), (int32_t)(uint32_t)kv.first, kv.second};
+                cells.push_back(c);
+                sum += c.count;
+                histogram[c.count]++;
+                if (intra) {
+                    size_t d = (size_t)(c.binY - c.binX);
+                    if (dist.size() <= d) dist.resize(d + 1, 0.0);
+                    dist[d] += c.count;
+                }
+            }
+            occupied += (int64_t)cells.size();
+            std::sort(cells.begin(), cells.end());
+            if (!encodeBlock(cells.data(), cells.size(), 9, out, raw)) ok = false;
+            BlockIndexEntry b = {number, (int64_t)sink.append(out), (int32_t)out.size()};
+            z.blocks.push_back(b);
+        }
+    }
+
+    void finish(OutputSink& sink, bool& ok) {
+        flush(INT32_MAX, sink, ok);
+        std::sort(z.blocks.begin(), z.blocks.end(),
+                  [](const BlockIndexEntry& a, const BlockIndexEntry& b) { return a.number < b.number; });
+        z.sumCounts = (float)sum;
+        z.occupiedCellCount = (float)occupied;
+        z.percent5 = z.percent95 = 0;
+        int64_t i5 = occupied * 5 / 100, i95 = std::min(occupied - 1, occupied * 95 / 100), seen = 0;
+        bool have5 = false;
+        for (const auto& h : histogram) {
+            seen += h.second;
+            if (!have5 && seen > i5) { z.percent5 = h.first; have5 = true; }
+            if (seen > i95) { z.percent95 = h.first; break; }
+        }
+    }
+};
+
+// Merges one chromosome pair within `budget` bytes: half for its run
+// readers, half for pending cells.
+static bool mergePartition(int32_t c1, int32_t c2, const std::vector<SpillRun>& runs,
+                           const SpillSet& set, int64_t budget, const PreOptions& opt,
+                           ExpectedAccumulator& acc, OutputSink& sink, MasterEntry& entry) {
+    bool intra = c1 == c2;
+    size_t readKeys = std::max<size_t>(
+        1024, std::min<size_t>(1 << 17, (size_t)(budget / 2 / sizeof(uint64_t) / runs.size())));
+    size_t maxPending = std::max<size_t>(1 << 12, (size_t)(budget / 2 / PENDING_CELL_BYTES));
+    ParkingFile parking;
+    parking.dir = set.tmpDir;
+    std::vector<BlockStreamer> streams(opt.resolutions.size());
+    for (size_t r = 0; r < streams.size(); r++) {
+        BlockStreamer& s = streams[r];
+        s.intra = intra;
+        s.pendingCells = 0;
+        s.parking = &parking;
+        s.z.unit = "BP";
+        s.z.resIdx = (int32_t)r;
+        s.z.binSize = opt.resolutions[r];
+        int64_t nBins = std::max(opt.chrLengths[c1], opt.chrLengths[c2]) / s.z.binSize + 1;
+        s.z.blockBinCount = PRE_BLOCK_BIN_COUNT;
+        s.z.blockColumnCount = (int32_t)(nBins / PRE_BLOCK_BIN_COUNT + 1);
+        s.lastBinX = -1;
+        s.sum = 0;
+        s.occupied = 0;
+    }
+
+    std::vector<RunReader> readers(runs.size());
+    typedef std::pair<uint64_t, size_t> HeapItem;
+    std::priority_queue<HeapItem, std::vector<HeapItem>, std::greater<HeapItem> > heap;
+    for (size_t i = 0; i < runs.size(); i++) {
+        readers[i].fd = set.workers[runs[i].file].fd;
+        readers[i].offset = runs[i].offset;
+        readers[i].remaining = runs[i].count;
+        readers[i].buf.reserve(readKeys);
+        readers[i].pos = 0;
+        uint64_t key;
+        if (readers[i].next(key)) heap.push(HeapItem(key, i));
+    }
+
+    bool ok = true;
+    while (!heap.empty() && ok) {
+        HeapItem top = heap.top();
+        heap.pop();
+        int64_t p1 = (int64_t)(top.first >> 32), p2 = (int64_t)(uint32_t)top.first;
+        for (size_t r = 0; r < streams.size(); r++) {
+            int32_t res = opt.resolutions[r];
+            streams[r].add((int32_t)(p1 / res), (int32_t)(p2 / res), sink, ok);
+        }
+        size_t pendingCells = 0;
+        for (const auto& s : streams) pendingCells += s.pendingCells;
+        if (pendingCells > maxPending)
+            for (auto& s : streams) s.park(ok);
+        uint64_t key;
+        if (readers[top.second].next(key)) heap.push(HeapItem(key, top.second));
+    }
+
+    MatrixRecord m;
+    m.chr1 = c1;
+    m.chr2 = c2;
+    for (size_t r = 0; r < streams.size(); r++) {
+        streams[r].finish(sink, ok);
+        m.resolutions.push_back(streams[r].z);
+        if (intra) {
+            std::lock_guard<std::mutex> lk(acc.mu);
+            std::vector<double>& total = acc.distanceSums[r];
+            const std::vector<double>& dist = streams[r].dist;
+            if (total.size() < dist.size()) total.resize(dist.size(), 0.0);
+            for (size_t d = 0; d < dist.size(); d++) total[d] += dist[d];
+            acc.chrTotals[r][c1] += streams[r].sum;
+        }
+    }
+    std::vector<char> rec;
+    appendMatrixRecord(rec, m);
+    entry.key = std::to_string(c1) + "_" + std::to_string(c2);
+    entry.position = (int64_t)sink.append(rec);
+    entry.size = (int32_t)rec.size();
+    return ok && sink.ok;
+}
+
+static bool preExternal(const HicFile& pairsFile, const PreOptions& opt, int64_t maxMemory,
+                        const std::string& tmpDir, ExpectedAccumulator& acc, OutputSink& sink,
+                        std::vector<MasterEntry>& master, int64_t& contacts, int64_t& skipped) {
+    ThreadPool& pool = ThreadPool::shared();
+    int64_t pairsSize = pairsFile.size();
+    SpillSet set;
+    set.workers.resize(pool.size() + 1);
+    // Half the budget buffers keys while partitioning; chunk buffers and the
+    // merge phase live in the other half.
+    set.capPerWorker = std::max<size_t>(1 << 16, (size_t)(maxMemory / 2 / 2 / sizeof(uint64_t) / set.workers.size()));
+    set.tmpDir = tmpDir;
+    for (auto& w : set.workers) {
+        w.fd = openSpillFile(tmpDir);
+        if (w.fd < 0) {
+            std::cerr << "Error: cannot create temp file in " << tmpDir << std::endl;
+            for (auto& o : set.workers) if (o.fd >= 0) close(o.fd);
+            return false;
+        }
+    }
+
+    {
+        TaskGroup group(pool);
+        for (int64_t start = 0; start < pairsSize; start += PRE_CHUNK) {
+            int64_t end = std::min(pairsSize, start + PRE_CHUNK);
+            group.run([&, start, end] {
+                int w = tlsWorkerIdx >= 0 ? tlsWorkerIdx : (int)pool.size();
+                SpillWorker& sw = set.workers[w];
+                auto emit = [&](int32_t c1, int64_t p1, int32_t c2, int64_t p2) {
+                    if (c1 > c2 || (c1 == c2 && p1 > p2)) { std::swap(c1, c2); std::swap(p1, p2); }
+                    if (p1 > UINT32_MAX || p2 > UINT32_MAX) { sw.skipped++; return; }
+                    sw.buffers[((uint64_t)c1 << 32) | (uint32_t)c2].push_back(((uint64_t)p1 << 32) | (uint64_t)p2);
+                    sw.contacts++;
+                    if (++sw.buffered >= set.capPerWorker) spillWorker(set, w);
+                };
+                if (!parsePairsChunk(pairsFile, pairsSize, start, end, opt, emit, sw.skipped)) set.ok = false;
+            });
+        }
+    }
+    for (size_t w = 0; w < set.workers.size(); w++) {
+        spillWorker(set, (int)w);
+        contacts += set.workers[w].contacts;
+        skipped += set.workers[w].skipped;
+        std::unordered_map<uint64_t, std::vector<uint64_t> >().swap(set.workers[w].buffers);
+    }
+
+    // Merge: the other half of the budget is split between at most `slots`
+    // pairs at a time, each task taking the next pair when it finishes one.
+    bool ok = set.ok;
+    if (ok) {
+        std::vector<std::map<uint64_t, std::vector<SpillRun> >::const_iterator> pairs;
+        for (auto it = set.runs.cbegin(); it != set.runs.cend(); ++it) pairs.push_back(it);
+        master.resize(pairs.size());
+        size_t slots = (size_t)std::max<int64_t>(1, std::min<int64_t>((int64_t)pool.size(), maxMemory / 2 / MIN_MERGE_BUDGET));
+        int64_t budget = maxMemory / 2 / (int64_t)slots;
+        std::atomic<size_t> next(0);
+        std::atomic<bool> merged(true);
+        TaskGroup group(pool);
+        for (size_t t = 0; t < std::min(slots, pairs.size()); t++) {
+            group.run([&] {
+                size_t k;
+                while (merged && (k = next++) < pairs.size()) {
+                    int32_t c1 = (int32_t)(pairs[k]->first >> 32), c2 = (int32_t)(uint32_t)pairs[k]->first;
+                    if (!mergePartition(c1, c2, pairs[k]->second, set, budget, opt, acc, sink, master[k]))
+                        merged = false;
+                }
+            });
+        }
+        group.wait();
+        ok = merged;
+    }
+    for (auto& w : set.workers) close(w.fd);
+    return ok;
+}
+
+static int runPre(int argc, char** argv) {
+    PreOptions opt;
+    opt.minMapq = 0;
+    std::set<int32_t> resSet;
+    std::string genomeId, format, tmpDir;
+    int64_t maxMemory = 0;
+    std::vector<std::string> args;
+    for (int i = 2; i < argc; i++) {
+        std::string a = argv[i];
+        if ((a == "-r" || a == "--resolutions") && i + 1 < argc) {
+            if (!parseIntList(argv[++i], resSet)) {
+                std::cerr << "Error: bad resolution list: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (a == "-q" && i + 1 < argc) {
+            opt.minMapq = std::atoi(argv[++i]);
+        } else if (a == "--genome-id" && i + 1 < argc) {
+            genomeId = argv[++i];
+        } else if (a == "--format" && i + 1 < argc) {
+            format = argv[++i];
+        } else if (a == "--max-memory" && i + 1 < argc) {
+            maxMemory = parseByteSize(argv[++i]);
+            if (maxMemory <= 0) {
+                std::cerr << "Error: bad memory size: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (a == "--tmp-dir" && i + 1 < argc) {
+            tmpDir = argv[++i];
+        } else if (a == "--threads" && i + 1 < argc) {
+            g_poolThreads = std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            args.push_back(a);
+        }
+    }
+    if (args.size() != 3 || (!format.empty() && format != "pairs" && format != "short")) {
+        std::cerr << "Usage: " << argv[0] << " pre [-r res1,res2,...] [-q minMapq] [--format pairs|short]"
+                  << " [--genome-id ID] [--max-memory SIZE] [--tmp-dir DIR] [--threads N]"
+                  << " <in.pairs> <out.hic> <chrom.sizes>\n";
+        return 1;
+    }
+    const std::string pairsPath = args[0], outPath = args[1];
+    if (!loadChromSizes(args[2], opt)) return 1;
+    if (genomeId.empty()) genomeId = args[2];
+    if (resSet.empty()) resSet.insert(std::begin(DEFAULT_PRE_RESOLUTIONS), std::end(DEFAULT_PRE_RESOLUTIONS));
+    opt.resolutions.assign(resSet.rbegin(), resSet.rend());
+
+    HicFile pairsFile;
+    if (!pairsFile.open(pairsPath)) {
+        std::cerr << "Error: cannot open pairs file: " << pairsPath << std::endl;
+        return 1;
+    }
+    if (format.empty() && (format = detectPairsFormat(pairsFile)).empty()) {
+        std::cerr << "Error: cannot tell the format of " << pairsPath << "; pass --format pairs|short" << std::endl;
+        return 1;
+    }
+    opt.shortFormat = format == "short";
+
+    // Header with placeholder pointers; the body follows it directly.
+    std::vector<char> header;
+    appendString(header, "HIC");
+    appendInt32(header, 9);
+    size_t footerPosField = header.size();
+    appendInt64(header, 0);
+    appendString(header, genomeId);
+    size_t nviPosField = header.size();
+    appendInt64(header, 0);
+    appendInt64(header, 0);
+    appendInt32(header, 1);
+    appendString(header, "software");
+    appendString(header, "update_hic_header pre");
+    appendInt32(header, (int32_t)opt.chrNames.size());
+    for (size_t c = 0; c < opt.chrNames.size(); c++) {
+        appendString(header, opt.chrNames[c]);
+        appendInt64(header, opt.chrLengths[c]);
+    }
+    appendInt32(header, (int32_t)opt.resolutions.size());
+    for (int32_t r : opt.resolutions) appendInt32(header, r);
+    appendInt32(header, 0);               // no fragment resolutions
+
+    OutputSink sink;
+    if (!sink.file.open(outPath, O_RDWR | O_CREAT | O_TRUNC)) {
+        std::cerr << "Error: cannot open output file: " << outPath << std::endl;
+        return 1;
+    }
+    sink.cursor = header.size();
+
+    ExpectedAccumulator acc;
+    acc.distanceSums.resize(opt.resolutions.size());
+    acc.chrTotals.resize(opt.resolutions.size());
+    std::vector<MasterEntry> master;
+    int64_t contacts = 0, skipped = 0;
+    bool ok = maxMemory > 0
+        ? preExternal(pairsFile, opt, maxMemory, tmpDir.empty() ? parentDir(outPath) : tmpDir,
+                      acc, sink, master, contacts, skipped)
+        : preInMemory(pairsFile, opt, acc, sink, master, contacts, skipped);
+    if (!ok) {
+        std::cerr << "Error: building matrices for " << outPath << " failed" << std::endl;
+        return 1;
+    }
+
+    // Footer: master index and expected values, then empty normalized
+    // expected values and an empty normalization-vector index.
+    std::vector<char> footer;
+    appendInt64(footer, 0);
+    appendInt32(footer, (int32_t)master.size());
+    for (const auto& e : master) {
+        appendString(footer, e.key);
+        appendInt64(footer, e.position);
+        appendInt32(footer, e.size);
+    }
+    appendExpectedValues(footer, opt, acc);
+    writeInt64LE(footer.data(), (int64_t)footer.size() - 8);
+    appendInt32(footer, 0);               // normalized expected values
+    size_t nviOffset = footer.size();
+    appendInt32(footer, 0);               // normalization-vector index
+    uint64_t footerPos = sink.append(footer);
+
+    writeInt64LE(header.data() + footerPosField, (int64_t)footerPos);
+    writeInt64LE(header.data() + nviPosField, (int64_t)(footerPos + nviOffset));
+    writeInt64LE(header.data() + nviPosField + 8, 4);
+    sink.write(header.data(), header.size(), 0);
+    if (!sink.ok || !sink.file.close()) {
+        std::cerr << "Error: writing " << outPath << " failed" << std::endl;
+        return 1;
+    }
+
+    std::cout << "Wrote " << outPath << ": " << contacts << " contacts in " << master.size()
+              << " matrices at " << opt.resolutions.size() << " resolutions";
+    if (skipped) std::cout << " (" << skipped << " lines skipped)";
+    std::cout << ".\n";
+    return 0;
+}
+
+// --- append-contacts ---
+//
+// Adds new pairs to an existing map without rebuilding it. The new contacts
+// are binned at the file's bp resolutions; only blocks that receive contacts
+// are decoded, merged and re-encoded (in parallel) and appended after the
+// old data together with rewritten matrix records and a new footer. The
+// header's footer pointer is patched last, so an interrupted in-place append
+// leaves the original map intact. Replaced blocks and records become dead
+// bytes that `compact` reclaims. The whole-genome All matrix (0_0), when the
+// file has one, receives the same contacts at its genome bins. Expected
+// values and normalization vectors are carried over unchanged and should be
+// recomputed afterwards.
+
+struct TouchedBlock {
+    ResolutionRecord* z;
+    size_t slot;                          // index in z->blocks
+    bool existing;
+    std::vector<ContactCell> cells;       // new contacts
+    int64_t addedCells;                   // cells that were empty before
+};
+
+// Juicer's All matrix lays the chromosomes end to end in dictionary order
+// and bins the genome in kb. Start offset of each chromosome in that layout.
+static std::vector<int64_t> genomeOffsets(const HicHeader& h) {
+    std::vector<int64_t> offsets(h.chrNames.size(), 0);
+    for (size_t c = 2; c < h.chrNames.size(); c++) offsets[c] = offsets[c - 1] + h.chrLengths[c - 1];
+    return offsets;
+}
+
+// Which of the bp bin sizes the All matrix (allBin kb) is built from: the
+// coarsest that still fits in a genome bin, else the finest. -1 if none.
+static int allMatrixSource(const std::vector<int32_t>& binSizes, int32_t allBin) {
+    int64_t limit = (int64_t)allBin * 1000;
+    int best = -1;
+    for (size_t i = 0; i < binSizes.size(); i++) {
+        int32_t b = binSizes[i];
+        if (best < 0) { best = (int)i; continue; }
+        int32_t cur = binSizes[best];
+        if ((b <= limit && (cur > limit || b > cur)) || (b > limit && cur > limit && b < cur)) best = (int)i;
+    }
+    return best;
+}
+
+// All-matrix bin of the midpoint of bin `bin` (binSize bp) of chromosome chr.
+static int32_t allMatrixBin(const HicHeader& h, const std::vector<int64_t>& offsets, int32_t allBin,
+                            int32_t chr, int32_t binSize, int32_t bin) {
+    int64_t mid = std::min<int64_t>((int64_t)bin * binSize + binSize / 2, h.chrLengths[chr]);
+    return (int32_t)((offsets[chr] + mid) / 1000 / allBin);
+}
+
+// Decode the old block (if any), add the new cells and encode the result.
+static bool mergeTouchedBlock(const HicFile& f, int32_t version, TouchedBlock& t, OutputSink& sink) {
+    BlockIndexEntry& entry = t.z->blocks[t.slot];
+    CellMap cells;
+    if (t.existing) {
+        DecodedBlock old;
+        DecodeScratch scratch;
+        if (!readBlock(f, version, entry, old, scratch)) return false;
+        for (size_t i = 0; i < old.size(); i++)
+            cells[packBins(old.binX[i], old.binY[i])] += old.counts[i];
+    }
+    size_t before = cells.size();
+    for (const auto& c : t.cells) cells[packBins(c.binX, c.binY)] += c.count;
+    t.addedCells = (int64_t)(cells.size() - before);
+
+    std::vector<ContactCell> merged;
+    merged.reserve(cells.size());
+    for (const auto& kv : cells) {
+        ContactCell c = {(int32_t)(kv.first >> 32), (int32_t)(uint32_t)kv.first, kv.second};
+        merged.push_back(c);
+    }
+    std::sort(merged.begin(), merged.end());
+    std::vector<char> out, raw;
+    if (!encodeBlock(merged.data(), merged.size(), version, out, raw)) return false;
+    entry.position = (int64_t)sink.append(out);
+    entry.size = (int32_t)out.size();
+    return sink.ok;
+}
+
+// Points sink at the end of the file that will receive appended data: the
+// input itself with inPlace, else a fresh copy of it at outPath.
+static bool openAppendSink(const HicFile& inFile, const std::string& inPath, const std::string& outPath,
+                           bool inPlace, OutputSink& sink) {
+    int64_t size = inFile.size();
+    if (inPlace) {
+        if (!sink.file.open(inPath, O_RDWR)) {
+            std::cerr << "Error: cannot open " << inPath << " for writing" << std::endl;
+            return false;
+        }
+    } else if (!sink.file.open(outPath, O_RDWR | O_CREAT | O_TRUNC) ||
+               !copyRange(inFile.fd(), 0, sink.file.fd(), 0, size)) {
+        std::cerr << "Error: cannot copy " << inPath << " to " << outPath << std::endl;
+        return false;
+    }
+    sink.cursor = (uint64_t)size;
+    return true;
+}
+
+// Appends a footer whose master index is `master` (expected values and the
+// v9 normalization-vector index are copied from the input), syncs, and then
+// points the header at it. Until that last write the file still reads as
+// the input did.
+static bool publishFooter(const HicFile& inFile, const HicHeader& h, const std::string& inPath,
+                          const std::string& outPath, int64_t masterEnd,
+                          const std::vector<MasterEntry>& master, OutputSink& sink) {
+    int64_t expectedEnd, tailEnd;
+    bool tailOk = scanFooterEnd(inFile, h.version, masterEnd, expectedEnd, tailEnd);
+    std::vector<char> footer;
+    if (h.version > 8) appendInt64(footer, 0);
+    else appendInt32(footer, 0);
+    appendInt32(footer, (int32_t)master.size());
+    for (const auto& e : master) {
+        appendString(footer, e.key);
+        appendInt64(footer, e.position);
+        appendInt32(footer, e.size);
+    }
+    size_t masterSize = footer.size();
+    footer.resize(masterSize + (size_t)(tailEnd - masterEnd));
+    if (!tailOk || !inFile.read(footer.data() + masterSize, (size_t)(tailEnd - masterEnd), masterEnd)) {
+        std::cerr << "Error: cannot read footer of " << inPath << std::endl;
+        return false;
+    }
+    int64_t nBytes = (int64_t)masterSize + (expectedEnd - masterEnd) - (h.version > 8 ? 8 : 4);
+    if (h.version > 8) writeInt64LE(footer.data(), nBytes);
+    else writeInt32LE(footer.data(), (int32_t)nBytes);
+    size_t nviOffset = footer.size();
+    if (h.version > 8 && h.nviPos > 0) {
+        footer.resize(nviOffset + (size_t)h.nviLen);
+        if (!inFile.read(footer.data() + nviOffset, (size_t)h.nviLen, h.nviPos)) {
+            std::cerr << "Error: cannot read normalization-vector index of " << inPath << std::endl;
+            return false;
+        }
+    }
+    uint64_t footerPos = sink.append(footer);
+
+    // Data first, then the header pointers that make it visible.
+    char pos[8];
+    writeInt64LE(pos, (int64_t)footerPos);
+    bool synced = sink.ok && sink.file.datasync() && sink.file.write(pos, 8, (int64_t)h.footerPosField);
+    if (synced && h.version > 8 && h.nviPos > 0) {
+        writeInt64LE(pos, (int64_t)(footerPos + nviOffset));
+        synced = sink.file.write(pos, 8, (int64_t)h.nviPosField);
+    }
+    if (!synced || !sink.file.datasync() || !sink.file.close()) {
+        std::cerr << "Error: writing " << outPath << " failed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static int runAppendContacts(int argc, char** argv) {
+    PreOptions opt;
+    opt.minMapq = 0;
+    bool inPlace = false;
+    std::string format;
+    std::vector<std::string> args;
+    for (int i = 2; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--in-place") {
+            inPlace = true;
+        } else if (a == "-q" && i + 1 < argc) {
+            opt.minMapq = std::atoi(argv[++i]);
+        } else if (a == "--format" && i + 1 < argc) {
+            format = argv[++i];
+        } else if (a == "--threads" && i + 1 < argc) {
+            g_poolThreads = std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            args.push_back(a);
+        }
+    }
+    if (args.size() != (inPlace ? 2u : 3u) || (!format.empty() && format != "pairs" && format != "short")) {
+        std::cerr << "Usage: " << argv[0] << " append-contacts [-q minMapq] [--format pairs|short] [--threads N]"
+                  << " <in.hic> <new.pairs> <out.hic>\n"
+                  << "       " << argv[0] << " append-contacts [options] --in-place <file.hic> <new.pairs>\n";
+        return 1;
+    }
+    const std::string inPath = args[0], pairsPath = args[1];
+    const std::string outPath = inPlace ? inPath : args[2];
+
+    HicFile inFile;
+    if (!inFile.open(inPath, inPlace ? O_RDWR : O_RDONLY)) {
+        std::cerr << "Error: cannot open input file: " << inPath << std::endl;
+        return 1;
+    }
+    HicHeader h;
+    if (!parseHicHeader(inFile, inPath, h)) return 1;
+    std::vector<MasterEntry> master;
+    int64_t masterEnd;
+    if (!scanMasterIndex(inFile, h.footerPos, h.version, master, masterEnd)) {
+        std::cerr << "Error: cannot read master index of " << inPath << std::endl;
+        return 1;
+    }
+
+    // Bin against the file's own dictionary and bp resolutions.
+    opt.chrNames = h.chrNames;
+    opt.chrLengths = h.chrLengths;
+    for (size_t c = 1; c < h.chrNames.size(); c++) opt.chrIndex[h.chrNames[c]] = (int32_t)c;
+    opt.resolutions = h.bpResolutions;
+    HicFile pairsFile;
+    if (!pairsFile.open(pairsPath)) {
+        std::cerr << "Error: cannot open pairs file: " << pairsPath << std::endl;
+        return 1;
+    }
+    if (format.empty() && (format = detectPairsFormat(pairsFile)).empty()) {
+        std::cerr << "Error: cannot tell the format of " << pairsPath << "; pass --format pairs|short" << std::endl;
+        return 1;
+    }
+    opt.shortFormat = format == "short";
+    std::vector<PreBins> bins;
+    std::map<uint64_t, std::vector<std::vector<CellMap>*> > byPair;
+    int64_t contacts = 0, skipped = 0;
+    if (!binPairs(pairsFile, opt, bins, byPair, contacts, skipped)) {
+        std::cerr << "Error: reading " << pairsPath << " failed" << std::endl;
+        return 1;
+    }
+
+    // Load the records of touched matrices; pairs without one get a new
+    // record laid out the way pre lays them out.
+    std::map<std::string, size_t> masterByKey;
+    for (size_t i = 0; i < master.size(); i++) masterByKey[master[i].key] = i;
+    std::vector<MatrixRecord> records(byPair.size());
+    std::vector<std::string> keys;
+    size_t k = 0;
+    for (const auto& kv : byPair) {
+        int32_t c1 = (int32_t)(kv.first >> 32), c2 = (int32_t)(uint32_t)kv.first;
+        std::string key = std::to_string(c1) + "_" + std::to_string(c2);
+        keys.push_back(key);
+        MatrixRecord& m = records[k++];
+        auto it = masterByKey.find(key);
+        if (it != masterByKey.end()) {
+            if (!readMatrixRecord(inFile, master[it->second].position, m)) {
+                std::cerr << "Error: cannot read matrix " << key << " of " << inPath << std::endl;
+                return 1;
+            }
+            continue;
+        }
+        m.chr1 = c1;
+        m.chr2 = c2;
+        for (size_t r = 0; r < opt.resolutions.size(); r++) {
+            ResolutionRecord z;
+            z.unit = "BP";
+            z.resIdx = (int32_t)r;
+            z.sumCounts = z.occupiedCellCount = z.percent5 = z.percent95 = 0;
+            z.binSize = opt.resolutions[r];
+            int64_t nBins = std::max(opt.chrLengths[c1], opt.chrLengths[c2]) / z.binSize + 1;
+            z.blockBinCount = PRE_BLOCK_BIN_COUNT;
+            z.blockColumnCount = (int32_t)(nBins / PRE_BLOCK_BIN_COUNT + 1);
+            z.blockIndexOffset = 0;
+            m.resolutions.push_back(z);
+        }
+    }
+
+    // The All matrix gets the same contacts at its genome bins, mapped from
+    // the resolution rebuild-all would use.
+    CellMap allCells;
+    auto allEntry = masterByKey.find("0_0");
+    if (allEntry != masterByKey.end() && !h.chrNames.empty() && h.chrNames[0] == "All") {
+        MatrixRecord all;
+        if (!readMatrixRecord(inFile, master[allEntry->second].position, all) || all.resolutions.empty()) {
+            std::cerr << "Error: cannot read matrix 0_0 of " << inPath << std::endl;
+            return 1;
+        }
+        int32_t allBin = all.resolutions[0].binSize;
+        std::vector<int64_t> offsets = genomeOffsets(h);
+        int src = allMatrixSource(opt.resolutions, allBin);
+        int32_t srcBin = src >= 0 ? opt.resolutions[src] : 0;
+        for (const auto& kv : byPair) {
+            if (src < 0) break;
+            int32_t c1 = (int32_t)(kv.first >> 32), c2 = (int32_t)(uint32_t)kv.first;
+            for (auto* parts : kv.second) {
+                for (const auto& cell : (*parts)[src]) {
+                    int32_t x = allMatrixBin(h, offsets, allBin, c1, srcBin, (int32_t)(cell.first >> 32));
+                    int32_t y = allMatrixBin(h, offsets, allBin, c2, srcBin, (int32_t)(uint32_t)cell.first);
+                    if (x > y) std::swap(x, y);
+                    allCells[packBins(x, y)] += cell.second;
+                }
+            }
+        }
+        records.push_back(all);
+        keys.push_back("0_0");
+    }
+
+    // Split the new cells by block; each touched block gets a slot in its
+    // resolution's index (existing entry or a new one).
+    std::deque<TouchedBlock> touched;
+    auto touch = [&](ResolutionRecord* z, std::map<int32_t, std::vector<ContactCell> >& byBlock) {
+        std::unordered_map<int32_t, size_t> slotOf;
+        for (size_t b = 0; b < z->blocks.size(); b++) slotOf[z->blocks[b].number] = b;
+        for (auto& bb : byBlock) {
+            TouchedBlock t;
+            t.z = z;
+            auto s = slotOf.find(bb.first);
+            t.existing = s != slotOf.end();
+            if (t.existing) {
+                t.slot = s->second;
+            } else {
+                BlockIndexEntry e = {bb.first, 0, 0};
+                t.slot = z->blocks.size();
+                z->blocks.push_back(e);
+            }
+            t.cells.swap(bb.second);
+            t.addedCells = 0;
+            touched.push_back(std::move(t));
+        }
+    };
+    k = 0;
+    for (auto& kv : byPair) {
+        MatrixRecord& m = records[k++];
+        bool intra = m.chr1 == m.chr2;
+        for (size_t r = 0; r < opt.resolutions.size(); r++) {
+            ResolutionRecord* z = nullptr;
+            for (auto& zz : m.resolutions)
+                if (zz.unit == "BP" && zz.binSize == opt.resolutions[r]) z = &zz;
+            if (!z) continue;
+            std::map<int32_t, std::vector<ContactCell> > byBlock;
+            double sum = 0;
+            for (auto* parts : kv.second) {
+                for (const auto& cell : (*parts)[r]) {
+                    ContactCell c = {(int32_t)(cell.first >> 32), (int32_t)(uint32_t)cell.first, cell.second};
+                    byBlock[blockNumberFor(h.version, intra, c.binX, c.binY,
+                                           z->blockBinCount, z->blockColumnCount)].push_back(c);
+                    sum += c.count;
+                }
+            }
+            z->sumCounts += (float)sum;
+            touch(z, byBlock);
+        }
+    }
+    if (!allCells.empty()) {
+        ResolutionRecord* z = &records.back().resolutions[0];
+        std::map<int32_t, std::vector<ContactCell> > byBlock;
+        double sum = 0;
+        for (const auto& kv : allCells) {
+            ContactCell c = {(int32_t)(kv.first >> 32), (int32_t)(uint32_t)kv.first, kv.second};
+            byBlock[blockNumberFor(h.version, true, c.binX, c.binY, z->blockBinCount, z->blockColumnCount)].push_back(c);
+            sum += c.count;
+        }
+        z->sumCounts += (float)sum;
+        touch(z, byBlock);
+        CellMap().swap(allCells);
+    }
+    bins.clear();
+
+    // Everything new goes after the old end of file.
+    OutputSink sink;
+    if (!openAppendSink(inFile, inPath, outPath, inPlace, sink)) return 1;
+
+    std::atomic<bool> ok(true);
+    {
+        TaskGroup group;
+        for (auto& t : touched) {
+            TouchedBlock* tp = &t;
+            group.run([&, tp] {
+                if (!mergeTouchedBlock(inFile, h.version, *tp, sink)) ok = false;
+            });
+        }
+    }
+    if (!ok) {
+        std::cerr << "Error: re-encoding blocks of " << inPath << " failed" << std::endl;
+        return 1;
+    }
+    for (const auto& t : touched) t.z->occupiedCellCount += (float)t.addedCells;
+
+    // Rewritten records, then a footer whose master index points at them;
+    // the expected values and the normalization-vector index are copied.
+    for (size_t i = 0; i < records.size(); i++) {
+        for (auto& z : records[i].resolutions)
+            std::sort(z.blocks.begin(), z.blocks.end(),
+                      [](const BlockIndexEntry& a, const BlockIndexEntry& b) { return a.number < b.number; });
+        std::vector<char> rec;
+        appendMatrixRecord(rec, records[i]);
+        auto it = masterByKey.find(keys[i]);
+        if (it == masterByKey.end()) {
+            MasterEntry e;
+            e.key = keys[i];
+            it = masterByKey.insert(std::make_pair(e.key, master.size())).first;
+            master.push_back(e);
+        }
+        master[it->second].position = (int64_t)sink.append(rec);
+        master[it->second].size = (int32_t)rec.size();
+    }
+
+    if (!publishFooter(inFile, h, inPath, outPath, masterEnd, master, sink)) return 1;
+
+    std::cout << "Appended " << contacts << " contacts to " << outPath << ": re-encoded "
+              << touched.size() << " blocks in " << records.size() << " matrices";
+    if (skipped) std::cout << " (" << skipped << " lines skipped)";
+    std::cout << ".\nNote: expected values and normalization vectors were kept as-is.\n";
+    return 0;
+}
+
+// --- rebuild-all ---
+//
+// Regenerates the whole-genome "All" matrix (0_0) from the per-chromosome
+// matrices, e.g. after append-contacts or an external merge left it stale.
+// Juicer's layout is kept: positions are genome coordinates in kb (the
+// chromosomes laid end to end in dictionary order) at one resolution of
+// about 1/500 of the genome. Each matrix is a pool task that decodes only
+// its coarsest bp resolution no coarser than that and maps every cell's
+// midpoint into the genome grid; the merged cells become one new record,
+// appended with a new footer as append-contacts does. The old record, if
+// any, is left for compact.
+
+static int runRebuildAll(int argc, char** argv) {
+    bool inPlace = false;
+    std::vector<std::string> args;
+    for (int i = 2; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--in-place") inPlace = true;
+        else if (a == "--threads" && i + 1 < argc) g_poolThreads = std::strtoul(argv[++i], nullptr, 10);
+        else args.push_back(a);
+    }
+    if (args.size() != (inPlace ? 1u : 2u)) {
+        std::cerr << "Usage: " << argv[0] << " rebuild-all [--threads N] <in.hic> <out.hic>\n"
+                  << "       " << argv[0] << " rebuild-all [--threads N] --in-place <file.hic>\n";
+        return 1;
+    }
+    const std::string inPath = args[0];
+    const std::string outPath = inPlace ? inPath : args[1];
+
+    HicFile inFile;
+    if (!inFile.open(inPath, inPlace ? O_RDWR : O_RDONLY)) {
+        std::cerr << "Error: cannot open input file: " << inPath << std::endl;
+        return 1;
+    }
+    HicHeader h;
+    if (!parseHicHeader(inFile, inPath, h)) return 1;
+    std::vector<MasterEntry> master;
+    int64_t masterEnd;
+    if (!scanMasterIndex(inFile, h.footerPos, h.version, master, masterEnd)) {
+        std::cerr << "Error: cannot read master index of " << inPath << std::endl;
+        return 1;
+    }
+    if (h.chrNames.size() < 2 || h.chrNames[0] != "All") {
+        std::cerr << "Error: " << inPath << " has no All pseudo-chromosome" << std::endl;
+        return 1;
+    }
+
+    std::vector<int64_t> offsets = genomeOffsets(h);
+    int64_t genomeKb = (offsets.back() + h.chrLengths.back()) / 1000;
+    int32_t allBin = (int32_t)std::max<int64_t>(1, genomeKb / 500);
+
+    std::mutex mu;
+    CellMap all;
+    std::atomic<bool> ok(true);
+    std::atomic<int64_t> matrices(0);
+    {
+        TaskGroup group;
+        for (const auto& e : master) {
+            if (e.key.compare(0, 2, "0_") == 0) continue;
+            int64_t recPos = e.position;
+            group.run([&, recPos] {
+                MatrixRecord m;
+                if (!readMatrixRecord(inFile, recPos, m)) { ok = false; return; }
+                if (m.chr1 <= 0 || m.chr2 <= 0 || m.chr1 >= (int32_t)offsets.size() ||
+                    m.chr2 >= (int32_t)offsets.size()) return;
+                std::vector<const ResolutionRecord*> bp;
+                std::vector<int32_t> binSizes;
+                for (const auto& zz : m.resolutions) {
+                    if (zz.unit != "BP") continue;
+                    bp.push_back(&zz);
+                    binSizes.push_back(zz.binSize);
+                }
+                int src = allMatrixSource(binSizes, allBin);
+                if (src < 0) return;
+                const ResolutionRecord* z = bp[src];
+                CellMap local;
+                DecodedBlock block;
+                DecodeScratch scratch;
+                for (const auto& b : z->blocks) {
+                    if (!readBlock(inFile, h.version, b, block, scratch)) { ok = false; return; }
+                    for (size_t i = 0; i < block.size(); i++) {
+                        int32_t x = allMatrixBin(h, offsets, allBin, m.chr1, z->binSize, block.binX[i]);
+                        int32_t y = allMatrixBin(h, offsets, allBin, m.chr2, z->binSize, block.binY[i]);
+                        if (x > y) std::swap(x, y);
+                        local[packBins(x, y)] += block.counts[i];
+                    }
+                }
+                std::lock_guard<std::mutex> lk(mu);
+                if (all.empty()) all.swap(local);
+                else for (const auto& kv : local) all[kv.first] += kv.second;
+                matrices++;
+            });
+        }
+    }
+    if (!ok) {
+        std::cerr << "Error: decoding matrices of " << inPath << " failed" << std::endl;
+        return 1;
+    }
+
+    OutputSink sink;
+    if (!openAppendSink(inFile, inPath, outPath, inPlace, sink)) return 1;
+
+    MatrixRecord m;
+    m.chr1 = m.chr2 = 0;
+    ResolutionRecord z;
+    z.unit = "BP";
+    z.resIdx = 0;
+    z.binSize = allBin;
+    z.blockBinCount = PRE_BLOCK_BIN_COUNT;
+    z.blockColumnCount = (int32_t)((genomeKb / allBin + 1) / PRE_BLOCK_BIN_COUNT + 1);
+    std::vector<ContactCell> cells;
+    std::vector<float> counts;
+    cells.reserve(all.size());
+    counts.reserve(all.size());
+    double sum = 0;
+    for (const auto& kv : all) {
+        ContactCell c = {(int32_t)(kv.first >> 32), (int32_t)(uint32_t)kv.first, kv.second};
+        cells.push_back(c);
+        counts.push_back(c.count);
+        sum += c.count;
+    }
+    CellMap().swap(all);
+    z.sumCounts = (float)sum;
+    z.occupiedCellCount = (float)cells.size();
+    countPercentiles(counts, z.percent5, z.percent95);
+    if (!writeBlocks(cells, h.version, true, z, sink)) {
+        std::cerr << "Error: writing blocks to " << outPath << " failed" << std::endl;
+        return 1;
+    }
+    m.resolutions.push_back(z);
+    std::vector<char> rec;
+    appendMatrixRecord(rec, m);
+
+    auto it = std::find_if(master.begin(), master.end(), [](const MasterEntry& e) { return e.key == "0_0"; });
+    if (it == master.end()) {
+        MasterEntry e;
+        e.key = "0_0";
+        it = master.insert(master.begin(), e);
+    }
+    it->position = (int64_t)sink.append(rec);
+    it->size = (int32_t)rec.size();
+    if (!publishFooter(inFile, h, inPath, outPath, masterEnd, master, sink)) return 1;
+
+    std::cout << "Rebuilt the All matrix of " << outPath << " from " << matrices << " matrices: "
+              << cells.size() << " cells at " << allBin << " kb, " << z.blocks.size() << " blocks.\n";
+    return 0;
+}
+
+// --- compact ---
+//
+// Rewrites a .hic without the byte ranges nothing points at (old footers,
+// replaced blocks and records, superseded norm vectors). A reachability
+// pass collects every referenced range: the header with any restriction-
+// site arrays, matrix records and their blocks, the footer with expected
+// values, the normalization-vector index and the vectors it lists.
+// Overlapping or adjacent ranges merge into live segments, which are copied
+// in order with the copy engine; every pointer is then mapped through the
+// segment table.
+
+struct LiveSegment {
+    int64_t start, end, newStart;
+};
+
+class LiveMap {
+public:
+    void add(int64_t start, int64_t len) {
+        if (len > 0) ranges_.push_back(std::make_pair(start, start + len));
+    }
+
+    // Merge the collected ranges into segments; returns the live byte count.
+    int64_t build() {
+        std::sort(ranges_.begin(), ranges_.end());
+        segments_.clear();
+        int64_t live = 0;
+        for (const auto& r : ranges_) {
+            if (!segments_.empty() && r.first <= segments_.back().end) {
+                if (r.second > segments_.back().end) {
+                    live += r.second - segments_.back().end;
+                    segments_.back().end = r.second;
+                }
+                continue;
+            }
+            LiveSegment s = {r.first, r.second, live};
+            segments_.push_back(s);
+            live += r.second - r.first;
+        }
+        return live;
+    }
+
+    // New offset of an old one; offsets in dead gaps map to the start of
+    // the next live byte.
+    int64_t map(int64_t old) const {
+        auto it = std::upper_bound(segments_.begin(), segments_.end(), old,
+                                   [](int64_t v, const LiveSegment& s) { return v < s.start; });
+        if (it == segments_.begin()) return 0;
+        --it;
+        return it->newStart + std::min(old - it->start, it->end - it->start);
+    }
+
+    const std::vector<LiveSegment>& segments() const { return segments_; }
+
+private:
+    std::vector<std::pair<int64_t, int64_t> > ranges_;
+    std::vector<LiveSegment> segments_;
+};
+
+// Compacts inPath into outPath, or over inPath when inPlace. Returns the
+// process exit status.
+static int compactHic(const std::string& inPath, const std::string& outArg, bool inPlace, bool dryRun) {
+    HicFile inFile;
+    if (!inFile.open(inPath)) {
+        std::cerr << "Error: cannot open input file: " << inPath << std::endl;
+        return 1;
+    }
+    HicHeader h;
+    if (!parseHicHeader(inFile, inPath, h)) return 1;
+
+    // Reachability: header, then everything the footer leads to.
+    LiveMap live;
+    live.add(0, (int64_t)h.dataStart);
+
+    std::vector<MasterEntry> master;
+    int64_t masterEnd, expectedEnd, footerEnd;
+    if (!scanMasterIndex(inFile, h.footerPos, h.version, master, masterEnd) ||
+        !scanFooterEnd(inFile, h.version, masterEnd, expectedEnd, footerEnd)) {
+        std::cerr << "Error: cannot read footer of " << inPath << std::endl;
+        return 1;
+    }
+    live.add(h.footerPos, footerEnd - h.footerPos);
+
+    std::vector<MatrixRecord> records(master.size());
+    std::atomic<bool> ok(true);
+    {
+        TaskGroup group;
+        for (size_t i = 0; i < master.size(); i++) {
+            group.run([&, i] {
+                if (!readMatrixRecord(inFile, master[i].position, records[i])) ok = false;
+            });
+        }
+    }
+    if (!ok) {
+        std::cerr << "Error: cannot read matrix records of " << inPath << std::endl;
+        return 1;
+    }
+    for (size_t i = 0; i < master.size(); i++) {
+        live.add(master[i].position, master[i].size);
+        for (const auto& z : records[i].resolutions)
+            for (const auto& b : z.blocks) live.add(b.position, b.size);
+    }
+
+    int64_t nviPos = locateNormVectorIndex(inFile, h, masterEnd, 0);
+    std::vector<NormVectorEntry> norms;
+    if (nviPos > 0) {
+        if (!readNormVectorIndex(inFile, nviPos, h.version, norms)) {
+            std::cerr << "Error: cannot read normalization-vector index of " << inPath << std::endl;
+            return 1;
+        }
+        if (h.version > 8) live.add(h.nviPos, h.nviLen);
+        for (const auto& e : norms) live.add(e.position, e.size);
+    }
+
+    int64_t fileSize = inFile.size();
+    int64_t liveBytes = live.build();
+    const std::vector<LiveSegment>& segments = live.segments();
+    size_t gaps = segments.size() - 1 + (segments.back().end < fileSize ? 1 : 0);
+    std::cout << inPath << ": " << fileSize << " bytes, " << liveBytes << " live, "
+              << fileSize - liveBytes << " dead in " << gaps << " gap(s).\n";
+    if (dryRun || liveBytes == fileSize) {
+        if (!dryRun) std::cout << "Nothing to reclaim.\n";
+        return 0;
+    }
+
+    // Copy live segments, then rewrite the pointers in their new places.
+    std::string outPath = inPlace ? inPath + ".tmp." + std::to_string(getpid()) : outArg;
+    HicFile outFile;
+    if (!outFile.open(outPath, O_RDWR | O_CREAT | O_TRUNC) || ftruncate(outFile.fd(), liveBytes) != 0) {
+        std::cerr << "Error: cannot open output file: " << outPath << std::endl;
+        return 1;
+    }
+    {
+        TaskGroup group;
+        for (const auto& s : segments) {
+            const LiveSegment* sp = &s;
+            group.run([&, sp] {
+                if (!copyRange(inFile.fd(), sp->start, outFile.fd(), sp->newStart, sp->end - sp->start))
+                    ok = false;
+            });
+        }
+    }
+
+    auto patch64 = [&](int64_t oldField, int64_t value) {
+        char b[8];
+        writeInt64LE(b, value);
+        if (!outFile.write(b, 8, live.map(oldField))) ok = false;
+    };
+    {
+        TaskGroup group;
+        for (size_t i = 0; i < records.size(); i++) {
+            group.run([&, i] {
+                MatrixRecord& m = records[i];
+                for (auto& z : m.resolutions)
+                    for (auto& b : z.blocks) b.position = live.map(b.position);
+                std::vector<char> rec;
+                appendMatrixRecord(rec, m);
+                if (rec.size() != (size_t)master[i].size ||
+                    !outFile.write(rec.data(), rec.size(), live.map(master[i].position))) ok = false;
+            });
+        }
+        group.run([&] {
+            std::vector<int64_t> fields;
+            int64_t end;
+            if (nviPos > 0 && !scanNormVectorIndex(inFile, nviPos, h.version, fields, end)) ok = false;
+            for (size_t j = 0; j < fields.size() && j < norms.size(); j++)
+                patch64(fields[j], live.map(norms[j].position));
+        });
+        for (const auto& e : master) patch64(e.fieldOffset, live.map(e.position));
+        patch64(h.footerPosField, live.map(h.footerPos));
+        if (h.version > 8 && h.nviPos > 0) patch64(h.nviPosField, live.map(h.nviPos));
+    }
+    if (!ok || !outFile.datasync() || !outFile.close()) {
+        std::cerr << "Error: writing " << outPath << " failed" << std::endl;
+        if (inPlace) std::remove(outPath.c_str());
+        return 1;
+    }
+    if (inPlace && std::rename(outPath.c_str(), inPath.c_str()) != 0) {
+        std::cerr << "Error: cannot replace " << inPath << ": " << std::strerror(errno) << std::endl;
+        std::remove(outPath.c_str());
+        return 1;
+    }
+    std::cout << "Compacted " << (inPlace ? inPath : outPath) << " to " << liveBytes << " bytes.\n";
+    return 0;
+}
+
+static int runCompact(int argc, char** argv) {
+    bool inPlace = false, dryRun = false;
+    std::vector<std::string> args;
+    for (int i = 2; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--in-place") inPlace = true;
+        else if (a == "--dry-run") dryRun = true;
+        else args.push_back(a);
+    }
+    if (args.size() != (inPlace || dryRun ? 1u : 2u)) {
+        std::cerr << "Usage: " << argv[0] << " compact <in.hic> <out.hic>\n"
+                  << "       " << argv[0] << " compact --in-place|--dry-run <file.hic>\n";
+        return 1;
+    }
+    return compactHic(args[0], inPlace || dryRun ? std::string() : args[1], inPlace, dryRun);
+}
+
+// --- retile ---
+//
+// Changes the block granularity of bp resolutions. Every (matrix,
+// resolution) being retiled is a pool task that decodes its blocks and
+// regroups the cells under the new blockBinCount (blockColumnCount follows
+// as in pre) with writeBlocks. The new blocks and records are appended to a
+// staging copy with a new footer, as append-contacts does, and compact then
+// drops the old blocks and relocates everything after them into the output.
+
+// "N" for every bp resolution, or "binSize=N,..." per resolution.
+static bool parseBlockBins(const std::string& s, int32_t& all, std::map<int32_t, int32_t>& per) {
+    std::stringstream ss(s);
+    std::string part;
+    while (std::getline(ss, part, ',')) {
+        size_t eq = part.find('=');
+        char* end;
+        long v = std::strtol(part.c_str() + (eq == std::string::npos ? 0 : eq + 1), &end, 10);
+        if (*end || v <= 0 || v > (1 << 20)) return false;
+        if (eq == std::string::npos) {
+            all = (int32_t)v;
+            continue;
+        }
+        long res = std::strtol(part.substr(0, eq).c_str(), &end, 10);
+        if (*end || res <= 0) return false;
+        per[(int32_t)res] = (int32_t)v;
+    }
+    return true;
+}
+
+static int runRetile(int argc, char** argv) {
+    int32_t allBins = 0;
+    std::map<int32_t, int32_t> perRes;
+    std::vector<std::string> args;
+    for (int i = 2; i < argc; i++) {
+        std::string a = argv[i];
+        if ((a == "-b" || a == "--block-bins") && i + 1 < argc) {
+            if (!parseBlockBins(argv[++i], allBins, perRes)) {
+                std::cerr << "Error: bad block size list: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (a == "--threads" && i + 1 < argc) {
+            g_poolThreads = std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            args.push_back(a);
+        }
+    }
+    if (args.size() != 2 || (allBins == 0 && perRes.empty())) {
+        std::cerr << "Usage: " << argv[0] << " retile -b N|binSize=N,... [--threads N] <in.hic> <out.hic>\n";
+        return 1;
+    }
+    const std::string inPath = args[0], outPath = args[1];
+
+    HicFile inFile;
+    if (!inFile.open(inPath)) {
+        std::cerr << "Error: cannot open input file: " << inPath << std::endl;
+        return 1;
+    }
+    HicHeader h;
+    if (!parseHicHeader(inFile, inPath, h)) return 1;
+    std::vector<MasterEntry> master;
+    int64_t masterEnd;
+    if (!scanMasterIndex(inFile, h.footerPos, h.version, master, masterEnd)) {
+        std::cerr << "Error: cannot read master index of " << inPath << std::endl;
+        return 1;
+    }
+    for (const auto& kv : perRes) {
+        if (std::find(h.bpResolutions.begin(), h.bpResolutions.end(), kv.first) == h.bpResolutions.end()) {
+            std::cerr << "Error: " << inPath << " has no " << kv.first << " bp resolution" << std::endl;
+            return 1;
+        }
+    }
+    auto blockBinsFor = [&](int32_t binSize) {
+        auto it = perRes.find(binSize);
+        return it != perRes.end() ? it->second : allBins;
+    };
+
+    std::string stagePath = outPath + ".tmp." + std::to_string(getpid());
+    OutputSink sink;
+    int64_t oldSize = inFile.size();
+    if (!sink.file.open(stagePath, O_RDWR | O_CREAT | O_TRUNC) ||
+        !copyRange(inFile.fd(), 0, sink.file.fd(), 0, oldSize)) {
+        std::cerr << "Error: cannot stage " << inPath << " in " << stagePath << std::endl;
+        std::remove(stagePath.c_str());
+        return 1;
+    }
+    sink.cursor = (uint64_t)oldSize;
+
+    std::vector<MatrixRecord> records(master.size());
+    std::vector<char> changed(master.size(), 0);
+    std::atomic<bool> ok(true);
+    std::atomic<int64_t> oldBlocks(0), newBlocks(0);
+    {
+        TaskGroup group;
+        for (size_t i = 0; i < master.size(); i++) {
+            group.run([&, i] {
+                MatrixRecord& m = records[i];
+                if (!readMatrixRecord(inFile, master[i].position, m)) { ok = false; return; }
+                bool intra = m.chr1 == m.chr2;
+                for (auto& z : m.resolutions) {
+                    int32_t bbc = z.unit == "BP" ? blockBinsFor(z.binSize) : 0;
+                    if (bbc == 0 || bbc == z.blockBinCount) continue;
+                    changed[i] = 1;
+                    ResolutionRecord* zp = &z;
+                    const MatrixRecord* mp = &m;
+                    group.run([&, zp, mp, bbc, intra] {
+                        ResolutionRecord& z = *zp;
+                        std::vector<ContactCell> cells;
+                        DecodedBlock block;
+                        DecodeScratch scratch;
+                        for (const auto& b : z.blocks) {
+                            if (!readBlock(inFile, h.version, b, block, scratch)) { ok = false; return; }
+                            for (size_t k = 0; k < block.size(); k++) {
+                                ContactCell c = {block.binX[k], block.binY[k], block.counts[k]};
+                                cells.push_back(c);
+                            }
+                        }
+                        int64_t nBins = 0;
+                        for (const auto& c : cells) nBins = std::max<int64_t>(nBins, std::max(c.binX, c.binY) + 1);
+                        int32_t c1 = mp->chr1, c2 = mp->chr2;
+                        if (c1 >= 0 && c2 >= 0 && c1 < (int32_t)h.chrLengths.size() && c2 < (int32_t)h.chrLengths.size())
+                            nBins = std::max(nBins, std::max(h.chrLengths[c1], h.chrLengths[c2]) / z.binSize + 1);
+                        oldBlocks += (int64_t)z.blocks.size();
+                        z.blockBinCount = bbc;
+                        z.blockColumnCount = (int32_t)(nBins / bbc + 1);
+                        if (!writeBlocks(cells, h.version, intra, z, sink)) ok = false;
+                        newBlocks += (int64_t)z.blocks.size();
+                    });
+                }
+            });
+        }
+    }
+    if (!ok) {
+        std::cerr << "Error: re-encoding blocks of " << inPath << " failed" << std::endl;
+        std::remove(stagePath.c_str());
+        return 1;
+    }
+    size_t retiled = 0;
+    for (size_t i = 0; i < master.size(); i++) {
+        if (!changed[i]) continue;
+        std::vector<char> rec;
+        appendMatrixRecord(rec, records[i]);
+        master[i].position = (int64_t)sink.append(rec);
+        master[i].size = (int32_t)rec.size();
+        retiled++;
+    }
+    if (!publishFooter(inFile, h, inPath, stagePath, masterEnd, master, sink)) {
+        std::remove(stagePath.c_str());
+        return 1;
+    }
+    std::cout << "Retiled " << retiled << " matrices: " << oldBlocks << " blocks became " << newBlocks << ".\n";
+    int status = compactHic(stagePath, outPath, false, false);
+    std::remove(stagePath.c_str());
+    return status;
+}
+
+// --- coarsen ---
+//
+// Adds bp resolutions that are integer multiples of existing ones without
+// rerunning pre. Each matrix is a pool task: for every new resolution it
+// decodes the finest existing resolution that divides it, sums cells into
+// the coarser grid and encodes them with writeBlocks. The records (now with
+// the extra sections and renumbered resIdx), expected values and, with
+// --norm, coverage vectors and their normalized expected values are
+// appended to a staging copy behind a new footer; the staging copy is then
+// relocated behind a header whose resolution list includes the new sizes.
+// Only the replaced records and footer are left dead; compact reclaims them.
+
+// Coverage normalization of one intra-chromosomal matrix: row sums of the
+// symmetric matrix (square-rooted for VC_SQRT), scaled so the normalized
+// matrix keeps the raw total. Empty rows are NaN.
+static std::vector<double> coverageVector(const std::vector<ContactCell>& cells, int64_t nBins, bool sqrtRows) {
+    std::vector<double> v((size_t)nBins, 0.0);
+    for (const auto& c : cells) {
+        v[c.binX] += c.count;
+        if (c.binX != c.binY) v[c.binY] += c.count;
+    }
+    for (auto& x : v) x = x > 0 ? (sqrtRows ? std::sqrt(x) : x) : NAN;
+    double raw = 0, norm = 0;
+    for (const auto& c : cells) {
+        double w = c.binX != c.binY ? 2 : 1;
+        double n = c.count / (v[c.binX] * v[c.binY]);
+        if (!std::isfinite(n)) continue;
+        raw += w * c.count;
+        norm += w * n;
+    }
+    double scale = raw > 0 && norm > 0 ? std::sqrt(norm / raw) : 1.0;
+    for (auto& x : v) x *= scale;
+    return v;
+}
+
+struct CoarsenNorm {
+    std::string type;
+    int32_t chrIdx, binSize;
+    std::vector<double> values;
+};
+
+static int runCoarsen(int argc, char** argv) {
+    std::set<int32_t> wanted;
+    std::set<std::string> normTypes;
+    std::vector<std::string> args;
+    for (int i = 2; i < argc; i++) {
+        std::string a = argv[i];
+        if ((a == "-r" || a == "--resolutions") && i + 1 < argc) {
+            if (!parseIntList(argv[++i], wanted)) {
+                std::cerr << "Error: bad resolution list: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (a == "--norm" && i + 1 < argc) {
+            normTypes.insert(argv[++i]);
+        } else if (a == "--threads" && i + 1 < argc) {
+            g_poolThreads = std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            args.push_back(a);
+        }
+    }
+    bool normsOk = true;
+    for (const auto& t : normTypes) normsOk = normsOk && (t == "VC" || t == "VC_SQRT");
+    if (args.size() != 2 || wanted.empty() || !normsOk) {
+        std::cerr << "Usage: " << argv[0]
+                  << " coarsen -r res1,res2,... [--norm VC|VC_SQRT]... [--threads N] <in.hic> <out.hic>\n";
+        return 1;
+    }
+    const std::string inPath = args[0], outPath = args[1];
+
+    HicFile inFile;
+    if (!inFile.open(inPath)) {
+        std::cerr << "Error: cannot open input file: " << inPath << std::endl;
+        return 1;
+    }
+    HicHeader h;
+    if (!parseHicHeader(inFile, inPath, h)) return 1;
+    std::vector<MasterEntry> master;
+    int64_t masterEnd, expectedEnd, tailEnd;
+    if (!scanMasterIndex(inFile, h.footerPos, h.version, master, masterEnd) ||
+        !scanFooterEnd(inFile, h.version, masterEnd, expectedEnd, tailEnd)) {
+        std::cerr << "Error: cannot read footer of " << inPath << std::endl;
+        return 1;
+    }
+    HicReader footerReader(inFile, expectedEnd);
+    skipExpectedValues(footerReader, h.version, true);
+    int64_t normExpectedEnd = footerReader.tell();
+    int64_t nviPos = locateNormVectorIndex(inFile, h, masterEnd, 0);
+    std::vector<NormVectorEntry> oldNorms;
+    if (nviPos > 0 && !readNormVectorIndex(inFile, nviPos, h.version, oldNorms)) {
+        std::cerr << "Error: cannot read normalization-vector index of " << inPath << std::endl;
+        return 1;
+    }
+
+    // Source of each new resolution: the finest existing one dividing it.
+    std::map<int32_t, int32_t> sourceOf;
+    for (int32_t r : wanted) {
+        if (std::find(h.bpResolutions.begin(), h.bpResolutions.end(), r) != h.bpResolutions.end()) {
+            std::cerr << "Error: " << inPath << " already has a " << r << " bp resolution" << std::endl;
+            return 1;
+        }
+        for (int32_t s : h.bpResolutions)
+            if (r % s == 0 && (!sourceOf.count(r) || s > sourceOf[r])) sourceOf[r] = s;
+        if (!sourceOf.count(r)) {
+            std::cerr << "Error: " << r << " is not a multiple of any resolution of " << inPath << std::endl;
+            return 1;
+        }
+    }
+    std::vector<int32_t> bpList(h.bpResolutions);
+    bpList.insert(bpList.end(), wanted.begin(), wanted.end());
+    std::sort(bpList.begin(), bpList.end(), std::greater<int32_t>());
+    std::map<int32_t, int32_t> resIdxOf;
+    for (size_t i = 0; i < bpList.size(); i++) resIdxOf[bpList[i]] = (int32_t)i;
+
+    PreOptions opt;
+    opt.chrLengths = h.chrLengths;
+    opt.resolutions.assign(wanted.begin(), wanted.end());
+    ExpectedAccumulator acc;
+    acc.distanceSums.resize(opt.resolutions.size());
+    acc.chrTotals.resize(opt.resolutions.size());
+    std::map<std::string, ExpectedAccumulator> normAcc;
+    for (const auto& t : normTypes) {
+        normAcc[t].distanceSums.resize(opt.resolutions.size());
+        normAcc[t].chrTotals.resize(opt.resolutions.size());
+    }
+    std::mutex normMu;
+    std::vector<CoarsenNorm> newNorms;
+
+    std::string stagePath = outPath + ".tmp." + std::to_string(getpid());
+    OutputSink sink;
+    int64_t oldSize = inFile.size();
+    if (!sink.file.open(stagePath, O_RDWR | O_CREAT | O_TRUNC) ||
+        !copyRange(inFile.fd(), 0, sink.file.fd(), 0, oldSize)) {
+        std::cerr << "Error: cannot stage " << inPath << " in " << stagePath << std::endl;
+        std::remove(stagePath.c_str());
+        return 1;
+    }
+    sink.cursor = (uint64_t)oldSize;
+
+    std::vector<MatrixRecord> records(master.size());
+    std::atomic<bool> ok(true);
+    {
+        TaskGroup group;
+        for (size_t i = 0; i < master.size(); i++) {
+            group.run([&, i] {
+                MatrixRecord& m = records[i];
+                if (!readMatrixRecord(inFile, master[i].position, m)) { ok = false; return; }
+                if (m.chr1 <= 0 || m.chr2 <= 0) return;           // the All matrix has its own scale
+                bool intra = m.chr1 == m.chr2;
+                for (size_t r = 0; r < opt.resolutions.size(); r++) {
+                    int32_t res = opt.resolutions[r];
+                    const ResolutionRecord* src = nullptr;
+                    for (const auto& zz : m.resolutions)
+                        if (zz.unit == "BP" && zz.binSize == sourceOf.at(res)) src = &zz;
+                    if (!src) continue;
+                    int32_t k = res / src->binSize;
+                    CellMap merged;
+                    DecodedBlock block;
+                    DecodeScratch scratch;
+                    for (const auto& b : src->blocks) {
+                        if (!readBlock(inFile, h.version, b, block, scratch)) { ok = false; return; }
+                        for (size_t c = 0; c < block.size(); c++)
+                            merged[packBins(block.binX[c] / k, block.binY[c] / k)] += block.counts[c];
+                    }
+                    ResolutionRecord z;
+                    z.unit = "BP";
+                    z.resIdx = resIdxOf.at(res);
+                    z.binSize = res;
+                    int64_t nBins = std::max(h.chrLengths[m.chr1], h.chrLengths[m.chr2]) / res + 1;
+                    z.blockBinCount = PRE_BLOCK_BIN_COUNT;
+                    z.blockColumnCount = (int32_t)(nBins / PRE_BLOCK_BIN_COUNT + 1);
+                    std::vector<ContactCell> cells;
+                    std::vector<float> counts;
+                    cells.reserve(merged.size());
+                    counts.reserve(merged.size());
+                    double sum = 0;
+                    std::vector<double> dist;
+                    for (const auto& kv : merged) {
+                        ContactCell cell = {(int32_t)(kv.first >> 32), (int32_t)(uint32_t)kv.first, kv.second};
+                        cells.push_back(cell);
+                        counts.push_back(cell.count);
+                        sum += cell.count;
+                        if (intra) {
+                            size_t d = (size_t)std::abs(cell.binY - cell.binX);
+                            if (dist.size() <= d) dist.resize(d + 1, 0.0);
+                            dist[d] += cell.count;
+                        }
+                    }
+                    CellMap().swap(merged);
+                    z.sumCounts = (float)sum;
+                    z.occupiedCellCount = (float)cells.size();
+                    countPercentiles(counts, z.percent5, z.percent95);
+
+                    if (intra) {
+                        {
+                            std::lock_guard<std::mutex> lk(acc.mu);
+                            std::vector<double>& total = acc.distanceSums[r];
+                            if (total.size() < dist.size()) total.resize(dist.size(), 0.0);
+                            for (size_t d = 0; d < dist.size(); d++) total[d] += dist[d];
+                            acc.chrTotals[r][m.chr1] += sum;
+                        }
+                        int64_t chrBins = h.chrLengths[m.chr1] / res + 1;
+                        for (const auto& t : normTypes) {
+                            CoarsenNorm n;
+                            n.type = t;
+                            n.chrIdx = m.chr1;
+                            n.binSize = res;
+                            n.values = coverageVector(cells, chrBins, t == "VC_SQRT");
+                            std::vector<double> ndist;
+                            double nsum = 0;
+                            for (const auto& c : cells) {
+                                double v = c.count / (n.values[c.binX] * n.values[c.binY]);
+                                if (!std::isfinite(v)) continue;
+                                size_t d = (size_t)std::abs(c.binY - c.binX);
+                                if (ndist.size() <= d) ndist.resize(d + 1, 0.0);
+                                ndist[d] += v;
+                                nsum += v;
+                            }
+                            std::lock_guard<std::mutex> lk(normMu);
+                            ExpectedAccumulator& na = normAcc.at(t);
+                            std::vector<double>& total = na.distanceSums[r];
+                            if (total.size() < ndist.size()) total.resize(ndist.size(), 0.0);
+                            for (size_t d = 0; d < ndist.size(); d++) total[d] += ndist[d];
+                            na.chrTotals[r][m.chr1] += nsum;
+                            newNorms.push_back(std::move(n));
+                        }
+                    }
+                    if (!writeBlocks(cells, h.version, intra, z, sink)) { ok = false; return; }
+                    m.resolutions.push_back(z);
+                }
+            });
+        }
+    }
+    if (!ok) {
+        std::cerr << "Error: aggregating matrices of " << inPath << " failed" << std::endl;
+        std::remove(stagePath.c_str());
+        return 1;
+    }
+
+    // Records with bp sections coarsest first, as in the header list.
+    for (size_t i = 0; i < master.size(); i++) {
+        MatrixRecord& m = records[i];
+        if (m.chr1 <= 0 || m.chr2 <= 0) continue;
+        for (auto& z : m.resolutions)
+            if (z.unit == "BP" && resIdxOf.count(z.binSize)) z.resIdx = resIdxOf[z.binSize];
+        std::stable_sort(m.resolutions.begin(), m.resolutions.end(),
+                         [](const ResolutionRecord& a, const ResolutionRecord& b) {
+                             if ((a.unit == "BP") != (b.unit == "BP")) return a.unit == "BP";
+                             return a.unit == "BP" && a.binSize > b.binSize;
+                         });
+        std::vector<char> rec;
+        appendMatrixRecord(rec, m);
+        master[i].position = (int64_t)sink.append(rec);
+        master[i].size = (int32_t)rec.size();
+    }
+
+    // New vectors, in the layout of the file's version.
+    std::sort(newNorms.begin(), newNorms.end(), [](const CoarsenNorm& a, const CoarsenNorm& b) {
+        if (a.type != b.type) return a.type < b.type;
+        if (a.binSize != b.binSize) return a.binSize > b.binSize;
+        return a.chrIdx < b.chrIdx;
+    });
+    std::vector<char> nviEntries;
+    for (const auto& n : newNorms) {
+        std::vector<char> data;
+        if (h.version > 8) appendInt64(data, (int64_t)n.values.size());
+        else appendInt32(data, (int32_t)n.values.size());
+        for (double v : n.values) {
+            if (h.version > 8) appendFloat(data, (float)v);
+            else appendDouble(data, v);
+        }
+        appendString(nviEntries, n.type);
+        appendInt32(nviEntries, n.chrIdx);
+        appendString(nviEntries, "BP");
+        appendInt32(nviEntries, n.binSize);
+        appendInt64(nviEntries, (int64_t)sink.append(data));
+        if (h.version > 8) appendInt64(nviEntries, (int64_t)data.size());
+        else appendInt32(nviEntries, (int32_t)data.size());
+    }
+
+    // Footer: master index, then each old section with its count bumped and
+    // the new entries after the old ones.
+    auto extendSection = [&](std::vector<char>& out, int64_t start, int64_t end,
+                             const std::vector<char>& extra, int32_t extraCount) {
+        std::vector<char> old((size_t)(end - start));
+        if (end > start && !inFile.read(old.data(), old.size(), start)) return false;
+        int32_t n = old.size() >= 4 ? readInt32LE(old.data()) : 0;
+        appendInt32(out, n + extraCount);
+        if (old.size() > 4) out.insert(out.end(), old.begin() + 4, old.end());
+        out.insert(out.end(), extra.begin(), extra.end());
+        return true;
+    };
+    std::vector<char> expected, normExpected;
+    appendExpectedValues(expected, opt, acc, h.version);
+    for (const auto& t : normTypes) {
+        std::vector<char> part;
+        appendExpectedValues(part, opt, normAcc[t], h.version, t);
+        normExpected.insert(normExpected.end(), part.begin() + 4, part.end());
+    }
+    std::vector<char> footer;
+    if (h.version > 8) appendInt64(footer, 0);
+    else appendInt32(footer, 0);
+    appendInt32(footer, (int32_t)master.size());
+    for (const auto& e : master) {
+        appendString(footer, e.key);
+        appendInt64(footer, e.position);
+        appendInt32(footer, e.size);
+    }
+    bool footerOk =
+        extendSection(footer, masterEnd, expectedEnd, std::vector<char>(expected.begin() + 4, expected.end()),
+                      (int32_t)opt.resolutions.size());
+    int64_t nBytes = (int64_t)footer.size() - (h.version > 8 ? 8 : 4);
+    if (h.version > 8) writeInt64LE(footer.data(), nBytes);
+    else writeInt32LE(footer.data(), (int32_t)nBytes);
+    footerOk = footerOk && extendSection(footer, expectedEnd, normExpectedEnd, normExpected,
+                                         (int32_t)(normTypes.size() * opt.resolutions.size()));
+    size_t nviOffset = footer.size();
+    int64_t oldNviEnd = 0;
+    std::vector<int64_t> nviFields;
+    if (nviPos > 0 && !scanNormVectorIndex(inFile, nviPos, h.version, nviFields, oldNviEnd)) footerOk = false;
+    if (nviPos > 0 || !newNorms.empty())
+        footerOk = footerOk && extendSection(footer, nviPos, nviPos > 0 ? oldNviEnd : nviPos,
+                                             nviEntries, (int32_t)newNorms.size());
+    if (!footerOk) {
+        std::cerr << "Error: cannot read footer of " << inPath << std::endl;
+        std::remove(stagePath.c_str());
+        return 1;
+    }
+    uint64_t footerPos = sink.append(footer);
+    char field[8];
+    writeInt64LE(field, (int64_t)footerPos);
+    sink.write(field, 8, h.footerPosField);
+    if (h.version > 8) {
+        bool hasNvi = footer.size() > nviOffset;
+        writeInt64LE(field, hasNvi ? (int64_t)(footerPos + nviOffset) : 0);
+        sink.write(field, 8, h.nviPosField);
+        writeInt64LE(field, hasNvi ? (int64_t)(footer.size() - nviOffset) : 0);
+        sink.write(field, 8, h.nviPosField + 8);
+    }
+    if (!sink.ok || !sink.file.close()) {
+        std::cerr << "Error: writing " << stagePath << " failed" << std::endl;
+        std::remove(stagePath.c_str());
+        return 1;
+    }
+
+    // Relocate the staging copy behind the header with the new list.
+    HicFile stage;
+    HicHeader sh;
+    if (!stage.open(stagePath) || !parseHicHeader(stage, stagePath, sh, true)) {
+        std::remove(stagePath.c_str());
+        return 1;
+    }
+    std::vector<char> resolutions;
+    appendInt32(resolutions, (int32_t)bpList.size());
+    for (int32_t r : bpList) appendInt32(resolutions, r);
+    resolutions.insert(resolutions.end(), sh.resolutionBuf.begin() + 4 + 4 * sh.bpResolutions.size(),
+                       sh.resolutionBuf.end());
+    sh.resolutionBuf.swap(resolutions);
+    int64_t delta = 0;
+    bool relocated = writeRelocated(stage, sh, buildHeader(sh, sh.attrs, sh.chrDictBuf), outPath, delta);
+    stage.close();
+    std::remove(stagePath.c_str());
+    if (!relocated) return 1;
+
+    std::cout << "Added " << opt.resolutions.size() << " resolution(s) to " << outPath;
+    if (!newNorms.empty()) std::cout << " with " << newNorms.size() << " normalization vectors";
+    std::cout << ".\n";
+    return 0;
+}
+
+// --- checksum and scrub ---
+//
+// `checksum` walks the master index and block indices like compact does and
+// writes a text sidecar (file.hic.xxh64 by default) with an XXH64 of every
+// region: the header with any restriction-site arrays, the footer, the v9
+// normalization-vector index, each matrix record, block and norm vector.
+// `scrub` re-reads the listed ranges on the pool, at most --rate MB/s in
+// total, and reports the chromosome pairs and resolutions with bad blocks.
+// It trusts only the sidecar, so a damaged footer does not hide anything.
+
+// Shared byte-rate cap: each caller reserves its slot in a virtual
+// timeline and sleeps until it comes up.
+class RateLimiter {
+public:
+    explicit RateLimiter(double bytesPerSecond)
+        : rate_(bytesPerSecond), next_(std::chrono::steady_clock::now()) {}
+
+    void acquire(int64_t bytes) {
+        if (rate_ <= 0) return;
+        std::chrono::steady_clock::time_point at;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            auto now = std::chrono::steady_clock::now();
+            if (next_ < now) next_ = now;
+            at = next_;
+            next_ += std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>((double)bytes / rate_));
+        }
+        std::this_thread::sleep_until(at);
+    }
+
+private:
+    double rate_;
+    std::mutex mu_;
+    std::chrono::steady_clock::time_point next_;
+};
+
+// One checksummed range. `what` is header, footer, nvi, record, block or
+// norm; `label` names the matrix/resolution or vector it belongs to.
+struct ChecksumItem {
+    std::string what, label;
+    int64_t position, size;
+    uint64_t hash;
+};
+
+static int runChecksum(int argc, char** argv) {
+    if (argc != 3 && argc != 4) {
+        std::cerr << "Usage: " << argv[0] << " checksum <file.hic> [sidecar]\n";
+        return 1;
+    }
+    const std::string path = argv[2];
+    const std::string sidecar = argc == 4 ? argv[3] : path + ".xxh64";
+    HicFile f;
+    if (!f.openRead(path)) {
+        std::cerr << "Error: cannot open input file: " << path << std::endl;
+        return 1;
+    }
+    HicHeader h;
+    if (!parseHicHeader(f, path, h)) return 1;
+
+    std::vector<ChecksumItem> items;
+    auto add = [&](const std::string& what, const std::string& label, int64_t pos, int64_t size) {
+        ChecksumItem it = {what, label, pos, size, 0};
+        items.push_back(it);
+    };
+    std::vector<MasterEntry> master;
+    int64_t masterEnd, expectedEnd, footerEnd;
+    if (!scanMasterIndex(f, h.footerPos, h.version, master, masterEnd) ||
+        !scanFooterEnd(f, h.version, masterEnd, expectedEnd, footerEnd)) {
+        std::cerr << "Error: cannot read footer of " << path << std::endl;
+        return 1;
+    }
+    add("header", "-", 0, (int64_t)h.dataStart);
+    add("footer", "-", h.footerPos, footerEnd - h.footerPos);
+    if (h.version > 8 && h.nviPos > 0) add("nvi", "-", h.nviPos, h.nviLen);
+
+    std::vector<MatrixRecord> records(master.size());
+    std::atomic<bool> ok(true);
+    {
+        TaskGroup group;
+        for (size_t i = 0; i < master.size(); i++) {
+            group.run([&, i] {
+                if (!readMatrixRecord(f, master[i].position, records[i])) ok = false;
+            });
+        }
+    }
+    if (!ok) {
+        std::cerr << "Error: cannot read matrix records of " << path << std::endl;
+        return 1;
+    }
+    for (size_t i = 0; i < master.size(); i++) {
+        add("record", master[i].key, master[i].position, master[i].size);
+        for (const auto& z : records[i].resolutions) {
+            std::string label = master[i].key + ":" + z.unit + ":" + std::to_string(z.binSize);
+            for (const auto& b : z.blocks) add("block", label + ":" + std::to_string(b.number), b.position, b.size);
+        }
+    }
+    int64_t nviPos = locateNormVectorIndex(f, h, masterEnd, 0);
+    std::vector<NormVectorEntry> norms;
+    if (nviPos > 0 && !readNormVectorIndex(f, nviPos, h.version, norms)) {
+        std::cerr << "Error: cannot read normalization-vector index of " << path << std::endl;
+        return 1;
+    }
+    for (const auto& e : norms)
+        add("norm", e.type + ":" + std::to_string(e.chrIdx) + ":" + e.unit + ":" + std::to_string(e.binSize),
+            e.position, e.size);
+
+    {
+        TaskGroup group;
+        for (size_t i = 0; i < items.size(); i++) {
+            group.run([&, i] {
+                if (!hashRange(f, items[i].position, items[i].size, items[i].hash)) ok = false;
+            });
+        }
+    }
+    if (!ok) {
+        std::cerr << "Error: reading " << path << " failed" << std::endl;
+        return 1;
+    }
+
+    std::ofstream out(sidecar);
+    out << "# xxh64 " << f.size() << " " << path << "\n";
+    char hex[17];
+    for (const auto& it : items) {
+        std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)it.hash);
+        out << it.what << '\t' << it.label << '\t' << it.position << '\t' << it.size << '\t' << hex << '\n';
+    }
+    if (!out.flush()) {
+        std::cerr << "Error: cannot write " << sidecar << std::endl;
+        return 1;
+    }
+    std::cout << "Wrote " << items.size() << " checksums to " << sidecar << ".\n";
+    return 0;
+}
+
+static int runScrub(int argc, char** argv) {
+    double rateMb = 0;
+    std::vector<std::string> args;
+    for (int i = 2; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--rate" && i + 1 < argc) rateMb = std::atof(argv[++i]);
+        else if (a == "--threads" && i + 1 < argc) g_poolThreads = std::strtoul(argv[++i], nullptr, 10);
+        else args.push_back(a);
+    }
+    if (args.size() != 1 && args.size() != 2) {
+        std::cerr << "Usage: " << argv[0] << " scrub [--rate MB/s] [--threads N] <file.hic> [sidecar]\n";
+        return 1;
+    }
+    const std::string path = args[0];
+    const std::string sidecar = args.size() == 2 ? args[1] : path + ".xxh64";
+    std::ifstream in(sidecar);
+    if (!in) {
+        std::cerr << "Error: cannot open checksum file: " << sidecar << std::endl;
+        return 1;
+    }
+    std::vector<ChecksumItem> items;
+    int64_t recordedSize = -1;
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.compare(0, 8, "# xxh64 ") == 0) {
+            recordedSize = std::atoll(line.c_str() + 8);
+            continue;
+        }
+        if (line.empty() || line[0] == '#') continue;
+        std::istringstream ss(line);
+        ChecksumItem it;
+        std::string hex;
+        if (!(ss >> it.what >> it.label >> it.position >> it.size >> hex)) {
+            std::cerr << "Error: bad line in " << sidecar << ": " << line << std::endl;
+            return 1;
+        }
+        it.hash = std::strtoull(hex.c_str(), nullptr, 16);
+        items.push_back(it);
+    }
+
+    HicFile f;
+    if (!f.openRead(path)) {
+        std::cerr << "Error: cannot open input file: " << path << std::endl;
+        return 1;
+    }
+    // Names for the report, if the header is still readable.
+    HicHeader h;
+    bool named = parseHicHeader(f, path, h, true);
+    auto pairName = [&](const std::string& key) {
+        int c1 = -1, c2 = -1;
+        if (!named || std::sscanf(key.c_str(), "%d_%d", &c1, &c2) != 2 || c1 < 0 || c2 < 0 ||
+            c1 >= (int)h.chrNames.size() || c2 >= (int)h.chrNames.size())
+            return key;
+        return h.chrNames[c1] + "-" + h.chrNames[c2];
+    };
+
+    RateLimiter limiter(rateMb * 1024 * 1024);
+    std::vector<char> bad(items.size(), 0);
+    std::atomic<int64_t> bytes(0);
+    auto t0 = std::chrono::steady_clock::now();
+    {
+        TaskGroup group;
+        for (size_t i = 0; i < items.size(); i++) {
+            group.run([&, i] {
+                limiter.acquire(items[i].size);
+                uint64_t hash;
+                if (!hashRange(f, items[i].position, items[i].size, hash) || hash != items[i].hash) bad[i] = 1;
+                bytes += items[i].size;
+            });
+        }
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    // Bad blocks by chromosome pair and resolution; other regions one by one.
+    std::map<std::string, std::pair<int64_t, int64_t> > blocks;   // label -> (bad, total)
+    std::vector<std::string> regions;
+    int64_t nBad = 0;
+    for (size_t i = 0; i < items.size(); i++) {
+        const ChecksumItem& it = items[i];
+        if (it.what == "block") {
+            std::string key = it.label.substr(0, it.label.find(':'));
+            std::string rest = it.label.substr(key.size() + 1);
+            std::string group = pairName(key) + " " + rest.substr(0, rest.rfind(':'));
+            auto& g = blocks[group];
+            g.second++;
+            if (bad[i]) g.first++;
+        } else if (bad[i]) {
+            std::string label = it.what == "record" ? pairName(it.label) : it.label;
+            regions.push_back(it.what + " " + label + " at " + std::to_string(it.position) + "+" +
+                              std::to_string(it.size));
+        }
+        nBad += bad[i];
+    }
+    std::cout << path << ": checked " << items.size() << " regions, " << bytes << " bytes in " << secs << " s";
+    if (recordedSize >= 0 && recordedSize != f.size())
+        std::cout << " (file size " << f.size() << ", was " << recordedSize << ")";
+    std::cout << ".\n";
+    for (const auto& r : regions) std::cout << "  BAD " << r << "\n";
+    for (const auto& g : blocks)
+        if (g.second.first) std::cout << "  BAD " << g.first << ": " << g.second.first << " of " << g.second.second << " blocks\n";
+    if (nBad) {
+        std::cout << nBad << " region(s) failed verification.\n";
+        return 1;
+    }
+    std::cout << "All checksums match.\n";
+    return 0;
+}
+
+// --- inspect ---
+//
+// Summary of a map from its header, master index and normalization-vector
+// index only. On a seekable archive that decodes just the metadata frames.
+
+static int runInspect(int argc, char** argv) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " inspect <file.hic|file.hic.zst>\n";
+        return 1;
+    }
+    const std::string path = argv[2];
+    HicFile f;
+    if (!f.openRead(path)) {
+        std::cerr << "Error: cannot open input file: " << path << std::endl;
+        return 1;
+    }
+    HicMetadata meta;
+    if (!loadMetadata(f, path, meta, true)) return 1;
+    const HicHeader& h = meta.h;
+    const std::vector<MasterEntry>& master = meta.master;
+    const std::vector<NormVectorEntry>& norms = meta.norms;
+
+    std::cout << path << ": .hic v" << h.version << ", " << f.size() << " bytes\n";
+    std::cout << "  attributes:";
+    for (const auto& a : h.attrs) std::cout << " " << a.key << "(" << a.value.size() << ")";
+    std::cout << "\n  chromosomes: " << h.chrNames.size() << "\n  bp resolutions:";
+    for (int32_t r : h.bpResolutions) std::cout << " " << r;
+    std::cout << "\n  fragment resolutions:";
+    for (int32_t r : h.fragResolutions) std::cout << " " << r;
+    if (!h.sites.empty()) {
+        int64_t nSites = 0;
+        for (const auto& s : h.sites) nSites += s.count;
+        std::cout << "\n  restriction sites: " << nSites << " (" << ((int64_t)h.dataStart - h.sitesStart) << " bytes)";
+    }
+    std::cout << "\n  matrices: " << master.size() << "\n  footer at " << h.footerPos << "\n";
+    std::map<std::string, int> normTypes;
+    for (const auto& e : norms) normTypes[e.type]++;
+    std::cout << "  normalization vectors: " << norms.size();
+    for (const auto& t : normTypes) std::cout << " " << t.first << "(" << t.second << ")";
+    std::cout << "\n";
+    if (const SeekableArchive* a = f.archive())
+        std::cout << "  seekable archive: decoded " << a->framesDecoded() << " of "
+                  << a->frameCount() << " frames\n";
+    if (meta.cached) std::cout << "  metadata: from cache\n";
+    return 0;
+}
+
+// --- query ---
+//
+// Region queries in the style of straw: contacts of one chromosome pair at
+// one bp resolution inside a rectangle, optionally normalized and, with
+// --oe, divided by the expected count at their distance. With "-"
+// queries are read one per line from stdin, as a viewer panning and zooming
+// would issue them. The blocks a query needs are found from the block grid
+// (blockBinCount x blockColumnCount, or v9's diagonal layout for intra
+// matrices). When reading from stdin, once a query's blocks are decoded the
+// prefetcher hints the neighbouring blocks along the diagonal and the
+// covering blocks one zoom level finer, so the next pan or zoom finds them
+// in the page cache (or, on a seekable archive, already decoded).
+
+struct QueryRegion {
+    int32_t chr;
+    int64_t start, end;                   // bp, end exclusive
+};
+
+static bool parseRegion(const HicHeader& h, const std::string& s, QueryRegion& r) {
+    size_t colon = s.find(':');
+    std::string name = s.substr(0, colon);
+    r.chr = -1;
+    for (size_t c = 0; c < h.chrNames.size(); c++)
+        if (h.chrNames[c] == name) r.chr = (int32_t)c;
+    if (r.chr < 0) return false;
+    r.start = 0;
+    r.end = h.chrLengths[r.chr];
+    if (colon != std::string::npos) {
+        std::string range = s.substr(colon + 1);
+        range.erase(std::remove(range.begin(), range.end(), ','), range.end());
+        size_t dash = range.find('-');
+        if (dash == std::string::npos) return false;
+        r.start = std::atoll(range.substr(0, dash).c_str());
+        r.end = std::atoll(range.substr(dash + 1).c_str());
+    }
+    return r.start >= 0 && r.end > r.start;
+}
+
+// Block numbers that may hold cells in bins [x1, x2] x [y1, y2].
+static void blocksForRegion(int32_t version, bool intra, const ResolutionRecord& z,
+                            int64_t x1, int64_t x2, int64_t y1, int64_t y2, std::set<int32_t>& out) {
+    int64_t bbc = z.blockBinCount, bcc = z.blockColumnCount;
+    if (version > 8 && intra) {
+        int64_t padLo = (x1 + y1) / 2 / bbc, padHi = (x2 + y2) / 2 / bbc + 1;
+        auto depthOf = [&](int64_t d) { return (int64_t)std::log2(1 + std::abs((double)d) / std::sqrt(2.0) / bbc); };
+        int64_t nearer = std::min(depthOf(x1 - y2), depthOf(x2 - y1));
+        int64_t further = std::max(depthOf(x1 - y2), depthOf(x2 - y1)) + 1;
+        if ((x1 > y2) != (x2 > y1)) nearer = 0;   // rectangle crosses the diagonal
+        for (int64_t d = nearer; d <= further; d++)
+            for (int64_t p = padLo; p <= padHi; p++) out.insert((int32_t)(d * bcc + p));
+        return;
+    }
+    for (int64_t r = y1 / bbc; r <= y2 / bbc; r++)
+        for (int64_t c = x1 / bbc; c <= x2 / bbc; c++) out.insert((int32_t)(r * bcc + c));
+    if (intra) {
+        for (int64_t r = x1 / bbc; r <= x2 / bbc; r++)
+            for (int64_t c = y1 / bbc; c <= y2 / bbc; c++) out.insert((int32_t)(r * bcc + c));
+    }
+}
+
+// Issues read-ahead hints for blocks a viewer is likely to ask for next,
+// at most once per block.
+class BlockPrefetcher {
+public:
+    explicit BlockPrefetcher(const HicFile& f) : f_(f), hinted_(0) {}
+
+    void hint(const ResolutionRecord& z, const std::unordered_map<int32_t, size_t>& index,
+              const std::set<int32_t>& numbers) {
+        for (int32_t n : numbers) {
+            auto it = index.find(n);
+            if (it == index.end() || !seen_.insert(std::make_pair(&z, n)).second) continue;
+            const BlockIndexEntry& b = z.blocks[it->second];
+            f_.prefetch(b.position, b.size);
+            hinted_++;
+        }
+    }
+
+    int64_t hinted() const { return hinted_; }
+
+private:
+    const HicFile& f_;
+    std::set<std::pair<const ResolutionRecord*, int32_t> > seen_;
+    int64_t hinted_;
+};
+
+struct QueryMatrix {
+    MatrixRecord record;
+    std::vector<std::unordered_map<int32_t, size_t> > index;   // per resolution: number -> slot
+};
+
+static int runQuery(int argc, char** argv) {
+    std::string norm = "NONE";
+    bool oe = false;
+    std::vector<std::string> args;
+    for (int i = 2; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--norm" && i + 1 < argc) norm = argv[++i];
+        else if (a == "--oe") oe = true;
+        else if (a == "--threads" && i + 1 < argc) g_poolThreads = std::strtoul(argv[++i], nullptr, 10);
+        else args.push_back(a);
+    }
+    bool fromStdin = args.size() == 2 && args[1] == "-";
+    if (!fromStdin && args.size() != 4) {
+        std::cerr << "Usage: " << argv[0] << " query [--norm TYPE] [--oe] <file.hic> <binSize> <chr1[:start-end]> <chr2[:start-end]>\n"
+                  << "       " << argv[0] << " query [--norm TYPE] [--oe] <file.hic> -   (one \"binSize region1 region2\" per line)\n";
+        return 1;
+    }
+    const std::string path = args[0];
+    HicFile f;
+    if (!f.openRead(path)) {
+        std::cerr << "Error: cannot open input file: " << path << std::endl;
+        return 1;
+    }
+    HicMetadata meta;
+    if (!loadMetadata(f, path, meta, norm != "NONE")) return 1;
+    const HicHeader& h = meta.h;
+    std::map<std::string, const MasterEntry*> byKey;
+    for (const auto& e : meta.master) byKey[e.key] = &e;
+    const std::vector<NormVectorEntry>& nvi = meta.norms;
+    if (norm != "NONE" && meta.nviPos == 0) {
+        std::cerr << "Error: " << path << " has no normalization vectors" << std::endl;
+        return 1;
+    }
+
+    std::map<std::string, QueryMatrix> matrices;
+    std::map<std::pair<int32_t, int32_t>, std::vector<double> > normCache;
+    BlockPrefetcher prefetcher(f);
+    int64_t blocksRead = 0;
+
+    auto normVector = [&](int32_t chr, int32_t binSize) -> const std::vector<double>* {
+        auto key = std::make_pair(chr, binSize);
+        auto it = normCache.find(key);
+        if (it != normCache.end()) return &it->second;
+        for (const auto& e : nvi) {
+            if (e.type == norm && e.chrIdx == chr && e.unit == "BP" && e.binSize == binSize) {
+                std::vector<double>& v = normCache[key];
+                if (!readNormVector(f, h.version, e, v)) return nullptr;
+                return &v;
+            }
+        }
+        return nullptr;
+    };
+
+    // Expected values for an intra-chromosomal matrix, divided by the
+    // chromosome's factor as straw does.
+    std::map<std::pair<int32_t, int32_t>, std::vector<double> > expectedCache;
+    auto expectedVector = [&](int32_t chr, int32_t binSize) -> const std::vector<double>* {
+        auto key = std::make_pair(chr, binSize);
+        auto it = expectedCache.find(key);
+        if (it != expectedCache.end()) return &it->second;
+        ExpectedValues e;
+        if (!readExpectedValues(f, h.version, meta.masterEnd, norm, "BP", binSize, e) || e.values.empty())
+            return nullptr;
+        auto factor = e.factors.find(chr);
+        if (factor != e.factors.end())
+            for (double& v : e.values) v /= factor->second;
+        return &(expectedCache[key] = std::move(e.values));
+    };
+
+    auto runOne = [&](int32_t binSize, QueryRegion r1, QueryRegion r2) -> bool {
+        if (r1.chr > r2.chr) std::swap(r1, r2);
+        std::string key = std::to_string(r1.chr) + "_" + std::to_string(r2.chr);
+        auto me = byKey.find(key);
+        if (me == byKey.end()) return true;             // no contacts between them
+        QueryMatrix& qm = matrices[key];
+        if (qm.record.resolutions.empty()) {
+            if (!readMatrixRecord(f, me->second->position, qm.record)) return false;
+            for (const auto& z : qm.record.resolutions) {
+                qm.index.emplace_back();
+                for (size_t b = 0; b < z.blocks.size(); b++) qm.index.back()[z.blocks[b].number] = b;
+            }
+        }
+        // This resolution and the next finer one.
+        int zi = -1, finer = -1;
+        for (size_t i = 0; i < qm.record.resolutions.size(); i++) {
+            const ResolutionRecord& z = qm.record.resolutions[i];
+            if (z.unit != "BP") continue;
+            if (z.binSize == binSize) zi = (int)i;
+            else if (z.binSize < binSize && (finer < 0 || z.binSize > qm.record.resolutions[finer].binSize))
+                finer = (int)i;
+        }
+        if (zi < 0) {
+            std::cerr << "Error: no " << binSize << " bp resolution for " << key << std::endl;
+            return false;
+        }
+        const ResolutionRecord& z = qm.record.resolutions[zi];
+        bool intra = r1.chr == r2.chr;
+        int64_t x1 = r1.start / binSize, x2 = (r1.end - 1) / binSize;
+        int64_t y1 = r2.start / binSize, y2 = (r2.end - 1) / binSize;
+        std::set<int32_t> wanted;
+        blocksForRegion(h.version, intra, z, x1, x2, y1, y2, wanted);
+
+        // Decode the wanted blocks in parallel.
+        std::vector<const BlockIndexEntry*> blocks;
+        for (int32_t n : wanted) {
+            auto it = qm.index[zi].find(n);
+            if (it != qm.index[zi].end()) blocks.push_back(&z.blocks[it->second]);
+        }
+        std::vector<DecodedBlock> decoded(blocks.size());
+        std::atomic<bool> ok(true);
+        {
+            TaskGroup group;
+            for (size_t i = 0; i < blocks.size(); i++) {
+                group.run([&, i] {
+                    DecodeScratch scratch;
+                    if (!readBlock(f, h.version, *blocks[i], decoded[i], scratch)) ok = false;
+                });
+            }
+        }
+        if (!ok) return false;
+        blocksRead += (int64_t)blocks.size();
+
+        // Once the wanted blocks are in, hint the neighbours one block span
+        // away in every direction (pans, and the next stretch along the
+        // diagonal) and the finer zoom level. Only a stream of queries can
+        // use them, and hinting earlier would compete with the demand reads.
+        if (fromStdin) {
+            int64_t span = z.blockBinCount;
+            std::set<int32_t> around;
+            blocksForRegion(h.version, intra, z, std::max<int64_t>(0, x1 - span), x2 + span,
+                            std::max<int64_t>(0, y1 - span), y2 + span, around);
+            for (int32_t n : wanted) around.erase(n);
+            prefetcher.hint(z, qm.index[zi], around);
+            if (finer >= 0) {
+                const ResolutionRecord& zf = qm.record.resolutions[finer];
+                int64_t k = binSize / zf.binSize;
+                std::set<int32_t> zoom;
+                blocksForRegion(h.version, intra, zf, x1 * k, (x2 + 1) * k - 1, y1 * k, (y2 + 1) * k - 1, zoom);
+                prefetcher.hint(zf, qm.index[finer], zoom);
+            }
+        }
+
+        const std::vector<double>* n1 = nullptr;
+        const std::vector<double>* n2 = nullptr;
+        if (norm != "NONE" && (!(n1 = normVector(r1.chr, binSize)) || !(n2 = normVector(r2.chr, binSize)))) {
+            std::cerr << "Error: no " << norm << " vector at " << binSize << " bp for " << key << std::endl;
+            return false;
+        }
+        NormTables t = {n1 ? n1->data() : nullptr, n1 ? n1->size() : 0,
+                        n2 ? n2->data() : nullptr, n2 ? n2->size() : 0, nullptr, 0};
+        double avgCount = 0;
+        if (oe && intra) {
+            const std::vector<double>* e = expectedVector(r1.chr, binSize);
+            if (!e) {
+                std::cerr << "Error: no " << norm << " expected values at " << binSize << " bp" << std::endl;
+                return false;
+            }
+            t.expected = e->data();
+            t.nExpected = e->size();
+        } else if (oe) {
+            // Inter-chromosomal matrices have no expected vector: straw
+            // uses the mean count over the cells of the matrix.
+            double bins1 = (double)((h.chrLengths[r1.chr] + binSize - 1) / binSize);
+            double bins2 = (double)((h.chrLengths[r2.chr] + binSize - 1) / binSize);
+            avgCount = z.sumCounts / bins1 / bins2;
+            t.expected = &avgCount;
+            t.nExpected = 1;
+        }
+        std::ostringstream out;
+        std::vector<double> normalized;
+        for (const auto& d : decoded) {
+            if (n1 || oe) normalizeBlock(t, d, normalized);
+            for (size_t i = 0; i < d.size(); i++) {
+                int64_t x = d.binX[i], y = d.binY[i];
+                bool inside = (x >= x1 && x <= x2 && y >= y1 && y <= y2) ||
+                              (intra && y >= x1 && y <= x2 && x >= y1 && x <= y2);
+                if (!inside) continue;
+                double v = d.counts[i];
+                if (n1 || oe) {
+                    v = normalized[i];
+                    if (!std::isfinite(v)) continue;
+                }
+                out << x * binSize << '\t' << y * binSize << '\t' << v << '\n';
+            }
+        }
+        std::cout << out.str();
+        return true;
+    };
+
+    auto parseQuery = [&](const std::vector<std::string>& q) -> bool {
+        QueryRegion r1, r2;
+        int32_t binSize = std::atoi(q[0].c_str());
+        if (binSize <= 0 || !parseRegion(h, q[1], r1) || !parseRegion(h, q[2], r2)) {
+            std::cerr << "Error: bad query: " << q[0] << " " << q[1] << " " << q[2] << std::endl;
+            return false;
+        }
+        return runOne(binSize, r1, r2);
+    };
+
+    if (!fromStdin) return parseQuery(std::vector<std::string>(args.begin() + 1, args.end())) ? 0 : 1;
+    std::string line;
+    int failures = 0;
+    while (std::getline(std::cin, line)) {
+        std::istringstream ss(line);
+        std::vector<std::string> q;
+        std::string tok;
+        while (ss >> tok) q.push_back(tok);
+        if (q.empty() || q[0][0] == '#') continue;
+        std::cout << "# " << line << "\n";
+        if (q.size() != 3 || !parseQuery(q)) failures++;
+    }
+    std::cerr << "Read " << blocksRead << " blocks, prefetched " << prefetcher.hinted() << ", "
+              << decodePoolStats().allocations << " buffer allocations.\n";
+    return failures ? 1 : 0;
+}
+
+// --- Durable output: group commit ---
+//
+// Outputs are written to "<out>.tmp.<pid>" and handed to a background
+// committer. Once a group is full (or the producer goes quiet) the committer
+// makes the whole group durable with one syncfs() per filesystem, renames
+// every file into place, then fsyncs each parent directory once. A crash
+// therefore leaves either the old output or a complete new one, and the cost
+// is one sync per group rather than one fsync per file.
+
+struct PendingCommit {
+    std::string tmpPath, finalPath;
+};
+
+class GroupCommitter {
+public:
+    explicit GroupCommitter(size_t groupSize)
+        : groupSize_(groupSize ? groupSize : 1), done_(false), failures_(0),
+          worker_(&GroupCommitter::run, this) {}
+
+    ~GroupCommitter() { finish(); }
+
+    void submit(const std::string& tmpPath, const std::string& finalPath) {
+        std::lock_guard<std::mutex> lk(mu_);
+        pending_.push_back({tmpPath, finalPath});
+        if (pending_.size() >= groupSize_) cv_.notify_one();
+    }
+
+    // Flush whatever is pending and join the committer; returns the number
+    // of files that could not be made durable.
+    int finish() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            if (done_) return failures_;
+            done_ = true;
+        }
+        cv_.notify_one();
+        worker_.join();
+        return failures_;
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lk(mu_);
+        while (true) {
+            // Wait for a full group, a quiet period, or shutdown.
+            cv_.wait_for(lk, std::chrono::milliseconds(200), [this] {
+                return done_ || pending_.size() >= groupSize_;
+            });
+            if (pending_.empty()) {
+                if (done_) return;
+                continue;
+            }
+            std::vector<PendingCommit> group;
+            while (!pending_.empty() && group.size() < groupSize_) {
+                group.push_back(pending_.front());
+                pending_.pop_front();
+            }
+            lk.unlock();
+            int bad = commitGroup(group);
+            lk.lock();
+            failures_ += bad;
+        }
+    }
+
+    static int commitGroup(const std::vector<PendingCommit>& group) {
+        int bad = 0;
+        std::vector<bool> ok(group.size(), true);
+
+        // One syncfs per filesystem; fall back to fdatasync per file where
+        // syncfs is unavailable.
+        std::set<dev_t> synced;
+        for (size_t i = 0; i < group.size(); i++) {
+            struct stat st;
+            if (stat(group[i].tmpPath.c_str(), &st) != 0) {
+                std::cerr << "Error: lost temp output " << group[i].tmpPath << std::endl;
+                ok[i] = false;
+                continue;
+            }
+            if (synced.count(st.st_dev)) continue;
+            int fd = open(group[i].tmpPath.c_str(), O_RDONLY);
+            if (fd < 0) { ok[i] = false; continue; }
+            if (syncfs(fd) == 0) {
+                synced.insert(st.st_dev);
+            } else if (fdatasync(fd) != 0) {
+                ok[i] = false;
+            }
+            close(fd);
+        }
+        for (size_t i = 0; i < group.size(); i++) {
+            if (!ok[i]) continue;
+            struct stat st;
+            if (stat(group[i].tmpPath.c_str(), &st) == 0 && synced.count(st.st_dev)) continue;
+            int fd = open(group[i].tmpPath.c_str(), O_RDONLY);
+            if (fd < 0 || fdatasync(fd) != 0) ok[i] = false;
+            if (fd >= 0) close(fd);
+        }
+
+        // Rename into place, then persist the directory entries.
+        std::set<std::string> dirs;
+        for (size_t i = 0; i < group.size(); i++) {
+            if (ok[i] && std::rename(group[i].tmpPath.c_str(), group[i].finalPath.c_str()) != 0)
+                ok[i] = false;
+            if (ok[i]) {
+                dirs.insert(parentDir(group[i].finalPath));
+            } else {
+                std::cerr << "Error: could not commit " << group[i].finalPath
+                          << ": " << std::strerror(errno) << std::endl;
+                std::remove(group[i].tmpPath.c_str());
+                bad++;
+            }
+        }
+        for (const auto& d : dirs) {
+            int fd = open(d.c_str(), O_RDONLY | O_DIRECTORY);
+            if (fd < 0) continue;
+            if (fsync(fd) != 0)
+                std::cerr << "Warning: fsync failed on directory " << d << std::endl;
+            close(fd);
+        }
+        return bad;
+    }
+
+    size_t groupSize_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<PendingCommit> pending_;
+    bool done_;
+    int failures_;
+    std::thread worker_;
+};
+
+// --- Batch mode ---
+
+struct BatchJob {
+    std::string inPath, outPath, statFile, graphFile;
+};
+
+// The same file under any spelling: its device and inode if it exists, else
+// its resolved directory and name.
+static std::string fileIdentity(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0)
+        return std::to_string((unsigned long long)st.st_dev) + ":" + std::to_string((unsigned long long)st.st_ino);
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    char* resolved = realpath(dir.c_str(), nullptr);
+    if (!resolved) return path;
+    std::string id = std::string(resolved) + "/" + path.substr(slash == std::string::npos ? 0 : slash + 1);
+    std::free(resolved);
+    return id;
+}
+
+// Reads the manifest. Two lines naming the same output (however spelled)
+// are rejected: their jobs would race on one file.
+static bool loadManifest(const std::string& path, std::vector<BatchJob>& jobs) {
+    std::ifstream fm(path);
+    if (!fm) {
+        std::cerr << "Error: cannot open manifest: " << path << std::endl;
+        return false;
+    }
+    std::map<std::string, int> outputs;       // identity -> line
+    std::string line;
+    int lineNo = 0;
+    while (std::getline(fm, line)) {
+        lineNo++;
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#') continue;
+        std::istringstream ss(line);
+        BatchJob job;
+        std::string extra;
+        if (!(ss >> job.inPath >> job.outPath >> job.statFile >> job.graphFile) || (ss >> extra)) {
+            std::cerr << "Error: " << path << ":" << lineNo
+                      << ": expected <in.hic> <out.hic> <statistics.txt> <graphs.txt>\n";
+            return false;
+        }
+        auto seen = outputs.insert(std::make_pair(fileIdentity(job.outPath), lineNo));
+        if (!seen.second) {
+            std::cerr << "Error: " << path << ":" << lineNo << ": " << job.outPath
+                      << " is already written by line " << seen.first->second << std::endl;
+            return false;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+// AIMD control of batch concurrency (-j auto). Every second it reads the
+// copy engine's counters. It allows one more file and one more chunk per
+// file in flight unless that is congestion: the time per copied byte has
+// doubled from the best seen without throughput gaining, or throughput fell
+// well below its running average right after a raise. On congestion both
+// are halved. The best cost decays slowly, so storage that changes speed
+// is re-learned.
+class AimdController {
+public:
+    AimdController(std::function<void(unsigned)> setFiles, unsigned maxFiles)
+        : setFiles_(setFiles), maxFiles_(std::max(1u, maxFiles)), files_(std::max(1u, maxFiles / 4)),
+          depth_(2), bestCost_(0), avgThroughput_(0), raised_(false), done_(false) {
+        setFiles_(files_);
+        g_copyDepth = depth_.load();
+        worker_ = std::thread(&AimdController::run, this);
+    }
+    ~AimdController() { stop(); }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            if (done_) return;
+            done_ = true;
+        }
+        cv_.notify_one();
+        worker_.join();
+        g_copyDepth = 0;
+    }
+
+    unsigned files() const { return files_; }
+    unsigned depth() const { return depth_; }
+
+private:
+    static const unsigned MAX_DEPTH = 16;
+
+    void run() {
+        typedef std::chrono::steady_clock Clock;
+        int64_t lastBytes = g_copyStats.bytes, lastNanos = g_copyStats.nanos;
+        Clock::time_point last = Clock::now();
+        std::unique_lock<std::mutex> lk(mu_);
+        while (!cv_.wait_for(lk, std::chrono::seconds(1), [this] { return done_; })) {
+            int64_t bytes = g_copyStats.bytes, nanos = g_copyStats.nanos;
+            Clock::time_point now = Clock::now();
+            if (bytes - lastBytes < COPY_CHUNK) continue;     // too little copied to judge
+            double seconds = std::chrono::duration<double>(now - last).count();
+            double throughput = (bytes - lastBytes) / seconds;
+            double cost = (double)(nanos - lastNanos) / (bytes - lastBytes);
+            lastBytes = bytes;
+            lastNanos = nanos;
+            last = now;
+
+            bestCost_ = bestCost_ == 0 ? cost : std::min(cost, bestCost_ * 1.02);
+            bool congested = (cost > 2 * bestCost_ && throughput < 1.1 * avgThroughput_) ||
+                             (raised_ && throughput < 0.7 * avgThroughput_);
+            if (congested) {
+                files_ = std::max(1u, files_ / 2);
+                depth_ = std::max(1u, depth_ / 2);
+            } else {
+                files_ = std::min(maxFiles_, files_ + 1);
+                depth_ = std::min(depth_ + 1, (unsigned)MAX_DEPTH);
+            }
+            raised_ = !congested;
+            avgThroughput_ = avgThroughput_ == 0 ? throughput : 0.5 * (avgThroughput_ + throughput);
+            g_copyDepth = depth_.load();
+            setFiles_(files_);
+        }
+    }
+
+    std::function<void(unsigned)> setFiles_;
+    unsigned maxFiles_;
+    std::atomic<unsigned> files_, depth_;
+    double bestCost_, avgThroughput_;         // throughput: bytes/s, smoothed
+    bool raised_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    bool done_;
+    std::thread worker_;
+};
+
+// Runs header updates as tasks on the shared pool. At most maxInFlight
+// jobs are open at once (default: one per worker), so their copy chunks
+// still find idle workers; submit() blocks until a slot frees up. With
+// adaptive set, an AimdController moves that cap between 1 and twice the
+// worker count. With durable set, outputs go through the group committer.
+// An output that replaces its own input is written next to it and renamed
+// into place.
+class BatchRunner {
+public:
+    BatchRunner(unsigned maxInFlight, bool durable, size_t groupSize, bool adaptive = false)
+        : pool_(ThreadPool::shared()), group_(pool_), maxInFlight_(maxInFlight ? maxInFlight : pool_.size()),
+          inFlight_(0), failures_(0), tmpSeq_(0) {
+        if (durable) committer_.reset(new GroupCommitter(groupSize));
+        if (adaptive)
+            controller_.reset(new AimdController([this](unsigned n) { setLimit(n); }, 2 * pool_.size()));
+    }
+
+    void setLimit(unsigned n) {
+        std::lock_guard<std::mutex> lk(slotMu_);
+        maxInFlight_ = n;
+        slotCv_.notify_all();
+    }
+    const AimdController* controller() const { return controller_.get(); }
+
+    // done(ok) runs on the worker once the job has been written (for a
+    // durable job: handed to the committer).
+    void submit(const BatchJob& job, std::function<void(bool)> done = nullptr) {
+        {
+            std::unique_lock<std::mutex> lk(slotMu_);
+            slotCv_.wait(lk, [&] { return inFlight_ < maxInFlight_; });
+            inFlight_++;
+        }
+        group_.run([this, job, done] {
+            bool ok = runJob(job);
+            if (!ok) failures_++;
+            if (done) done(ok);
+            std::lock_guard<std::mutex> lk(slotMu_);
+            inFlight_--;
+            slotCv_.notify_one();
+        });
+    }
+
+    // Waits for every job and commit; returns the number of failures.
+    int finish() {
+        group_.wait();
+        if (controller_) controller_->stop();
+        if (committer_) failures_ += committer_->finish();
+        return failures_;
+    }
+
+private:
+    bool runJob(const BatchJob& job) {
+        std::vector<char> statVal, graphVal;
+        if (!load_value_file_text(job.statFile, statVal) || !load_value_file_text(job.graphFile, graphVal))
+            return false;
+        if (!committer_ && job.inPath != job.outPath)
+            return updateHicHeader(job.inPath, job.outPath, statVal, graphVal) == 0;
+        std::string tmpPath = job.outPath + ".tmp." + std::to_string(getpid()) + "." + std::to_string(tmpSeq_++);
+        if (updateHicHeader(job.inPath, tmpPath, statVal, graphVal, job.outPath) != 0) {
+            std::remove(tmpPath.c_str());
+            return false;
+        }
+        if (committer_) {
+            committer_->submit(tmpPath, job.outPath);
+            return true;
+        }
+        if (std::rename(tmpPath.c_str(), job.outPath.c_str()) != 0) {
+            std::cerr << "Error: could not replace " << job.outPath << ": " << std::strerror(errno) << std::endl;
+            std::remove(tmpPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    ThreadPool& pool_;
+    TaskGroup group_;
+    std::unique_ptr<GroupCommitter> committer_;
+    std::unique_ptr<AimdController> controller_;
+    unsigned maxInFlight_;
+    std::mutex slotMu_;
+    std::condition_variable slotCv_;
+    unsigned inFlight_;
+    std::atomic<int> failures_;
+    std::atomic<unsigned> tmpSeq_;            // keeps temporary names unique per job
+};
+
+static int runBatch(int argc, char** argv) {
+    bool durable = false, adaptive = false;
+    size_t groupSize = 16;
+    unsigned maxInFlight = 0;
+    std::string manifest;
+    for (int i = 2; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--durable") durable = true;
+        else if (a == "--group" && i + 1 < argc) groupSize = std::strtoul(argv[++i], nullptr, 10);
+        else if (a == "-j" && i + 1 < argc && std::string(argv[i + 1]) == "auto") { adaptive = true; i++; }
+        else if (a == "-j" && i + 1 < argc) maxInFlight = std::strtoul(argv[++i], nullptr, 10);
+        else if (a == "--threads" && i + 1 < argc) g_poolThreads = std::strtoul(argv[++i], nullptr, 10);
+        else if (a == "--numa") g_numa = true;
+        else if (a == "--max-memory" && i + 1 < argc) {
+            g_relocMemory = parseByteSize(argv[++i]);
+            if (g_relocMemory <= 0) {
+                std::cerr << "Error: bad memory size: " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        else if (manifest.empty()) manifest = a;
+        else { manifest.clear(); break; }
+    }
+    if (manifest.empty()) {
+        std::cerr << "Usage: " << argv[0]
+                  << " batch [--durable] [--group N] [-j N|auto] [--threads N] [--numa] [--max-memory SIZE] <manifest.txt>\n";
+        return 1;
+    }
+    std::vector<BatchJob> jobs;
+    if (!loadManifest(manifest, jobs)) return 1;
+
+    // Largest inputs first, so the longest copies do not start last.
+    std::vector<std::pair<int64_t, size_t> > order;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        struct stat st;
+        order.push_back(std::make_pair(stat(jobs[i].inPath.c_str(), &st) == 0 ? (int64_t)st.st_size : 0, i));
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [](const std::pair<int64_t, size_t>& a, const std::pair<int64_t, size_t>& b) {
+                         return a.first > b.first;
+                     });
+
+    BatchRunner runner(maxInFlight, durable, groupSize, adaptive);
+    for (const auto& o : order) runner.submit(jobs[o.second]);
+    int failures = runner.finish();
+    unsigned finalFiles = adaptive ? runner.controller()->files() : 0;
+    unsigned finalDepth = adaptive ? runner.controller()->depth() : 0;
+
+    std::cout << "Batch: " << (jobs.size() - failures) << " of " << jobs.size()
+              << " files updated" << (durable ? " (durable)" : "");
+    if (adaptive) std::cout << ", settled at -j " << finalFiles << " with " << finalDepth << " chunks per file";
+    std::cout << ".\n";
+    return failures ? 1 : 0;
+}
+
+// --- Watch mode ---
+//
+// Watches directory trees with inotify for statistics/graphs files dropped
+// next to maps: "<name>.statistics.txt" and "<name>.graphs.txt" beside
+// "<name>.hic" by default. A map is updated in place once both files exist
+// and neither has changed for the debounce interval, so a burst of edits
+// costs one rewrite; edits landing while a map is being rewritten queue one
+// more. Updates run through the batch engine. On start, and after an event
+// queue overflow, maps older than their sidecars are picked up by a scan.
+// Runs until SIGINT or SIGTERM, then finishes the updates in flight.
+
+static volatile sig_atomic_t g_watchStop = 0;
+
+static void onWatchSignal(int) { g_watchStop = 1; }
+
+class HeaderWatcher {
+public:
+    HeaderWatcher(BatchRunner& runner, int debounceMs, const std::string& statSuffix,
+                  const std::string& graphSuffix)
+        : runner_(runner), debounce_(debounceMs), statSuffix_(statSuffix), graphSuffix_(graphSuffix),
+          fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)), updated_(0) {}
+    ~HeaderWatcher() { if (fd_ >= 0) ::close(fd_); }
+
+    bool ok() const { return fd_ >= 0; }
+
+    // Watches dir and every directory below it; scan also queues the maps
+    // that are behind their sidecars.
+    bool addTree(const std::string& dir, bool scan) {
+        int wd = inotify_add_watch(fd_, dir.c_str(),
+                                   IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE_SELF | IN_ONLYDIR);
+        if (wd < 0) {
+            std::cerr << "Warning: cannot watch " << dir << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        dirs_[wd] = dir;
+        DIR* d = opendir(dir.c_str());
+        if (!d) return true;
+        std::vector<std::string> subdirs;
+        while (struct dirent* e = readdir(d)) {
+            std::string name = e->d_name;
+            if (name == "." || name == "..") continue;
+            if (e->d_type == DT_DIR) subdirs.push_back(dir + "/" + name);
+            else if (scan) consider(dir, name, true);
+        }
+        closedir(d);
+        for (const auto& sub : subdirs) addTree(sub, scan);
+        return true;
+    }
+
+    // Event loop; returns once stopped and every queued update is done.
+    void run() {
+        std::vector<char> buf(64 << 10);
+        while (!g_watchStop) {
+            struct pollfd pfd = {fd_, POLLIN, 0};
+            int rc = poll(&pfd, 1, nextTimeout());
+            if (rc > 0 && (pfd.revents & POLLIN)) drain(buf);
+            dispatchDue();
+        }
+        // Deadlines still pending were never confirmed quiet; the next scan
+        // picks them up.
+        runner_.finish();
+    }
+
+    int updated() const { return updated_; }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Pending {
+        Clock::time_point due;
+        int events;
+        bool running, again;
+    };
+
+    void drain(std::vector<char>& buf) {
+        while (true) {
+            ssize_t n = read(fd_, buf.data(), buf.size());
+            if (n <= 0) return;
+            for (char* p = buf.data(); p < buf.data() + n; ) {
+                const struct inotify_event* ev = (const struct inotify_event*)p;
+                p += sizeof(struct inotify_event) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    std::cerr << "Warning: inotify queue overflowed, rescanning" << std::endl;
+                    std::vector<std::string> watched;
+                    for (const auto& d : dirs_) watched.push_back(d.second);
+                    for (const auto& d : watched) scanDir(d);
+                    continue;
+                }
+                auto it = dirs_.find(ev->wd);
+                if (it == dirs_.end()) continue;
+                if (ev->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+                    dirs_.erase(it);
+                    continue;
+                }
+                if (ev->len == 0) continue;
+                std::string dir = it->second, name = ev->name;
+                if (ev->mask & IN_ISDIR) {
+                    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) addTree(dir + "/" + name, true);
+                } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                    consider(dir, name, false);
+                }
+            }
+        }
+    }
+
+    void scanDir(const std::string& dir) {
+        DIR* d = opendir(dir.c_str());
+        if (!d) return;
+        while (struct dirent* e = readdir(d)) {
+            if (e->d_type != DT_DIR) consider(dir, e->d_name, true);
+        }
+        closedir(d);
+    }
+
+    static bool endsWith(const std::string& s, const std::string& suffix) {
+        return s.size() > suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    // name changed in dir (or, with stale, exists there): queue its map
+    // when both sidecars are present, and with stale only when the map is
+    // older than one of them.
+    void consider(const std::string& dir, const std::string& name, bool stale) {
+        std::string base;
+        if (endsWith(name, statSuffix_)) base = name.substr(0, name.size() - statSuffix_.size());
+        else if (endsWith(name, graphSuffix_)) base = name.substr(0, name.size() - graphSuffix_.size());
+        else return;
+        BatchJob job;
+        job.inPath = job.outPath = dir + "/" + base + ".hic";
+        job.statFile = dir + "/" + base + statSuffix_;
+        job.graphFile = dir + "/" + base + graphSuffix_;
+        struct stat hs, ss, gs;
+        if (stat(job.inPath.c_str(), &hs) != 0 || stat(job.statFile.c_str(), &ss) != 0 ||
+            stat(job.graphFile.c_str(), &gs) != 0)
+            return;
+        if (stale && !newer(ss, hs) && !newer(gs, hs)) return;
+
+        std::lock_guard<std::mutex> lk(mu_);
+        Pending& p = pending_[job.inPath];
+        if (p.events == 0) jobs_[job.inPath] = job;
+        p.events++;
+        p.due = Clock::now() + std::chrono::milliseconds(debounce_);
+        if (p.running) p.again = true;
+    }
+
+    static bool newer(const struct stat& a, const struct stat& b) {
+        return a.st_mtim.tv_sec != b.st_mtim.tv_sec ? a.st_mtim.tv_sec > b.st_mtim.tv_sec
+                                                    : a.st_mtim.tv_nsec > b.st_mtim.tv_nsec;
+    }
+
+    int nextTimeout() {
+        std::lock_guard<std::mutex> lk(mu_);
+        Clock::time_point now = Clock::now(), next = now + std::chrono::seconds(1);
+        for (const auto& p : pending_) {
+            if (!p.second.running && p.second.due < next) next = std::max(now, p.second.due);
+        }
+        return (int)std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count() + 1;
+    }
+
+    // Hands every quiet map to the batch engine.
+    void dispatchDue() {
+        std::vector<std::pair<BatchJob, int> > ready;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            Clock::time_point now = Clock::now();
+            for (auto& p : pending_) {
+                if (p.second.running || p.second.due > now) continue;
+                p.second.running = true;
+                p.second.again = false;
+                ready.push_back(std::make_pair(jobs_[p.first], p.second.events));
+                p.second.events = 0;
+            }
+        }
+        for (const auto& r : ready) {
+            const std::string path = r.first.inPath;
+            int events = r.second;
+            runner_.submit(r.first, [this, path, events](bool ok) { finished(path, events, ok); });
+        }
+    }
+
+    void finished(const std::string& path, int events, bool ok) {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (ok) {
+            updated_++;
+            std::cout << "Watch: updated " << path << " (" << events << " change"
+                      << (events == 1 ? "" : "s") << ")" << std::endl;
+        }
+        auto it = pending_.find(path);
+        if (it == pending_.end()) return;
+        if (it->second.again) {
+            it->second.running = false;
+        } else {
+            pending_.erase(it);
+            jobs_.erase(path);
+        }
+    }
+
+    BatchRunner& runner_;
+    int debounce_;
+    std::string statSuffix_, graphSuffix_;
+    int fd_;
+    std::map<int, std::string> dirs_;
+    std::mutex mu_;
+    std::map<std::string, Pending> pending_;
+    std::map<std::string, BatchJob> jobs_;
+    int updated_;
+};
+
+static int runWatch(int argc, char** argv) {
+    bool durable = false, adaptive = false;
+    size_t groupSize = 16;
+    unsigned maxInFlight = 0;
+    int debounceMs = 2000;
+    std::string statSuffix = ".statistics.txt", graphSuffix = ".graphs.txt";
+    std::vector<std::string> dirs;
+    for (int i = 2; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--durable") durable = true;
+        else if (a == "--group" && i + 1 < argc) groupSize = std::strtoul(argv[++i], nullptr, 10);
+        else if (a == "-j" && i + 1 < argc && std::string(argv[i + 1]) == "auto") { adaptive = true; i++; }
+        else if (a == "-j" && i + 1 < argc) maxInFlight = std::strtoul(argv[++i], nullptr, 10);
+        else if (a == "--threads" && i + 1 < argc) g_poolThreads = std::strtoul(argv[++i], nullptr, 10);
+        else if (a == "--debounce" && i + 1 < argc) debounceMs = std::atoi(argv[++i]);
+        else if (a == "--stats-suffix" && i + 1 < argc) statSuffix = argv[++i];
+        else if (a == "--graphs-suffix" && i + 1 < argc) graphSuffix = argv[++i];
+        else dirs.push_back(a);
+    }
+    if (dirs.empty() || debounceMs < 0 || statSuffix.empty() || graphSuffix.empty() || statSuffix == graphSuffix) {
+        std::cerr << "Usage: " << argv[0]
+                  << " watch [--debounce MS] [--stats-suffix S] [--graphs-suffix S] [--durable] [--group N]"
+                     " [-j N|auto] [--threads N] <dir>...\n";
+        return 1;
+    }
+
+    BatchRunner runner(maxInFlight, durable, groupSize, adaptive);
+    HeaderWatcher watcher(runner, debounceMs, statSuffix, graphSuffix);
+    if (!watcher.ok()) {
+        std::cerr << "Error: inotify unavailable: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onWatchSignal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    for (auto& d : dirs) {
+        while (d.size() > 1 && d.back() == '/') d.pop_back();
+        if (!watcher.addTree(d, true)) return 1;
+    }
+    std::cout << "Watch: watching " << dirs.size() << " tree(s), debounce " << debounceMs << " ms." << std::endl;
+    watcher.run();
+    std::cout << "Watch: " << watcher.updated() << " update(s)." << std::endl;
+    return 0;
+}
+
+// --- Benchmarks ---
+
+static double secondsSince(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// bench copy: time the copy engine on a file copied to "<file>.benchcopy".
+static int benchCopy(const std::string& path, int repeat) {
+    int inFd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (inFd < 0 || fstat(inFd, &st) != 0) {
+        std::cerr << "Error: cannot open " << path << std::endl;
+        return 1;
+    }
+    std::string outPath = path + ".benchcopy";
+    int outFd = open(outPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outFd < 0) {
+        std::cerr << "Error: cannot create " << outPath << std::endl;
+        close(inFd);
+        return 1;
+    }
+    ThreadPool& pool = ThreadPool::shared();
+    std::cout << "copy: " << st.st_size << " bytes, " << pool.size() << " workers, "
+              << pool.nodeCount() << " NUMA node(s)\n";
+    int rc = 0;
+    for (int r = 0; r < repeat && rc == 0; r++) {
+        auto t0 = std::chrono::steady_clock::now();
+        if (ftruncate(outFd, st.st_size) != 0 || !copyRange(inFd, 0, outFd, 0, st.st_size)) rc = 1;
+        double sec = secondsSince(t0);
+        std::cout << "  run " << r + 1 << ": " << sec * 1e3 << " ms, "
+                  << (sec > 0 ? st.st_size / sec / 1e6 : 0) << " MB/s\n";
+    }
+    close(inFd);
+    close(outFd);
+    std::remove(outPath.c_str());
+    return rc;
+}
+
+// bench decode: decode every block of a .hic R times, one task per
+// resolution, and report each pass with the buffer pool's counters.
+static int benchDecode(const std::string& path, int repeat) {
+    HicFile f;
+    if (!f.openRead(path)) {
+        std::cerr << "Error: cannot open " << path << std::endl;
+        return 1;
+    }
+    HicMetadata meta;
+    if (!loadMetadata(f, path, meta, false)) return 1;
+    std::vector<MatrixRecord> records(meta.master.size());
+    int64_t nBlocks = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        if (!readMatrixRecord(f, meta.master[i].position, records[i])) {
+            std::cerr << "Error: cannot read matrix " << meta.master[i].key << std::endl;
+            return 1;
+        }
+        for (const auto& z : records[i].resolutions) nBlocks += (int64_t)z.blocks.size();
+    }
+    ThreadPool& pool = ThreadPool::shared();
+    std::cout << "decode: " << nBlocks << " blocks in " << records.size() << " matrices, "
+              << pool.size() << " workers\n";
+    for (int r = 0; r < repeat; r++) {
+        BufferPoolStats before = decodePoolStats();
+        std::atomic<int64_t> nRecords(0);
+        std::atomic<bool> ok(true);
+        auto t0 = std::chrono::steady_clock::now();
+        {
+            TaskGroup group(pool);
+            for (const auto& m : records) {
+                for (const auto& z : m.resolutions) {
+                    const ResolutionRecord* zp = &z;
+                    group.run([&, zp] {
+                        DecodedBlock block;
+                        DecodeScratch scratch;
+                        int64_t n = 0;
+                        for (const auto& b : zp->blocks) {
+                            if (!readBlock(f, meta.h.version, b, block, scratch)) ok = false;
+                            n += (int64_t)block.size();
+                        }
+                        nRecords += n;
+                    });
+                }
+            }
+        }
+        double sec = secondsSince(t0);
+        BufferPoolStats after = decodePoolStats();
+        std::cout << "  run " << r + 1 << ": " << sec * 1e3 << " ms, "
+                  << (sec > 0 ? nBlocks / sec : 0) << " blocks/s, "
+                  << (sec > 0 ? nRecords / sec / 1e6 : 0) << " M records/s; buffers: "
+                  << after.takes - before.takes << " taken, "
+                  << after.localHits - before.localHits << " from thread caches, "
+                  << after.sharedHits - before.sharedHits << " shared, "
+                  << after.allocations - before.allocations << " allocated\n";
+        if (!ok) {
+            std::cerr << "Error: decoding " << path << " failed" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// bench norm: run every normalization kernel the CPU supports on N
+// synthetic contacts, with and without O/E, and check each against the
+// scalar kernel bit for bit. A tenth of the norms are NaN or zero and some
+// bins fall outside the vectors, so the undefined cases are covered too.
+static int benchNorm(int64_t nRecords, int repeat) {
+    const size_t nBins = 1 << 16;
+    std::vector<double> norm(nBins), expected(nBins / 2);
+    std::vector<int32_t> x((size_t)nRecords), y((size_t)nRecords);
+    std::vector<float> counts((size_t)nRecords);
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    auto next = [&]() {
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        return seed;
+    };
+    for (size_t i = 0; i < nBins; i++) {
+        uint64_t r = next() % 20;
+        norm[i] = r == 0 ? NAN : r == 1 ? 0.0 : 0.5 + (double)(next() % 1000) / 1000;
+    }
+    for (size_t i = 0; i < expected.size(); i++) expected[i] = 100.0 / (1 + i);
+    for (size_t i = 0; i < counts.size(); i++) {
+        x[i] = (int32_t)(next() % (nBins + 64)) - 16;   // a few bins out of range either side
+        y[i] = (int32_t)(next() % (nBins + 64)) - 16;
+        counts[i] = (float)(1 + next() % 50);
+    }
+    std::vector<std::pair<const char*, NormKernel> > kernels = normKernels();
+    std::cout << "norm: " << nRecords << " contacts, kernels:";
+    for (const auto& k : kernels) std::cout << ' ' << k.first;
+    std::cout << "\n";
+    std::vector<double> want(counts.size()), got(counts.size());
+    int rc = 0;
+    for (int oe = 0; oe < 2; oe++) {
+        NormTables t = {norm.data(), nBins, norm.data(), nBins,
+                        oe ? expected.data() : nullptr, oe ? expected.size() : 0};
+        normalizeScalar(t, x.data(), y.data(), counts.data(), counts.size(), want.data());
+        for (const auto& k : kernels) {
+            double best = 0;
+            for (int r = 0; r < repeat; r++) {
+                auto t0 = std::chrono::steady_clock::now();
+                k.second(t, x.data(), y.data(), counts.data(), counts.size(), got.data());
+                double sec = secondsSince(t0);
+                if (r == 0 || sec < best) best = sec;
+            }
+            bool same = std::memcmp(want.data(), got.data(), want.size() * sizeof(double)) == 0;
+            std::cout << "  " << (oe ? "oe   " : "norm ") << k.first << ": "
+                      << (best > 0 ? nRecords / best / 1e6 : 0) << " M contacts/s"
+                      << (same ? "" : ", DIFFERS from scalar") << "\n";
+            if (!same) rc = 1;
+        }
+    }
+    return rc;
+}
+
+static int runBench(int argc, char** argv) {
+    std::string what = argc > 2 ? argv[2] : "";
+    int repeat = 3;
+    int64_t records = 1 << 24;
+    std::string file;
+    for (int i = 3; i < argc; i++) {
+        std::string a = argv[i];
+        if (a == "--threads" && i + 1 < argc) g_poolThreads = std::strtoul(argv[++i], nullptr, 10);
+        else if (a == "--numa") g_numa = true;
+        else if (a == "--repeat" && i + 1 < argc) repeat = std::atoi(argv[++i]);
+        else if (a == "--records" && i + 1 < argc) records = std::atoll(argv[++i]);
+        else file = a;
+    }
+    if (what == "copy" && !file.empty()) return benchCopy(file, repeat);
+    if (what == "decode" && !file.empty()) return benchDecode(file, repeat);
+    if (what == "norm" && records > 0) return benchNorm(records, repeat);
+    std::cerr << "Usage: " << argv[0] << " bench copy|decode [--threads N] [--numa] [--repeat R] <file>\n"
+              << "       " << argv[0] << " bench norm [--repeat R] [--records N]\n";
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 2 && std::string(argv[1]) == "batch")
+        return runBatch(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "watch")
+        return runWatch(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "bench")
+        return runBench(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "rename-chroms")
+        return runRenameChroms(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "export-csr")
+        return runExportCsr(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "export-tiles")
+        return runExportTiles(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "pre")
+        return runPre(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "append-contacts")
+        return runAppendContacts(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "rebuild-all")
+        return runRebuildAll(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "compact")
+        return runCompact(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "retile")
+        return runRetile(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "coarsen")
+        return runCoarsen(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "checksum")
+        return runChecksum(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "scrub")
+        return runScrub(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "inspect")
+        return runInspect(argc, argv);
+    if (argc >= 2 && std::string(argv[1]) == "query")
+        return runQuery(argc, argv);
+
+    if (argc >= 3 && std::string(argv[1]) == "--max-memory") {
+        g_relocMemory = parseByteSize(argv[2]);
+        if (g_relocMemory <= 0) {
+            std::cerr << "Error: bad memory size: " << argv[2] << std::endl;
+            return 1;
+        }
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc != 7) {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--max-memory SIZE] <in.hic> <out.hic> statistics <file1> graphs <file2>\n";
+        std::cerr << "       " << argv[0]
+                  << " batch [--durable] [--group N] [-j N|auto] [--threads N] [--numa] [--max-memory SIZE] <manifest.txt>\n";
+        std::cerr << "       " << argv[0]
+                  << " watch [--debounce MS] [--stats-suffix S] [--graphs-suffix S] [--durable] [-j N|auto] <dir>...\n";
+        std::cerr << "       " << argv[0]
+                  << " rename-chroms <in.hic> <out.hic>|--in-place <mapping.txt>\n";
+        std::cerr << "       " << argv[0]
+                  << " export-csr [-r res1,res2,...] [--norm TYPE]... <in.hic> <out.csr>\n";
+        std::cerr << "       " << argv[0]
+                  << " export-tiles [-r res1,res2,...] [--norm TYPE] [--tile-size N] [--float16] <in.hic> <out.tiles>\n";
+        std::cerr << "       " << argv[0]
+                  << " pre [-r res1,res2,...] [-q minMapq] [--max-memory SIZE] <in.pairs> <out.hic> <chrom.sizes>\n";
+        std::cerr << "       " << argv[0]
+                  << " append-contacts [-q minMapq] <in.hic> <new.pairs> <out.hic>|--in-place\n";
+        std::cerr << "       " << argv[0] << " rebuild-all <in.hic> <out.hic>|--in-place\n";
+        std::cerr << "       " << argv[0]
+                  << " compact <in.hic> <out.hic>|--in-place|--dry-run\n";
+        std::cerr << "       " << argv[0] << " retile -b N|binSize=N,... <in.hic> <out.hic>\n";
+        std::cerr << "       " << argv[0]
+                  << " coarsen -r res1,res2,... [--norm VC|VC_SQRT]... <in.hic> <out.hic>\n";
+        std::cerr << "       " << argv[0] << " checksum <file.hic> [sidecar]\n";
+        std::cerr << "       " << argv[0] << " scrub [--rate MB/s] [--threads N] <file.hic> [sidecar]\n";
+        std::cerr << "       " << argv[0] << " inspect <file.hic|file.hic.zst>\n";
+        std::cerr << "       " << argv[0]
+                  << " query [--norm TYPE] [--oe] <file.hic> <binSize> <chr1[:s-e]> <chr2[:s-e]>|-\n";
+        std::cerr << "  (Only 'statistics' and 'graphs' can be inserted in order after 'software'.)\n";
+        return 1;
+    }
+    const std::string inPath  = argv[1];
+    const std::string outPath = argv[2];
+
+    std::string statKey = argv[3], statFile = argv[4];
+    std::string graphKey = argv[5], graphFile = argv[6];
+    if (statKey != "statistics" || graphKey != "graphs") {
+        std::cerr << "Only 'statistics' and 'graphs' can be appended.\n";
+        return 1;
+    }
+
+    // Use Juicer-style text read for statistics/graphs
+    std::vector<char> statVal, graphVal;
+    if (!load_value_file_text(statFile, statVal) || !load_value_file_text(graphFile, graphVal))
+        return 1;
+
+    return updateHicHeader(inPath, outPath, statVal, graphVal);
+}